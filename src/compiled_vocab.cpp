@@ -0,0 +1,251 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#include "compiled_vocab.hpp"
+
+#include "third_party/utf8.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace utils {
+
+static constexpr size_t alignImageOffset(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+static std::string tokenUtf8(const std::vector<uint32_t> &word) {
+  static constexpr uint32_t kReplacementChar = 0xFFFD;
+  std::string bytes;
+  for (uint32_t code_point : word) {
+    vkcom::utf8_to_chars(vkcom::check_codepoint(code_point) ? code_point : kReplacementChar,
+                         std::back_inserter(bytes));
+  }
+  return bytes;
+}
+
+CompiledVocab::CompiledVocab(const WordPieceVocabulary &vocab) {
+  if (vocab.tokens.size() > static_cast<size_t>(INT32_MAX)) {
+    throw std::runtime_error("Vocab is too large");
+  }
+
+  size_t pool_size = 0;
+  size_t max_token_length = 0;
+  size_t table_count = 0;
+  // Matchable tokens are valid UTF-8, so their first code point fits in a key.
+  std::unordered_map<uint32_t, FirstLengths> first_lengths;
+  std::string utf8;
+  std::vector<uint32_t> utf8_offsets;
+  utf8_offsets.reserve(vocab.tokens.size());
+  for (const WordPieceToken &token : vocab.tokens) {
+    utf8_offsets.push_back(static_cast<uint32_t>(utf8.size()));
+    utf8 += tokenUtf8(token.word);
+    if (utf8.size() > UINT32_MAX) {
+      throw std::runtime_error("Vocab is too large");
+    }
+    pool_size += token.word.size();
+    if (!token.is_special && !token.is_malformed) {
+      max_token_length = std::max(max_token_length, token.word.size());
+      ++table_count;
+      const uint32_t key = token.word[0] * 2 + (token.is_prefix ? 1 : 0);
+      FirstLengths &lengths = first_lengths.try_emplace(key, FirstLengths{key, 0, 0}).first->second;
+      lengths.max_length = std::max(lengths.max_length, static_cast<uint32_t>(token.word.size()));
+      lengths.lengths
+       |= uint64_t{1} << (std::min(token.word.size(), FirstLengths::kLengthBits) - 1);
+    }
+  }
+  // Load factor is at most 1/2, so most probes finish in the first bucket.
+  size_t bucket_count = 1;
+  while (bucket_count * kBucketSlots < 2 * table_count) {
+    bucket_count *= 2;
+  }
+  size_t first_count = 1;
+  while (first_count < 2 * first_lengths.size()) {
+    first_count *= 2;
+  }
+
+  Header header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.token_count = static_cast<uint32_t>(vocab.tokens.size());
+  header.unk_token_id = vocab.unk_token_id;
+  header.max_token_length = static_cast<uint32_t>(max_token_length);
+  header.pool_size = pool_size;
+  header.bucket_count = bucket_count;
+  header.tokens_offset = alignImageOffset(sizeof(Header), kImageAlignment);
+  header.pool_offset = alignImageOffset(header.tokens_offset
+                                         + vocab.tokens.size() * sizeof(Token),
+                                        kImageAlignment);
+  header.utf8_offset
+   = alignImageOffset(header.pool_offset + pool_size * sizeof(uint32_t), kImageAlignment);
+  header.utf8_size = utf8.size();
+  header.table_offset = alignImageOffset(header.utf8_offset + utf8.size(), kImageAlignment);
+  header.first_count = first_count;
+  header.first_offset = header.table_offset + bucket_count * sizeof(Bucket);
+  header.image_size
+   = alignImageOffset(header.first_offset + first_count * sizeof(FirstLengths), kImageAlignment);
+  header.normalization = (vocab.normalization.clean_text ? kCleanText : 0)
+                       | (vocab.normalization.lower_case ? kLowerCase : 0)
+                       | (vocab.normalization.strip_accents ? kStripAccents : 0);
+
+  storage_.assign(header.image_size / sizeof(CacheLine), CacheLine{});
+  char *image = reinterpret_cast<char *>(storage_.data());
+  std::memcpy(image, &header, sizeof(header));
+
+  auto *tokens = reinterpret_cast<Token *>(image + header.tokens_offset);
+  auto *pool = reinterpret_cast<uint32_t *>(image + header.pool_offset);
+  auto *table = reinterpret_cast<Bucket *>(image + header.table_offset);
+  auto *first_table = reinterpret_cast<FirstLengths *>(image + header.first_offset);
+  std::memcpy(image + header.utf8_offset, utf8.data(), utf8.size());
+  std::fill(first_table, first_table + first_count, kNoLengths);
+  for (const auto &[key, lengths] : first_lengths) {
+    uint64_t index = hashStep(kHashSeed, key) & (first_count - 1);
+    while (first_table[index].key != kEmptyKey) {
+      index = (index + 1) & (first_count - 1);
+    }
+    first_table[index] = lengths;
+  }
+
+  uint32_t offset = 0;
+  for (size_t i = 0; i < vocab.tokens.size(); i++) {
+    const WordPieceToken &token = vocab.tokens[i];
+    uint32_t flags = 0;
+    flags |= token.is_prefix ? kPrefixToken : 0;
+    flags |= token.is_special ? kSpecialToken : 0;
+    flags |= token.is_malformed ? kMalformedToken : 0;
+    tokens[i] = Token{offset, static_cast<uint32_t>(token.word.size()), flags, utf8_offsets[i]};
+    std::copy(token.word.begin(), token.word.end(), pool + offset);
+    offset += static_cast<uint32_t>(token.word.size());
+
+    if (token.is_special || token.is_malformed) {
+      continue;
+    }
+    const uint64_t hash = hashWord(token.word.data(), token.word.size());
+    const uint32_t tag = makeTag(token.is_prefix, hash, token.word.size());
+    bool inserted = false;
+    for (uint64_t index = hash & (bucket_count - 1); !inserted;
+         index = (index + 1) & (bucket_count - 1)) {
+      Bucket &bucket = table[index];
+      for (size_t slot = 0; slot < kBucketSlots && !inserted; slot++) {
+        // The last duplicate wins.
+        if (bucket.tags[slot] == kEmptyTag
+            || (bucket.tags[slot] == tag
+                && std::equal(token.word.begin(),
+                              token.word.end(),
+                              pool + tokens[bucket.ids[slot]].offset))) {
+          bucket.tags[slot] = tag;
+          bucket.ids[slot] = static_cast<int32_t>(i);
+          inserted = true;
+        }
+      }
+    }
+  }
+
+  attach(image, header.image_size);
+}
+
+CompiledVocab CompiledVocab::fromFile(const std::string &file,
+                                      const word_piece::Normalization &normalization) {
+  if (isImage(file)) {
+    CompiledVocab vocab = loadImage(file);
+    if (!(vocab.normalization() == normalization)) {
+      throw std::runtime_error("Vocab image " + file + " was compiled with another normalization");
+    }
+    return vocab;
+  }
+  return CompiledVocab(readVocabFromFile(file, normalization));
+}
+
+CompiledVocab CompiledVocab::loadImage(const std::string &file) {
+  CompiledVocab vocab;
+  vocab.mmap_.open(file);
+  vocab.attach(vocab.mmap_.data(), vocab.mmap_.size());
+  return vocab;
+}
+
+bool CompiledVocab::isImage(const std::string &file) {
+  std::ifstream fin(file, std::ios::binary);
+  char magic[sizeof(kMagic)] = {};
+  fin.read(magic, sizeof(magic));
+  return fin.good() && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+void CompiledVocab::saveImage(const std::string &file) const {
+  std::ofstream fout(file, std::ios::binary);
+  fout.write(image_, static_cast<std::streamsize>(header_->image_size));
+  if (!fout) {
+    throw std::runtime_error("Cannot write vocab image to " + file);
+  }
+}
+
+void CompiledVocab::attach(const char *image, size_t image_size) {
+  if (image_size < sizeof(Header)) {
+    throw std::runtime_error("Vocab image is truncated");
+  }
+  const auto *header = reinterpret_cast<const Header *>(image);
+  if (std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+    throw std::runtime_error("Vocab image has wrong magic");
+  }
+  if (header->version != kVersion) {
+    throw std::runtime_error("Vocab image version " + std::to_string(header->version)
+                             + " is not supported, expected " + std::to_string(kVersion));
+  }
+  if (header->image_size != image_size
+      || header->tokens_offset + header->token_count * sizeof(Token) > header->pool_offset
+      || header->pool_offset + header->pool_size * sizeof(uint32_t) > header->utf8_offset
+      || header->utf8_offset + header->utf8_size > header->table_offset
+      || header->table_offset + header->bucket_count * sizeof(Bucket) > header->first_offset
+      || header->first_offset + header->first_count * sizeof(FirstLengths) > image_size
+      || header->table_offset % kImageAlignment != 0 || header->bucket_count == 0
+      || header->first_offset % alignof(FirstLengths) != 0 || header->first_count == 0
+      || (header->first_count & (header->first_count - 1)) != 0
+      || (header->normalization & ~(kCleanText | kLowerCase | kStripAccents)) != 0
+      || (header->bucket_count & (header->bucket_count - 1)) != 0) {
+    throw std::runtime_error("Vocab image is malformed");
+  }
+
+  image_ = image;
+  header_ = header;
+  tokens_ = reinterpret_cast<const Token *>(image + header->tokens_offset);
+  pool_ = reinterpret_cast<const uint32_t *>(image + header->pool_offset);
+  utf8_ = image + header->utf8_offset;
+  table_ = reinterpret_cast<const Bucket *>(image + header->table_offset);
+  first_table_ = reinterpret_cast<const FirstLengths *>(image + header->first_offset);
+
+  for (size_t i = 0; i < header->token_count; i++) {
+    const uint64_t utf8_end
+     = i + 1 < header->token_count ? tokens_[i + 1].utf8_offset : header->utf8_size;
+    if (static_cast<uint64_t>(tokens_[i].offset) + tokens_[i].length > header->pool_size
+        || tokens_[i].utf8_offset > utf8_end || utf8_end > header->utf8_size) {
+      throw std::runtime_error("Vocab image is malformed");
+    }
+  }
+  for (size_t index = 0; index < header->bucket_count; index++) {
+    for (size_t slot = 0; slot < kBucketSlots; slot++) {
+      if (table_[index].tags[slot] != kEmptyTag
+          && static_cast<uint32_t>(table_[index].ids[slot]) >= header->token_count) {
+        throw std::runtime_error("Vocab image is malformed");
+      }
+    }
+  }
+
+  content_hash_ = hashStep(kHashSeed, static_cast<uint32_t>(header->unk_token_id));
+  // Vocabs without normalization keep the hash they had before it existed.
+  if (header->normalization != 0) {
+    content_hash_ = hashStep(content_hash_, header->normalization);
+  }
+  for (size_t i = 0; i < header->token_count; i++) {
+    content_hash_ = hashStep(content_hash_, tokens_[i].flags);
+    content_hash_ = hashStep(content_hash_, tokens_[i].length);
+    const uint32_t *word = pool_ + tokens_[i].offset;
+    for (const uint32_t *it = word; it != word + tokens_[i].length; it++) {
+      content_hash_ = hashStep(content_hash_, *it);
+    }
+  }
+}
+
+} // namespace utils
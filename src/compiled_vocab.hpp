@@ -0,0 +1,239 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "utils.hpp"
+
+namespace utils {
+
+// Immutable vocabulary with lookup tables, stored as one contiguous image.
+// The image can be written to disk and loaded back with a single mmap, so many processes
+// share the same physical pages and no parsing happens at startup.
+//
+// Layout (native byte order, every section is aligned to a cache line):
+//   Header | Token[token_count] | uint32_t pool[pool_size] | char utf8[utf8_size]
+//   | Bucket table[bucket_count] | FirstLengths first_table[first_count]
+// The UTF-8 pool holds the bytes of every token in id order, for decoding.
+// Prefix and suffix tokens share one open addressing table. Each bucket is one cache line
+// with eight inline tags (16-bit hash fingerprint, prefix bit, 15-bit length), so most misses
+// are rejected without touching the code point pool. The first table tells which lengths the
+// tokens starting with a code point have, so probes of other lengths are skipped.
+class CompiledVocab {
+ public:
+  static constexpr uint32_t kVersion = 6;
+
+  static constexpr uint64_t kHashSeed = 0;
+
+  // Extends hash of a code point sequence by one code point. Multiply-xorshift, no modulo,
+  // so prefix hashes of a window are computed in the same pass that scans it.
+  static uint64_t hashStep(uint64_t hash, uint32_t code_point) {
+    hash = (hash ^ code_point) * 0x9e3779b97f4a7c15ull;
+    return hash ^ (hash >> 29u);
+  }
+
+  static uint64_t hashWord(const uint32_t *begin, size_t length) {
+    uint64_t hash = kHashSeed;
+    for (const uint32_t *it = begin; it != begin + length; it++) {
+      hash = hashStep(hash, *it);
+    }
+    return hash;
+  }
+
+  static constexpr uint32_t kPrefixToken = 1;
+  static constexpr uint32_t kSpecialToken = 2;
+  static constexpr uint32_t kMalformedToken = 4;
+
+  struct Token {
+    uint32_t offset; // in code point pool
+    uint32_t length;
+    uint32_t flags;
+    uint32_t utf8_offset; // in UTF-8 pool, bytes end where the next token's begin
+
+    bool isPrefix() const { return (flags & kPrefixToken) != 0; }
+
+    bool isSpecial() const { return (flags & kSpecialToken) != 0; }
+
+    bool isMalformed() const { return (flags & kMalformedToken) != 0; }
+  };
+
+  // Lengths of the matchable tokens which start with one code point, prefix and suffix tokens
+  // separately. Bit i of lengths is set if there is a token of length i + 1, the last bit
+  // stands for every length from kLengthBits on.
+  struct FirstLengths {
+    static constexpr size_t kLengthBits = 64;
+
+    uint32_t key; // code point * 2 + is_prefix
+    uint32_t max_length;
+    uint64_t lengths;
+
+    bool has(size_t length) const {
+      return ((lengths >> (std::min(length, kLengthBits) - 1)) & 1u) != 0;
+    }
+  };
+
+  explicit CompiledVocab(const WordPieceVocabulary &vocab);
+
+  CompiledVocab(const CompiledVocab &) = delete;
+
+  CompiledVocab(CompiledVocab &&) noexcept = default;
+
+  CompiledVocab &operator=(const CompiledVocab &) = delete;
+
+  CompiledVocab &operator=(CompiledVocab &&) noexcept = default;
+
+  // Loads a binary image if the file starts with the image magic, parses text vocab otherwise.
+  // An image must have been compiled with the same normalization.
+  static CompiledVocab fromFile(const std::string &file,
+                                const word_piece::Normalization &normalization = {});
+
+  static CompiledVocab loadImage(const std::string &file);
+
+  static bool isImage(const std::string &file);
+
+  void saveImage(const std::string &file) const;
+
+  size_t size() const { return header_->token_count; }
+
+  int unkTokenId() const { return header_->unk_token_id; }
+
+  // Normalization of the tokens, texts must be decoded with it.
+  word_piece::Normalization normalization() const {
+    return {(header_->normalization & kCleanText) != 0,
+            (header_->normalization & kLowerCase) != 0,
+            (header_->normalization & kStripAccents) != 0};
+  }
+
+  // Longest token which takes part in matching (neither special nor malformed).
+  size_t maxTokenLength() const { return header_->max_token_length; }
+
+  size_t poolSize() const { return header_->pool_size; }
+
+  // Hash of the tokens and their flags, the same for the text vocab and its image. Stored in
+  // binary id files to tell which vocab the ids belong to.
+  uint64_t contentHash() const { return content_hash_; }
+
+  const Token &token(size_t id) const { return tokens_[id]; }
+
+  const uint32_t *word(size_t id) const { return pool_ + tokens_[id].offset; }
+
+  // UTF-8 bytes of the token, without "##" for suffix tokens. Invalid code points of malformed
+  // tokens are U+FFFD.
+  std::string_view utf8(size_t id) const {
+    const uint64_t begin = tokens_[id].utf8_offset;
+    const uint64_t end
+     = id + 1 < header_->token_count ? tokens_[id + 1].utf8_offset : header_->utf8_size;
+    return {utf8_ + begin, static_cast<size_t>(end - begin)};
+  }
+
+  // Lengths of the tokens which start with code_point, max_length is 0 if there is none.
+  const FirstLengths &firstLengths(bool is_prefix, uint32_t code_point) const {
+    if (code_point > kMaxCodePoint) {
+      return kNoLengths;
+    }
+    const uint32_t key = code_point * 2 + (is_prefix ? 1 : 0);
+    const uint64_t first_mask = header_->first_count - 1;
+    for (uint64_t index = hashStep(kHashSeed, key) & first_mask;;
+         index = (index + 1) & first_mask) {
+      const FirstLengths &entry = first_table_[index];
+      if (entry.key == key) {
+        return entry;
+      }
+      if (entry.key == kEmptyKey) {
+        return kNoLengths;
+      }
+    }
+  }
+
+  // Returns id of token equal to [begin, begin + length) or -1.
+  // hash must be equal to hashWord(begin, length).
+  int find(bool is_prefix, uint64_t hash, const uint32_t *begin, size_t length) const {
+    const uint32_t tag = makeTag(is_prefix, hash, length);
+    const uint64_t bucket_mask = header_->bucket_count - 1;
+    for (uint64_t index = hash & bucket_mask;; index = (index + 1) & bucket_mask) {
+      const Bucket &bucket = table_[index];
+      for (size_t slot = 0; slot < kBucketSlots; slot++) {
+        if (bucket.tags[slot] == tag) {
+          const Token &token = tokens_[bucket.ids[slot]];
+          if (token.length == length && std::equal(begin, begin + length, pool_ + token.offset)) {
+            return bucket.ids[slot];
+          }
+        } else if (bucket.tags[slot] == kEmptyTag) {
+          return -1;
+        }
+      }
+    }
+  }
+
+ private:
+  static constexpr char kMagic[8] = {'W', 'P', 'V', 'O', 'C', 'A', 'B', '\0'};
+  static constexpr size_t kImageAlignment = 64;
+  static constexpr size_t kBucketSlots = 8;
+  static constexpr uint32_t kEmptyTag = 0; // real tags have non-zero length
+  static constexpr uint32_t kMaxTagLength = 0x7fff;
+  static constexpr uint32_t kCleanText = 1;
+  static constexpr uint32_t kLowerCase = 2;
+  static constexpr uint32_t kStripAccents = 4;
+  static constexpr uint32_t kMaxCodePoint = 0x10FFFF;
+  static constexpr uint32_t kEmptyKey = UINT32_MAX; // real keys are at most 2 * kMaxCodePoint + 1
+  static constexpr FirstLengths kNoLengths = {kEmptyKey, 0, 0};
+
+  struct alignas(kImageAlignment) Bucket {
+    uint32_t tags[kBucketSlots];
+    int32_t ids[kBucketSlots];
+  };
+
+  struct alignas(kImageAlignment) CacheLine {
+    char bytes[kImageAlignment];
+  };
+
+  static uint32_t makeTag(bool is_prefix, uint64_t hash, size_t length) {
+    const auto fingerprint = static_cast<uint32_t>(hash >> 48u);
+    const auto tag_length = static_cast<uint32_t>(std::min<size_t>(length, kMaxTagLength));
+    return (fingerprint << 16u) | (is_prefix ? 0x8000u : 0u) | tag_length;
+  }
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t token_count;
+    int32_t unk_token_id;
+    uint32_t max_token_length;
+    uint64_t pool_size;
+    uint64_t bucket_count; // power of two
+    uint64_t tokens_offset;
+    uint64_t pool_offset;
+    uint64_t utf8_offset;
+    uint64_t utf8_size;
+    uint64_t table_offset;
+    uint64_t image_size;
+    uint32_t normalization; // kCleanText | kLowerCase | kStripAccents
+    uint64_t first_count;   // power of two
+    uint64_t first_offset;
+  };
+
+  CompiledVocab() = default;
+
+  void attach(const char *image, size_t image_size);
+
+  std::vector<CacheLine> storage_;
+  boost::iostreams::mapped_file_source mmap_;
+
+  const char *image_ = nullptr;
+  const Header *header_ = nullptr;
+  const Token *tokens_ = nullptr;
+  const uint32_t *pool_ = nullptr;
+  const char *utf8_ = nullptr;
+  const Bucket *table_ = nullptr;
+  const FirstLengths *first_table_ = nullptr;
+  uint64_t content_hash_ = 0;
+};
+
+} // namespace utils
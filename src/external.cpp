@@ -0,0 +1,185 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#include "external.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "third_party/utf8.hpp"
+
+namespace {
+
+// Blocking queue of limited capacity. After close() push fails and pop drains what is left.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+  bool push(T value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(value));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return std::nullopt;
+    }
+    T value = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return value;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  bool closed_ = false;
+  std::deque<T> items_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+struct TextBatch {
+  const char *text;
+  size_t size;
+  std::vector<uint32_t> code_points;
+};
+
+// Pulls the pages of a batch into memory ahead of the encoder.
+void prefetchPages(const char *text, size_t size) {
+  static constexpr size_t kPageSize = 4096;
+  volatile char sink = 0;
+  for (size_t offset = 0; offset < size; offset += kPageSize) {
+    sink = static_cast<char>(sink ^ text[offset]);
+  }
+}
+
+} // namespace
+
+namespace utils {
+
+template <typename Id>
+void encodeExternalPipeline(const std::string &text_file,
+                            size_t batch_size,
+                            bool decode,
+                            const word_piece::Normalization &normalization,
+                            const ExternalBatchEncoder<Id> &encode,
+                            IdWriter &writer) {
+  static constexpr size_t kQueueCapacity = kExternalBatchesInFlight - 2;
+
+  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
+  BoundedQueue<TextBatch> text_queue(kQueueCapacity);
+  BoundedQueue<word_piece::BasicChunkedIds<Id>> ids_queue(kQueueCapacity);
+  std::exception_ptr reader_error;
+  std::exception_ptr encoder_error;
+  std::exception_ptr writer_error;
+
+  std::thread reader([&] {
+    try {
+      const char *begin = mmap.const_data();
+      size_t size = mmap.size();
+      while (size > 0) {
+        size_t batch;
+        if (size > batch_size) {
+          batch = std::max<size_t>(batch_size, 1);
+          while (batch < size
+                 && !vkcom::starts_with_space(begin + batch - 1,
+                                              static_cast<int64_t>(size - batch))) {
+            batch++;
+          }
+        } else {
+          batch = size;
+        }
+
+        TextBatch item{begin, batch, {}};
+        if (decode) {
+          // Tasks of the encoder and of the decoder share the pool, each waits for its own group.
+          item.code_points = parseText(begin, batch, globalThreadPool(), nullptr, normalization);
+        } else {
+          prefetchPages(begin, batch);
+        }
+        if (!text_queue.push(std::move(item))) {
+          break;
+        }
+        begin += batch;
+        size -= batch;
+      }
+    } catch (...) {
+      reader_error = std::current_exception();
+    }
+    text_queue.close();
+  });
+
+  std::thread writer_thread([&] {
+    try {
+      while (std::optional<word_piece::BasicChunkedIds<Id>> ids = ids_queue.pop()) {
+        writer.write(*ids);
+      }
+    } catch (...) {
+      writer_error = std::current_exception();
+      ids_queue.close();
+      text_queue.close();
+    }
+  });
+
+  try {
+    while (std::optional<TextBatch> item = text_queue.pop()) {
+      word_piece::BasicChunkedIds<Id> ids = encode(item->text, item->size, item->code_points);
+      // Code points are not needed while the ids wait for the writer.
+      item.reset();
+      if (!ids_queue.push(std::move(ids))) {
+        break;
+      }
+    }
+  } catch (...) {
+    encoder_error = std::current_exception();
+    text_queue.close();
+  }
+  ids_queue.close();
+
+  reader.join();
+  writer_thread.join();
+  for (const std::exception_ptr &error : {reader_error, encoder_error, writer_error}) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+template void encodeExternalPipeline<int>(const std::string &text_file,
+                                          size_t batch_size,
+                                          bool decode,
+                                          const word_piece::Normalization &normalization,
+                                          const ExternalBatchEncoder<int> &encode,
+                                          IdWriter &writer);
+
+template void encodeExternalPipeline<uint16_t>(const std::string &text_file,
+                                               size_t batch_size,
+                                               bool decode,
+                                               const word_piece::Normalization &normalization,
+                                               const ExternalBatchEncoder<uint16_t> &encode,
+                                               IdWriter &writer);
+
+} // namespace utils
@@ -0,0 +1,68 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace utils {
+
+// Batches of every kind alive at once in encodeExternalPipeline: one being produced, one waiting
+// in the queue and one being consumed. Engines divide memory_limit by it.
+constexpr size_t kExternalBatchesInFlight = 3;
+
+// Encodes [text, text + size) of one batch. code_points is the decoded batch if decoding was
+// requested and empty otherwise. The chunks go to the writer as they are.
+template <typename Id>
+using ExternalBatchEncoder = std::function<word_piece::BasicChunkedIds<Id>(
+ const char *text, size_t size, const std::vector<uint32_t> &code_points)>;
+
+// Encodes text_file batch by batch into writer as a three-stage pipeline: a reader thread
+// prefetches (or decodes with normalization on the thread pool, if decode is set) batch k + 1
+// while the calling thread encodes batch k and a writer thread writes ids of batch k - 1.
+// Queues between the stages hold one batch, so at most kExternalBatchesInFlight batches of text
+// and of ids exist at once.
+// Batches are about batch_size bytes and end after a space. Id is int or uint16_t.
+template <typename Id>
+void encodeExternalPipeline(const std::string &text_file,
+                            size_t batch_size,
+                            bool decode,
+                            const word_piece::Normalization &normalization,
+                            const ExternalBatchEncoder<Id> &encode,
+                            IdWriter &writer);
+
+// encodeExternalPipeline with uint16_t ids if they fit for vocab_size and int otherwise, so ids in
+// flight take half the memory with usual vocabs. encode(Id(), text, size, code_points) returns
+// word_piece::BasicChunkedIds<Id>.
+template <typename Encode>
+void encodeExternalCompact(const std::string &text_file,
+                           size_t batch_size,
+                           bool decode,
+                           const word_piece::Normalization &normalization,
+                           size_t vocab_size,
+                           const Encode &encode,
+                           IdWriter &writer) {
+  const auto run = [&](auto id) {
+    using Id = decltype(id);
+    encodeExternalPipeline<Id>(
+     text_file,
+     batch_size,
+     decode,
+     normalization,
+     [&encode](const char *text, size_t size, const std::vector<uint32_t> &code_points) {
+       return encode(Id(), text, size, code_points);
+     },
+     writer);
+  };
+  if (compactIds(vocab_size)) {
+    run(uint16_t());
+  } else {
+    run(int());
+  }
+}
+
+} // namespace utils
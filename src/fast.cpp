@@ -3,183 +3,1012 @@
 #include "word_piece.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
-#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <boost/iostreams/device/mapped_file.hpp>
 
+#include "compiled_vocab.hpp"
+#include "external.hpp"
 #include "third_party/thread_pool.hpp"
 #include "third_party/utf8.hpp"
+#include "utf8_decode.hpp"
 #include "utils.hpp"
 
-static std::vector<int> encodeFastWordPieceImpl(const std::vector<uint32_t> &text,
-                                                const utils::WordPieceVocabulary &vocab) {
-  using WordMap = std::unordered_map<vkcom::VectorSegment, int>;
-  WordMap prefix_to_id; // no ## in word prefix
-  WordMap suffix_to_id; // ## in word prefix
+// Ids of recently seen words of one thread, keyed by the code points of a space-delimited run.
+// A run always starts a word, so its code points are the whole context of its ids. Fixed size
+// open addressing with a short probe window, an insert into a full window replaces its first
+// entry. A new generation empties the cache in O(1).
+class WordCache {
+ public:
+  static constexpr size_t kMaxWordLength = 8;
+  static constexpr size_t kMaxTokens = 4;
 
-  size_t max_len = 0;
-  for (size_t i = 0; i < vocab.tokens.size(); i++) {
-    const auto &token = vocab.tokens[i];
-    if (token.is_special || token.is_malformed) {
-      continue;
+  // entries is a power of two.
+  WordCache(uint64_t owner, size_t entries) : owner_(owner), entries_(entries) {}
+
+  uint64_t owner() const { return owner_; }
+
+  size_t size() const { return entries_.size(); }
+
+  // Forgets every entry, the cache goes to another tokenizer.
+  void reset(uint64_t owner) {
+    owner_ = owner;
+    if (++generation_ == 0) {
+      std::fill(entries_.begin(), entries_.end(), Entry{});
+      generation_ = 1;
     }
-    max_len = std::max(max_len, token.word.size());
-    vkcom::VectorSegmentBuilder segment(token.word);
-    WordMap *word_to_id = token.is_prefix ? &prefix_to_id : &suffix_to_id;
-    (*word_to_id)[segment.finish()] = static_cast<int>(i);
   }
-  max_len = std::min(max_len, text.size());
 
-  const auto is_word_prefix = [&text](size_t index) {
-    return index == 0 || vkcom::is_spacing_char(text[index])
-        || vkcom::is_spacing_char(text[index - 1]);
+  // Appends the ids of word and, if spans is not null, their ranges shifted by begin.
+  template <typename Id>
+  bool find(uint64_t hash,
+            const uint32_t *word,
+            size_t length,
+            size_t begin,
+            std::vector<Id> &token_ids,
+            std::vector<word_piece::TokenSpan> *spans) {
+    for (size_t probe = 0; probe < kProbes; probe++) {
+      const Entry &entry = entries_[(hash + probe) & (entries_.size() - 1)];
+      if (entry.generation != generation_) {
+        break;
+      }
+      if (entry.hash == static_cast<uint32_t>(hash) && entry.length == length
+          && std::equal(word, word + length, entry.word)) {
+        size_t token_begin = begin;
+        for (size_t i = 0; i < entry.token_count; i++) {
+          token_ids.push_back(utils::toId<Id>(entry.ids[i]));
+          if (spans != nullptr) {
+            spans->push_back({token_begin, begin + entry.token_end[i]});
+            token_begin = begin + entry.token_end[i];
+          }
+        }
+        ++hits;
+        return true;
+      }
+    }
+    ++misses;
+    return false;
+  }
+
+  // Tokens of a run cover it without gaps, spans are only needed for their ends.
+  template <typename Id>
+  void insert(uint64_t hash,
+              const uint32_t *word,
+              size_t length,
+              size_t begin,
+              const Id *ids,
+              const word_piece::TokenSpan *spans,
+              size_t token_count) {
+    if (token_count > kMaxTokens) {
+      return;
+    }
+    Entry *target = &entries_[hash & (entries_.size() - 1)];
+    for (size_t probe = 0; probe < kProbes; probe++) {
+      Entry &entry = entries_[(hash + probe) & (entries_.size() - 1)];
+      if (entry.generation != generation_) {
+        target = &entry;
+        break;
+      }
+    }
+    target->hash = static_cast<uint32_t>(hash);
+    target->generation = generation_;
+    target->length = static_cast<uint8_t>(length);
+    target->token_count = static_cast<uint8_t>(token_count);
+    std::copy(word, word + length, target->word);
+    for (size_t i = 0; i < token_count; i++) {
+      if constexpr (std::is_same_v<Id, uint16_t>) {
+        target->ids[i] = ids[i] == word_piece::kUnkId16 ? -1 : ids[i];
+      } else {
+        target->ids[i] = ids[i];
+      }
+      target->token_end[i] = static_cast<uint8_t>(spans[i].end - begin);
+    }
+  }
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+ private:
+  static constexpr size_t kProbes = 4;
+
+  // One cache line.
+  struct alignas(64) Entry {
+    uint32_t hash = 0;
+    uint32_t generation = 0;
+    uint8_t length = 0;
+    uint8_t token_count = 0;
+    uint32_t word[kMaxWordLength] = {};
+    int32_t ids[kMaxTokens] = {};
+    uint8_t token_end[kMaxTokens] = {};
   };
 
-  const auto worker = [&, unk_token_id = vocab.unk_token_id](size_t begin, size_t end) {
-    std::vector<int> token_ids;
-    token_ids.reserve((end - begin) / max_len + 1);
+  static_assert(sizeof(Entry) == 64);
 
-    while (begin != end && vkcom::is_space(text[begin])) {
-      ++begin;
+  uint64_t owner_;
+  uint32_t generation_ = 1;
+  std::vector<Entry> entries_;
+};
+
+// Word caches of one tokenizer: every thread keeps its own, the counters are shared.
+struct WordCacheConfig {
+  WordCacheConfig(size_t entries) : owner(nextOwner()), entries(entries) {}
+
+  static uint64_t nextOwner() {
+    static std::atomic<uint64_t> owner{0};
+    return ++owner;
+  }
+
+  const uint64_t owner;
+  const size_t entries; // 0 disables the caches
+  mutable std::atomic<uint64_t> hits{0};
+  mutable std::atomic<uint64_t> misses{0};
+};
+
+// The cache of the calling thread for one run of encoding, its counters go to the config at the
+// end. A thread keeps one cache, it is emptied when another tokenizer takes it. Must not live
+// across calls which may run other pool tasks on this thread.
+class ThreadWordCache {
+ public:
+  explicit ThreadWordCache(const WordCacheConfig *config) : config_(config) {
+    if (config == nullptr || config->entries == 0) {
+      return;
     }
+    thread_local std::unique_ptr<WordCache> thread_cache;
+    if (thread_cache == nullptr || thread_cache->size() != config->entries) {
+      thread_cache = std::make_unique<WordCache>(config->owner, config->entries);
+    } else if (thread_cache->owner() != config->owner) {
+      thread_cache->reset(config->owner);
+    }
+    cache_ = thread_cache.get();
+  }
 
-    size_t tokens_since_prefix = 0;
+  ThreadWordCache(const ThreadWordCache &) = delete;
 
-    while (begin != end) {
-      size_t word_len = 1;
-      if (!vkcom::is_punctuation(text[begin])) {
-        while (word_len < std::min(max_len, end - begin)
-               && !vkcom::is_spacing_char(text[begin + word_len])) {
-          ++word_len;
-        }
-      }
+  ThreadWordCache &operator=(const ThreadWordCache &) = delete;
+
+  ~ThreadWordCache() {
+    if (cache_ != nullptr) {
+      config_->hits += cache_->hits;
+      config_->misses += cache_->misses;
+      cache_->hits = 0;
+      cache_->misses = 0;
+    }
+  }
 
-      const uint32_t *segment_begin = text.data() + static_cast<int64_t>(begin);
-      const uint32_t *segment_end = segment_begin + static_cast<int64_t>(word_len);
-      const WordMap *word_to_id = is_word_prefix(begin) ? &prefix_to_id : &suffix_to_id;
+  WordCache *get() const { return cache_; }
 
-      vkcom::VectorSegmentBuilder segment(segment_begin, segment_end);
-      while (!segment.empty()) {
-        auto it = word_to_id->find(segment.finish());
-        if (it != word_to_id->end()) {
-          ++tokens_since_prefix;
-          token_ids.push_back(it->second);
-          begin += segment.size();
-          break;
-        } else {
-          segment.pop_back();
-        }
+ private:
+  const WordCacheConfig *config_;
+  WordCache *cache_ = nullptr;
+};
+
+// Appends ids of text[begin, end) to token_ids and, if spans is not null, their code point
+// ranges to spans. begin is 0 or text[begin] is a space. Space-delimited runs are encoded on
+// their own, short ones go through cache if it is not null.
+// Longest token at text[begin] which crosses neither a spacing character nor end. window is the
+// number of code points hashed into prefix_hash, id is -1 and length is 0 if nothing matches.
+struct TokenMatch {
+  int id;
+  size_t length;
+  size_t window;
+};
+
+static TokenMatch matchLongestToken(const uint32_t *text,
+                                    size_t begin,
+                                    size_t end,
+                                    bool is_prefix,
+                                    const utils::CompiledVocab &vocab,
+                                    uint64_t *prefix_hash) {
+  // Neither the window nor the probes go past the lengths of tokens with this first letter.
+  const utils::CompiledVocab::FirstLengths &first = vocab.firstLengths(is_prefix, text[begin]);
+  size_t window = 1;
+  prefix_hash[0] = utils::CompiledVocab::hashStep(utils::CompiledVocab::kHashSeed, text[begin]);
+  if (!vkcom::is_punctuation(text[begin])) {
+    while (window < std::min<size_t>(first.max_length, end - begin)
+           && !vkcom::is_spacing_char(text[begin + window])) {
+      prefix_hash[window]
+       = utils::CompiledVocab::hashStep(prefix_hash[window - 1], text[begin + window]);
+      ++window;
+    }
+  }
+
+  for (size_t length = window; length > 0; --length) {
+    if (first.has(length)) {
+      const int token_id = vocab.find(is_prefix, prefix_hash[length - 1], text + begin, length);
+      if (token_id != -1) {
+        return {token_id, length, window};
       }
+    }
+  }
+  return {-1, 0, window};
+}
+
+template <typename Id>
+static void encodeFastWordPieceRange(const uint32_t *text,
+                                     size_t begin,
+                                     size_t end,
+                                     const utils::CompiledVocab &vocab,
+                                     WordCache *cache,
+                                     std::vector<Id> &token_ids,
+                                     std::vector<word_piece::TokenSpan> *spans) {
+  const size_t max_len = vocab.maxTokenLength();
+  const Id unk_token_id = utils::toId<Id>(vocab.unkTokenId());
+
+  const auto is_word_prefix = [text](size_t index) {
+    return index == 0 || vkcom::is_spacing_char(text[index])
+        || vkcom::is_spacing_char(text[index - 1]);
+  };
+
+  // prefix_hash[i] is hash of text[begin, begin + i]. Lives on the stack unless vocab has
+  // unusually long tokens, allocated once per call in that case.
+  static constexpr size_t kStackHashes = 256;
+  uint64_t stack_prefix_hash[kStackHashes];
+  std::vector<uint64_t> heap_prefix_hash(max_len > kStackHashes ? max_len : 0);
+  uint64_t *prefix_hash = max_len > kStackHashes ? heap_prefix_hash.data() : stack_prefix_hash;
 
-      if (segment.empty()) {
+  // Encodes the run text[begin, end), which has no spaces.
+  const auto encode_run = [&](size_t begin, size_t end, std::vector<word_piece::TokenSpan> *spans) {
+    size_t tokens_since_prefix = 0;
+
+    while (begin != end) {
+      const TokenMatch match
+       = matchLongestToken(text, begin, end, is_word_prefix(begin), vocab, prefix_hash);
+      if (match.id != -1) {
+        ++tokens_since_prefix;
+        token_ids.push_back(static_cast<Id>(match.id));
+        if (spans != nullptr) {
+          spans->push_back({begin, begin + match.length});
+        }
+        begin += match.length;
+        if (begin != end && is_word_prefix(begin)) {
+          tokens_since_prefix = 0;
+        }
+      } else {
+        size_t word_len = match.window;
+        size_t word_begin = begin;
         while (tokens_since_prefix > 0) {
           token_ids.pop_back();
+          if (spans != nullptr) {
+            word_begin = spans->back().begin;
+            spans->pop_back();
+          }
           --tokens_since_prefix;
         }
         token_ids.push_back(unk_token_id);
+        // UNK skips the window of the longest token of the vocab, not the shorter one probed:
+        // after a CJK character the letters which follow must not start a new word.
+        if (!vkcom::is_punctuation(text[begin])) {
+          while (word_len < std::min(max_len, end - begin)
+                 && !vkcom::is_spacing_char(text[begin + word_len])) {
+            ++word_len;
+          }
+        }
         begin += word_len;
         while (begin != end && !is_word_prefix(begin)) {
           ++begin;
         }
-      } else if (begin != end && is_word_prefix(begin)) {
-        tokens_since_prefix = 0;
+        if (spans != nullptr) {
+          spans->push_back({word_begin, begin});
+        }
       }
+    }
+  };
 
-      while (begin != end && vkcom::is_space(text[begin])) {
-        ++begin;
+  // Spans of a run encoded for the cache when the caller does not want them.
+  std::vector<word_piece::TokenSpan> run_spans;
+  while (begin != end) {
+    while (begin != end && vkcom::is_space(text[begin])) {
+      ++begin;
+    }
+    size_t run_end = begin;
+    while (run_end != end && !vkcom::is_space(text[run_end])) {
+      ++run_end;
+    }
+    if (cache == nullptr || run_end - begin > WordCache::kMaxWordLength) {
+      encode_run(begin, run_end, spans);
+    } else if (begin != run_end) {
+      uint64_t hash = utils::CompiledVocab::kHashSeed;
+      for (size_t i = begin; i < run_end; i++) {
+        hash = utils::CompiledVocab::hashStep(hash, text[i]);
+      }
+      if (!cache->find(hash, text + begin, run_end - begin, begin, token_ids, spans)) {
+        const size_t ids_before = token_ids.size();
+        std::vector<word_piece::TokenSpan> *used_spans = spans != nullptr ? spans : &run_spans;
+        const size_t spans_before = used_spans->size();
+        encode_run(begin, run_end, used_spans);
+        cache->insert(hash,
+                      text + begin,
+                      run_end - begin,
+                      begin,
+                      token_ids.data() + ids_before,
+                      used_spans->data() + spans_before,
+                      token_ids.size() - ids_before);
+        run_spans.clear();
       }
     }
+    begin = run_end;
+  }
+}
 
+template <typename Id>
+static word_piece::BasicChunkedIds<Id>
+encodeFastWordPieceImpl(const std::vector<uint32_t> &text,
+                        const utils::CompiledVocab &vocab,
+                        const WordCacheConfig *word_cache,
+                        std::vector<word_piece::TokenSpan> *spans) {
+  const size_t max_len = std::max<size_t>(std::min(vocab.maxTokenLength(), text.size()), 1);
+
+  const auto worker = [&](size_t begin, size_t end, std::vector<word_piece::TokenSpan> *spans) {
+    std::vector<Id> token_ids;
+    token_ids.reserve((end - begin) / max_len + 1);
+    const ThreadWordCache cache(word_cache);
+    encodeFastWordPieceRange(text.data(), begin, end, vocab, cache.get(), token_ids, spans);
     return token_ids;
   };
 
   static constexpr size_t kWorkBatch = 1'000'000;
-  std::vector<int> token_ids;
+  static constexpr size_t kChunkSize = 1 << 16;
+  word_piece::BasicChunkedIds<Id> token_ids;
   if (text.size() < 2 * kWorkBatch) {
-    token_ids = worker(0, text.size());
+    token_ids.chunks.push_back(worker(0, text.size(), spans));
   } else {
     const size_t thread_count
      = std::min(utils::globalThreadPool().maxThreads(), text.size() / kWorkBatch);
-    const size_t work_batch = text.size() / thread_count + 1;
-    std::vector<std::vector<int>> per_thread_token_ids(thread_count);
-    size_t work_begin = 0;
-    for (size_t thread_id = 0; thread_id < thread_count && work_begin < text.size(); thread_id++) {
-      size_t work_end = std::min(text.size(), work_begin + work_batch);
-      while (work_end < text.size() && !vkcom::is_space(text[work_end])) {
-        ++work_end;
+    const size_t chunk_count = utils::dynamicChunkCount(text.size(), kChunkSize);
+    token_ids.chunks.resize(chunk_count);
+    std::vector<std::vector<word_piece::TokenSpan>> chunk_spans(spans != nullptr ? chunk_count
+                                                                                 : 0);
+    utils::forEachDynamicChunk(
+     utils::globalThreadPool(),
+     text.size(),
+     kChunkSize,
+     thread_count,
+     [&text](size_t pos) { return vkcom::is_space(text[pos]); },
+     [&](size_t chunk, size_t begin, size_t end) {
+       token_ids.chunks[chunk]
+        = worker(begin, end, spans != nullptr ? &chunk_spans[chunk] : nullptr);
+     });
+
+    if (spans != nullptr) {
+      for (const std::vector<word_piece::TokenSpan> &segment : chunk_spans) {
+        spans->insert(spans->end(), segment.begin(), segment.end());
       }
-      utils::globalThreadPool().submit(
-       [thread_id, work_begin, work_end, &per_thread_token_ids, &worker] {
-         per_thread_token_ids[thread_id] = worker(work_begin, work_end);
-       });
-      work_begin = work_end;
     }
+  }
+
+  return token_ids;
+}
+
+template <typename Id>
+static word_piece::BasicChunkedIds<Id>
+encodeFastWordPiece(const char *text,
+                    size_t size,
+                    const utils::CompiledVocab &vocab,
+                    const WordCacheConfig *word_cache,
+                    std::vector<word_piece::TokenSpan> *spans = nullptr) {
+  if (spans != nullptr) {
+    spans->clear();
+  }
+  if (size == 0) {
+    return {};
+  }
+  // Spans of normalized text map through the source of every code point.
+  const bool normalized = vocab.normalization().enabled();
+  std::vector<size_t> invalid_positions;
+  std::vector<size_t> source_offsets;
+  const std::vector<uint32_t> text_utf8
+   = utils::parseText(text,
+                      size,
+                      utils::globalThreadPool(),
+                      spans != nullptr && !normalized ? &invalid_positions : nullptr,
+                      vocab.normalization(),
+                      spans != nullptr && normalized ? &source_offsets : nullptr);
+  if (text_utf8.empty()) {
+    return {};
+  }
+  word_piece::BasicChunkedIds<Id> token_ids
+   = encodeFastWordPieceImpl<Id>(text_utf8, vocab, word_cache, spans);
+  if (spans != nullptr && normalized) {
+    utils::spansToByteOffsets(text, source_offsets, spans->data(), spans->size());
+  } else if (spans != nullptr) {
+    utils::spansToByteOffsets(text, size, invalid_positions, spans->data(), spans->size());
+  }
+  return token_ids;
+}
+
+static word_piece::BatchEncoding
+encodeFastWordPieceBatch(const std::vector<std::string_view> &texts,
+                         const utils::CompiledVocab &vocab,
+                         const WordCacheConfig *word_cache,
+                         bool with_spans) {
+  // Smaller tasks do not pay for the thread pool round trip.
+  static constexpr size_t kMinTaskBytes = 16 * 1024;
+  static constexpr size_t kTasksPerThread = 4;
 
-    utils::globalThreadPool().waitCompletion();
+  const word_piece::Normalization normalization = vocab.normalization();
+  const bool normalized = normalization.enabled();
+  word_piece::BatchEncoding result;
+  result.offsets.assign(texts.size() + 1, 0);
+  if (texts.empty()) {
+    return result;
+  }
+
+  size_t total_bytes = 0;
+  for (std::string_view text : texts) {
+    total_bytes += text.size();
+  }
+  const size_t max_tasks
+   = std::min(texts.size(), utils::globalThreadPool().maxThreads() * kTasksPerThread);
+  const size_t task_count = std::clamp<size_t>(total_bytes / kMinTaskBytes, 1, max_tasks);
 
-    size_t token_count = 0;
-    for (size_t thread_id = 0; thread_id < thread_count; thread_id++) {
-      token_count += per_thread_token_ids[thread_id].size();
+  // Runs of documents with about total_bytes / task_count bytes each.
+  std::vector<size_t> task_begin = {0};
+  size_t run_bytes = 0;
+  for (size_t i = 0; i < texts.size() && task_begin.size() < task_count; i++) {
+    run_bytes += texts[i].size();
+    if (run_bytes * task_count >= total_bytes * task_begin.size()) {
+      task_begin.push_back(i + 1);
     }
-    token_ids.resize(token_count);
-    work_begin = 0;
-    for (size_t thread_id = 0; thread_id < thread_count; thread_id++) {
-      std::vector<int> &segment = per_thread_token_ids[thread_id];
-      if (!segment.empty()) {
-        std::memcpy(token_ids.data() + work_begin, segment.data(), segment.size() * sizeof(int));
-        work_begin += segment.size();
+  }
+  if (task_begin.back() != texts.size()) {
+    task_begin.push_back(texts.size());
+  }
+  const size_t runs = task_begin.size() - 1;
+
+  std::vector<std::vector<int>> task_ids(runs);
+  std::vector<std::vector<word_piece::TokenSpan>> task_spans(with_spans ? runs : 0);
+  const auto run_task = [&](size_t task) {
+    std::vector<uint32_t> text_utf8;
+    std::vector<size_t> invalid_positions;
+    std::vector<size_t> source_offsets;
+    std::vector<int> &ids = task_ids[task];
+    std::vector<word_piece::TokenSpan> *spans = with_spans ? &task_spans[task] : nullptr;
+    const ThreadWordCache cache(word_cache);
+    for (size_t i = task_begin[task]; i < task_begin[task + 1]; i++) {
+      const std::string_view text = texts[i];
+      if (text_utf8.size() < text.size()) {
+        text_utf8.resize(text.size());
+      }
+      invalid_positions.clear();
+      source_offsets.clear();
+      const size_t length
+       = utils::decodeUtf8(text.data(),
+                           text.data() + text.size(),
+                           text_utf8.data(),
+                           normalization,
+                           with_spans && !normalized ? &invalid_positions : nullptr,
+                           with_spans && normalized ? &source_offsets : nullptr);
+      const size_t ids_before = ids.size();
+      encodeFastWordPieceRange(text_utf8.data(), 0, length, vocab, cache.get(), ids, spans);
+      result.offsets[i + 1] = ids.size() - ids_before;
+      if (with_spans && normalized) {
+        utils::spansToByteOffsets(
+         text.data(), source_offsets, spans->data() + ids_before, ids.size() - ids_before);
+      } else if (with_spans) {
+        utils::spansToByteOffsets(text.data(),
+                                  text.size(),
+                                  invalid_positions,
+                                  spans->data() + ids_before,
+                                  ids.size() - ids_before);
       }
     }
+  };
+
+  if (runs == 1) {
+    run_task(0);
+  } else {
+    utils::TaskGroup tasks(utils::globalThreadPool());
+    for (size_t task = 0; task < runs; task++) {
+      tasks.submit([task, &run_task] { run_task(task); });
+    }
+    tasks.wait();
   }
 
-  return token_ids;
+  for (size_t i = 0; i < texts.size(); i++) {
+    result.offsets[i + 1] += result.offsets[i];
+  }
+  if (runs == 1) {
+    result.ids = std::move(task_ids[0]);
+    if (with_spans) {
+      result.spans = std::move(task_spans[0]);
+    }
+  } else {
+    result.ids.resize(result.offsets.back());
+    size_t offset = 0;
+    for (const std::vector<int> &ids : task_ids) {
+      if (!ids.empty()) {
+        std::memcpy(result.ids.data() + offset, ids.data(), ids.size() * sizeof(int));
+        offset += ids.size();
+      }
+    }
+    if (with_spans) {
+      result.spans.reserve(result.ids.size());
+      for (const std::vector<word_piece::TokenSpan> &spans : task_spans) {
+        result.spans.insert(result.spans.end(), spans.begin(), spans.end());
+      }
+    }
+  }
+  return result;
 }
 
-static std::vector<int>
-encodeFastWordPiece(const char *text, size_t size, const utils::WordPieceVocabulary &vocab) {
-  if (size == 0) {
-    return {};
+// Text of a token in decoded output, UNK without a vocab token is "[UNK]".
+static std::string_view decodedToken(const utils::CompiledVocab &vocab, int id, bool *is_prefix) {
+  static constexpr std::string_view kUnkText = "[UNK]";
+  if (id >= 0 && static_cast<size_t>(id) < vocab.size()) {
+    *is_prefix = vocab.token(static_cast<size_t>(id)).isPrefix();
+    return vocab.utf8(static_cast<size_t>(id));
+  }
+  if (id == vocab.unkTokenId() || id == -1) {
+    *is_prefix = true;
+    return kUnkText;
   }
-  const std::vector<uint32_t> text_utf8 = utils::parseText(text, size, utils::globalThreadPool());
-  return encodeFastWordPieceImpl(text_utf8, vocab);
+  throw std::runtime_error("No token with id " + std::to_string(id));
+}
+
+// Size of ids[begin, end) in decoded text. first is the index of the first id of the text.
+static size_t decodedSize(const int *ids,
+                          size_t begin,
+                          size_t end,
+                          size_t first,
+                          const utils::CompiledVocab &vocab) {
+  size_t size = 0;
+  for (size_t i = begin; i < end; i++) {
+    bool is_prefix;
+    size += decodedToken(vocab, ids[i], &is_prefix).size();
+    size += is_prefix && i != first ? 1 : 0;
+  }
+  return size;
+}
+
+static void decodeTo(const int *ids,
+                     size_t begin,
+                     size_t end,
+                     size_t first,
+                     const utils::CompiledVocab &vocab,
+                     char *out) {
+  for (size_t i = begin; i < end; i++) {
+    bool is_prefix;
+    const std::string_view token = decodedToken(vocab, ids[i], &is_prefix);
+    if (is_prefix && i != first) {
+      *out++ = ' ';
+    }
+    std::memcpy(out, token.data(), token.size());
+    out += token.size();
+  }
+}
+
+// One pass measures the output, then every chunk of ids is copied to its offset in it.
+static std::string decodeFastWordPiece(const int *ids,
+                                       size_t count,
+                                       const utils::CompiledVocab &vocab) {
+  static constexpr size_t kWorkBatch = 1'000'000;
+  static constexpr size_t kChunkSize = 1 << 16;
+
+  std::string text;
+  if (count < 2 * kWorkBatch) {
+    text.resize(decodedSize(ids, 0, count, 0, vocab));
+    decodeTo(ids, 0, count, 0, vocab, text.data());
+    return text;
+  }
+
+  const size_t thread_count = std::min(utils::globalThreadPool().maxThreads(), count / kWorkBatch);
+  const size_t chunk_count = utils::dynamicChunkCount(count, kChunkSize);
+  const auto any_position = [](size_t) { return true; };
+  std::vector<size_t> chunk_offsets(chunk_count + 1);
+  utils::forEachDynamicChunk(
+   utils::globalThreadPool(),
+   count,
+   kChunkSize,
+   thread_count,
+   any_position,
+   [&](size_t chunk, size_t begin, size_t end) {
+     chunk_offsets[chunk + 1] = decodedSize(ids, begin, end, 0, vocab);
+   });
+  for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+    chunk_offsets[chunk + 1] += chunk_offsets[chunk];
+  }
+  text.resize(chunk_offsets.back());
+  utils::forEachDynamicChunk(
+   utils::globalThreadPool(),
+   count,
+   kChunkSize,
+   thread_count,
+   any_position,
+   [&](size_t chunk, size_t begin, size_t end) {
+     decodeTo(ids, begin, end, 0, vocab, text.data() + chunk_offsets[chunk]);
+   });
+  return text;
+}
+
+static std::vector<std::string> decodeFastWordPieceBatch(const word_piece::BatchEncoding &batch,
+                                                         const utils::CompiledVocab &vocab) {
+  static constexpr size_t kWorkBatch = 1'000'000;
+  static constexpr size_t kChunkSize = 256;
+
+  const size_t text_count = batch.offsets.empty() ? 0 : batch.offsets.size() - 1;
+  if (text_count > 0 && batch.offsets.back() > batch.ids.size()) {
+    throw std::runtime_error("Batch offsets are out of ids");
+  }
+  std::vector<std::string> texts(text_count);
+  const auto decode_texts = [&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const size_t first = batch.offsets[i];
+      const size_t last = batch.offsets[i + 1];
+      texts[i].resize(decodedSize(batch.ids.data(), first, last, first, vocab));
+      decodeTo(batch.ids.data(), first, last, first, vocab, texts[i].data());
+    }
+  };
+  const size_t thread_count = std::clamp<size_t>(
+   batch.ids.size() / kWorkBatch, 1, utils::globalThreadPool().maxThreads());
+  utils::forEachDynamicChunk(utils::globalThreadPool(),
+                             text_count,
+                             kChunkSize,
+                             thread_count,
+                             [](size_t) { return true; },
+                             decode_texts);
+  return texts;
 }
 
 namespace word_piece::fast {
 
+struct Tokenizer::Impl {
+  Impl(utils::CompiledVocab vocab, size_t word_cache_size)
+   : vocab(std::move(vocab)), word_cache(word_cache_size) {
+    if ((word_cache_size & (word_cache_size - 1)) != 0) {
+      throw std::runtime_error("Word cache size must be a power of two");
+    }
+  }
+
+  utils::CompiledVocab vocab;
+  WordCacheConfig word_cache;
+};
+
+Tokenizer::Tokenizer(const std::vector<std::string> &vocab,
+                     const Normalization &normalization,
+                     size_t word_cache_size)
+ : impl_(new Impl(
+  utils::CompiledVocab(utils::parseVocab(vocab, normalization)), word_cache_size)) {}
+
+Tokenizer::Tokenizer(const std::string &vocab_file,
+                     const Normalization &normalization,
+                     size_t word_cache_size)
+ : impl_(new Impl(utils::CompiledVocab::fromFile(vocab_file, normalization), word_cache_size)) {}
+
+Tokenizer::Tokenizer(Tokenizer &&other) noexcept = default;
+
+Tokenizer &Tokenizer::operator=(Tokenizer &&other) noexcept = default;
+
+Tokenizer::~Tokenizer() = default;
+
+std::vector<int> Tokenizer::encode(const std::string &text, std::vector<TokenSpan> *spans) const {
+  return encodeChunked(text, spans).join();
+}
+
+std::vector<int> Tokenizer::encodeFile(const std::string &text_file,
+                                       std::vector<TokenSpan> *spans) const {
+  return encodeFileChunked(text_file, spans).join();
+}
+
+WordCacheStats Tokenizer::wordCacheStats() const {
+  return {impl_->word_cache.hits.load(), impl_->word_cache.misses.load()};
+}
+
+size_t Tokenizer::idBytes() const { return utils::compactIds(impl_->vocab.size()) ? 2 : 4; }
+
+template <typename Id>
+BasicChunkedIds<Id> Tokenizer::encodeChunked(const std::string &text,
+                                             std::vector<TokenSpan> *spans) const {
+  if (sizeof(Id) < idBytes()) {
+    throw std::runtime_error("Vocab is too large for 16-bit ids");
+  }
+  return encodeFastWordPiece<Id>(text.data(), text.size(), impl_->vocab, &impl_->word_cache, spans);
+}
+
+template <typename Id>
+BasicChunkedIds<Id> Tokenizer::encodeFileChunked(const std::string &text_file,
+                                                 std::vector<TokenSpan> *spans) const {
+  if (sizeof(Id) < idBytes()) {
+    throw std::runtime_error("Vocab is too large for 16-bit ids");
+  }
+  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
+  return encodeFastWordPiece<Id>(
+   mmap.const_data(), mmap.size(), impl_->vocab, &impl_->word_cache, spans);
+}
+
+template ChunkedIds Tokenizer::encodeChunked<int>(const std::string &,
+                                                 std::vector<TokenSpan> *) const;
+template BasicChunkedIds<uint16_t>
+Tokenizer::encodeChunked<uint16_t>(const std::string &, std::vector<TokenSpan> *) const;
+template ChunkedIds Tokenizer::encodeFileChunked<int>(const std::string &,
+                                                     std::vector<TokenSpan> *) const;
+template BasicChunkedIds<uint16_t>
+Tokenizer::encodeFileChunked<uint16_t>(const std::string &, std::vector<TokenSpan> *) const;
+
+BatchEncoding Tokenizer::encodeBatch(const std::vector<std::string_view> &texts,
+                                     bool with_spans) const {
+  return encodeFastWordPieceBatch(texts, impl_->vocab, &impl_->word_cache, with_spans);
+}
+
+std::string Tokenizer::decode(const std::vector<int> &ids) const {
+  return decodeFastWordPiece(ids.data(), ids.size(), impl_->vocab);
+}
+
+std::vector<std::string> Tokenizer::decodeBatch(const BatchEncoding &batch) const {
+  return decodeFastWordPieceBatch(batch, impl_->vocab);
+}
+
+void Tokenizer::encodeExternal(const std::string &text_file,
+                               const std::string &out_file,
+                               size_t memory_limit,
+                               OutputFormat format) const {
+  // Decoded text takes 4 bytes per code point, ids are fewer.
+  const size_t batch_size = memory_limit / 2 / utils::kExternalBatchesInFlight;
+  utils::IdWriter writer(out_file, format, impl_->vocab.contentHash(), impl_->vocab.size());
+  utils::encodeExternalCompact(
+   text_file,
+   batch_size,
+   true,
+   impl_->vocab.normalization(),
+   impl_->vocab.size(),
+   [this](auto id, const char *, size_t, const std::vector<uint32_t> &code_points) {
+     using Id = decltype(id);
+     if (code_points.empty()) {
+       return BasicChunkedIds<Id>();
+     }
+     return encodeFastWordPieceImpl<Id>(code_points, impl_->vocab, &impl_->word_cache, nullptr);
+   },
+   writer);
+  writer.close();
+}
+
+struct StreamingEncoder::Impl {
+  Impl(const utils::CompiledVocab &vocab, const WordCacheConfig &word_cache, Callback callback)
+   : vocab(vocab),
+     word_cache(word_cache),
+     normalization(vocab.normalization()),
+     callback(std::move(callback)),
+     prefix_hash(std::max<size_t>(vocab.maxTokenLength(), 1)) {}
+
+  static bool isContinuation(char byte) {
+    return (static_cast<uint8_t>(byte) & 0xC0) == 0x80;
+  }
+
+  static size_t sequenceLength(char byte) {
+    const auto lead = static_cast<uint8_t>(byte);
+    return lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+  }
+
+  void decode(const char *begin, const char *end) {
+    // A huge chunk does not keep its buffer for the rest of the stream.
+    static constexpr size_t kMinBuffer = 1 << 16;
+    const size_t size = static_cast<size_t>(end - begin);
+    if (text.size() < text_size + size) {
+      text.resize(text_size + size);
+    } else if (text.size() > 4 * (text_size + size) + kMinBuffer) {
+      text.resize(text_size + size);
+      text.shrink_to_fit();
+    }
+    text_size += utils::decodeUtf8(begin, end, text.data() + text_size, normalization);
+  }
+
+  // Encodes text[0, end) and drops it. text[end] must be spacing, so no word crosses it.
+  void encode(size_t end) {
+    if (end == 0) {
+      return;
+    }
+    ids.clear();
+    {
+      const ThreadWordCache cache(&word_cache);
+      encodeFastWordPieceRange(text.data(), 0, end, vocab, cache.get(), ids, nullptr);
+    }
+    drop(end);
+  }
+
+  // Steps through a word longer than any token as encodeFastWordPieceRange does, while every
+  // step is decided by the decoded code points (all of them once finished), and drops what is
+  // done. Ids since the word start are pending, UNK may still replace them. Returns true once
+  // text[0] is a word start again and nothing is pending.
+  bool encodeLongWord(bool finished) {
+    const size_t max_len = vocab.maxTokenLength();
+    const auto is_word_prefix = [this](size_t index) {
+      return vkcom::is_spacing_char(text[index])
+          || (index == 0 ? prev_spacing : vkcom::is_spacing_char(text[index - 1]));
+    };
+    const auto flush = [this] {
+      ids.insert(ids.end(), word_ids.begin(), word_ids.end());
+      word_ids.clear();
+    };
+
+    ids.clear();
+    size_t begin = 0;
+    bool word_start = false;
+    while (!word_start && begin != text_size && (finished || text_size - begin > max_len)) {
+      if (skipping) {
+        word_start = is_word_prefix(begin);
+        skipping = !word_start;
+        begin += skipping ? 1 : 0;
+      } else if (vkcom::is_space(text[begin])) {
+        flush();
+        ++begin;
+        word_start = true;
+      } else {
+        const TokenMatch match = matchLongestToken(
+         text.data(), begin, text_size, is_word_prefix(begin), vocab, prefix_hash.data());
+        if (match.id != -1) {
+          word_ids.push_back(match.id);
+          begin += match.length;
+          if (begin != text_size && is_word_prefix(begin)) {
+            flush();
+            word_start = true;
+          }
+        } else {
+          word_ids.clear();
+          ids.push_back(vocab.unkTokenId());
+          size_t word_len = match.window;
+          if (!vkcom::is_punctuation(text[begin])) {
+            while (word_len < std::min(max_len, text_size - begin)
+                   && !vkcom::is_spacing_char(text[begin + word_len])) {
+              ++word_len;
+            }
+          }
+          begin += word_len;
+          skipping = true;
+        }
+      }
+    }
+    if (finished && !word_start) {
+      flush();
+      skipping = false;
+      word_start = true;
+    }
+    if (begin != 0) {
+      prev_spacing = vkcom::is_spacing_char(text[begin - 1]);
+    }
+    drop(begin);
+    in_word = !word_start;
+    return word_start;
+  }
+
+  void drop(size_t end) {
+    if (!ids.empty()) {
+      callback(ids);
+    }
+    std::memmove(text.data(), text.data() + end, (text_size - end) * sizeof(uint32_t));
+    text_size -= end;
+  }
+
+  const utils::CompiledVocab &vocab;
+  const WordCacheConfig &word_cache;
+  const word_piece::Normalization normalization;
+  Callback callback;
+  // The beginning of a UTF-8 sequence cut by the end of the previous chunk.
+  std::string pending_bytes;
+  // Decoded code points of the unfinished word. Unless in_word, text[0] is a word start.
+  // Otherwise encodeLongWord is in the middle of a word: word_ids are pending, skipping is set
+  // after UNK, prev_spacing tells if the code point before text[0] was spacing.
+  std::vector<uint32_t> text;
+  size_t text_size = 0;
+  bool in_word = false;
+  bool skipping = false;
+  bool prev_spacing = true;
+  std::vector<int> word_ids;
+  std::vector<uint64_t> prefix_hash;
+  std::vector<int> ids;
+};
+
+StreamingEncoder::StreamingEncoder(const Tokenizer &tokenizer, Callback callback)
+ : impl_(new Impl(tokenizer.impl_->vocab, tokenizer.impl_->word_cache, std::move(callback))) {}
+
+StreamingEncoder::StreamingEncoder(StreamingEncoder &&other) noexcept = default;
+
+StreamingEncoder &StreamingEncoder::operator=(StreamingEncoder &&other) noexcept = default;
+
+StreamingEncoder::~StreamingEncoder() = default;
+
+void StreamingEncoder::feed(const char *data, size_t size) {
+  Impl &impl = *impl_;
+  const size_t decoded_before = impl.text_size;
+
+  // The cut sequence takes continuation bytes up to its length. Whatever it turns out to be,
+  // decoding it alone gives the same as decoding it in the whole stream.
+  size_t begin = 0;
+  if (!impl.pending_bytes.empty()) {
+    const size_t length = Impl::sequenceLength(impl.pending_bytes[0]);
+    while (impl.pending_bytes.size() < length && begin < size
+           && Impl::isContinuation(data[begin])) {
+      impl.pending_bytes.push_back(data[begin++]);
+    }
+    if (impl.pending_bytes.size() < length && begin == size) {
+      return;
+    }
+    impl.decode(impl.pending_bytes.data(), impl.pending_bytes.data() + impl.pending_bytes.size());
+    impl.pending_bytes.clear();
+  }
+
+  size_t end = size;
+  for (size_t i = size; i > begin && size - i < 3; i--) {
+    if (!Impl::isContinuation(data[i - 1])) {
+      if (static_cast<uint8_t>(data[i - 1]) >= 0xC0
+          && i - 1 + Impl::sequenceLength(data[i - 1]) > size) {
+        end = i - 1;
+      }
+      break;
+    }
+  }
+  impl.decode(data + begin, data + end);
+  impl.pending_bytes.assign(data + end, size - end);
+
+  // Everything before the last spacing code point is finished. Older code points are already
+  // known to be a part of the unfinished word. A word longer than any token, e.g. a URL or
+  // base64, is encoded while it arrives instead, waiting for twice the window keeps the moves of
+  // the carried code points linear in the stream.
+  const size_t max_len = impl.vocab.maxTokenLength();
+  size_t checked = std::max<size_t>(decoded_before, 1);
+  while (true) {
+    if (impl.in_word) {
+      if (!impl.encodeLongWord(false)) {
+        break;
+      }
+      // The rest starts at a word start and is new to the search.
+      checked = 1;
+    }
+    for (size_t i = impl.text_size; i > checked; i--) {
+      if (vkcom::is_spacing_char(impl.text[i - 1])) {
+        impl.encode(i - 1);
+        break;
+      }
+    }
+    if (impl.text_size <= 2 * max_len + 1) {
+      break;
+    }
+    impl.in_word = true;
+    impl.prev_spacing = true;
+  }
+}
+
+void StreamingEncoder::finish() {
+  Impl &impl = *impl_;
+  impl.decode(impl.pending_bytes.data(), impl.pending_bytes.data() + impl.pending_bytes.size());
+  impl.pending_bytes.clear();
+  if (impl.in_word) {
+    impl.encodeLongWord(true);
+  }
+  impl.encode(impl.text_size);
+}
+
 std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab) {
-  const utils::WordPieceVocabulary vocab_utf8 = utils::parseVocab(vocab);
-  return encodeFastWordPiece(text.data(), text.size(), vocab_utf8);
+  return Tokenizer(vocab).encode(text);
 }
 
 std::vector<int> encode(const std::string &text_file, const std::string &vocab_file) {
-  const utils::WordPieceVocabulary vocab_utf8 = utils::readVocabFromFile(vocab_file);
-  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
-  return encodeFastWordPiece(mmap.const_data(), mmap.size(), vocab_utf8);
+  return Tokenizer(vocab_file).encodeFile(text_file);
 }
 
-std::vector<std::string> decode(const std::string vocab_file, const std::vector<int> &ids) {
-  const utils::WordPieceVocabulary vocab_utf8 = utils::readVocabFromFile(vocab_file);
+std::vector<std::string> decode(const std::string &vocab_file, const std::vector<int> &ids) {
+  const utils::CompiledVocab vocab = utils::CompiledVocab::fromFile(vocab_file);
   std::vector<std::string> result;
   result.reserve(ids.size());
 
   for (int id : ids) {
-    if (id < 0 || static_cast<size_t>(id) > vocab_utf8.tokens.size()) {
+    if (id < 0 || static_cast<size_t>(id) >= vocab.size()) {
       std::cerr << "no token " << id << std::endl;
       continue;
     }
-    const auto &token = vocab_utf8.tokens.at(static_cast<size_t>(id));
-    if (token.is_malformed) {
+    const utils::CompiledVocab::Token &token = vocab.token(static_cast<size_t>(id));
+    if (token.isMalformed()) {
       std::cerr << "trying to access malformed token" << std::endl;
-    } else if (token.is_prefix) {
-      result.push_back(vkcom::encode_utf8(token.word));
+    } else if (token.isPrefix()) {
+      result.emplace_back(vocab.utf8(static_cast<size_t>(id)));
     } else {
-      std::string encoded = "##" + vkcom::encode_utf8(token.word);
-      result.push_back(std::move(encoded));
+      std::string &word = result.emplace_back("##");
+      word += vocab.utf8(static_cast<size_t>(id));
     }
   }
 
@@ -189,34 +1018,9 @@ std::vector<std::string> decode(const std::string vocab_file, const std::vector<
 void encodeExternal(const std::string &text_file,
                     const std::string &vocab_file,
                     const std::string &out_file,
-                    size_t memory_limit) {
-  const utils::WordPieceVocabulary vocab_utf8 = utils::readVocabFromFile(vocab_file);
-
-  const size_t maxTextBatch = memory_limit / 2;
-  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
-  const char *begin = mmap.const_data();
-  size_t size = mmap.size();
-
-  std::ofstream fout(out_file);
-  while (size > 0) {
-    size_t batch;
-    if (size > maxTextBatch) {
-      batch = maxTextBatch;
-      while (batch < size
-             && !vkcom::starts_with_space(begin + batch - 1, static_cast<int64_t>(size - batch))) {
-        batch++;
-      }
-    } else {
-      batch = size;
-    }
-
-    std::vector<int> ids = encodeFastWordPiece(begin, batch, vocab_utf8);
-    for (int id : ids) {
-      fout << id << ' ';
-    }
-    begin += batch;
-    size -= batch;
-  }
+                    size_t memory_limit,
+                    OutputFormat format) {
+  Tokenizer(vocab_file).encodeExternal(text_file, out_file, memory_limit, format);
 }
 
 } // namespace word_piece::fast
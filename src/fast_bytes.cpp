@@ -0,0 +1,254 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#include "word_piece.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "compiled_vocab.hpp"
+#include "external.hpp"
+#include "third_party/thread_pool.hpp"
+#include "third_party/utf8.hpp"
+#include "utils.hpp"
+
+namespace {
+
+// Reads the code point at it and moves it past. Invalid bytes are skipped exactly like
+// vkcom::decode_utf8 does, so the sequence of read code points is the same as parseText gives.
+// Returns false at the end of the input.
+bool readCodePoint(const char *&it, const char *end, uint32_t *code_point) {
+  while (it != end) {
+    const auto byte = static_cast<uint8_t>(*it);
+    if (byte < 0x80) {
+      *code_point = byte;
+      ++it;
+      return true;
+    }
+    uint64_t utf8_len = 0;
+    *code_point = vkcom::chars_to_utf8(it, end - it, &utf8_len);
+    it += utf8_len;
+    if (*code_point != vkcom::INVALID_UNICODE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool peekCodePoint(const char *it, const char *end, uint32_t *code_point) {
+  return readCodePoint(it, end, code_point);
+}
+
+// Same algorithm as the fast engine, but the text stays UTF-8: the current window of at most
+// firstLengths().max_length code points is decoded on the fly and hashed with the vocab hash.
+template <typename Id>
+std::vector<Id> encodeBytesWorker(const char *begin,
+                                  const char *end,
+                                  const utils::CompiledVocab &vocab) {
+  const size_t max_len = vocab.maxTokenLength();
+  const Id unk_token_id = utils::toId<Id>(vocab.unkTokenId());
+
+  std::vector<Id> token_ids;
+  token_ids.reserve(static_cast<size_t>(end - begin) / std::max<size_t>(max_len, 1) + 1);
+
+  // window[i] is the i-th code point of the current word, window_end[i] points past its bytes
+  // and prefix_hash[i] is hash of window[0, i]. On the stack unless vocab has unusually long
+  // tokens.
+  static constexpr size_t kStackWindow = 256;
+  uint32_t stack_window[kStackWindow];
+  const char *stack_window_end[kStackWindow];
+  uint64_t stack_prefix_hash[kStackWindow];
+  const size_t heap_size = max_len > kStackWindow ? max_len : 0;
+  std::vector<uint32_t> heap_window(heap_size);
+  std::vector<const char *> heap_window_end(heap_size);
+  std::vector<uint64_t> heap_prefix_hash(heap_size);
+  uint32_t *window = heap_size > 0 ? heap_window.data() : stack_window;
+  const char **window_end = heap_size > 0 ? heap_window_end.data() : stack_window_end;
+  uint64_t *prefix_hash = heap_size > 0 ? heap_prefix_hash.data() : stack_prefix_hash;
+
+  // Whether the code point before the current position is spacing, true at the chunk begin.
+  bool after_spacing = true;
+  uint32_t code_point = 0;
+  const auto skip_spaces = [&] {
+    const char *next = begin;
+    while (readCodePoint(next, end, &code_point) && vkcom::is_space(code_point)) {
+      begin = next;
+      after_spacing = true;
+    }
+  };
+
+  skip_spaces();
+
+  size_t tokens_since_prefix = 0;
+
+  while (peekCodePoint(begin, end, &code_point)) {
+    const char *next = begin;
+    readCodePoint(next, end, &window[0]);
+    window_end[0] = next;
+    prefix_hash[0] = utils::CompiledVocab::hashStep(utils::CompiledVocab::kHashSeed, window[0]);
+    const bool is_prefix = after_spacing || vkcom::is_spacing_char(window[0]);
+    const utils::CompiledVocab::FirstLengths &first = vocab.firstLengths(is_prefix, window[0]);
+    size_t word_len = 1;
+    if (!vkcom::is_punctuation(window[0])) {
+      while (word_len < first.max_length && readCodePoint(next, end, &code_point)
+             && !vkcom::is_spacing_char(code_point)) {
+        window[word_len] = code_point;
+        window_end[word_len] = next;
+        prefix_hash[word_len]
+         = utils::CompiledVocab::hashStep(prefix_hash[word_len - 1], code_point);
+        ++word_len;
+      }
+    }
+
+    size_t match_len = word_len;
+    for (; match_len > 0; --match_len) {
+      if (!first.has(match_len)) {
+        continue;
+      }
+      const int token_id = vocab.find(is_prefix, prefix_hash[match_len - 1], window, match_len);
+      if (token_id != -1) {
+        ++tokens_since_prefix;
+        token_ids.push_back(static_cast<Id>(token_id));
+        begin = window_end[match_len - 1];
+        after_spacing = vkcom::is_spacing_char(window[match_len - 1]);
+        break;
+      }
+    }
+
+    if (match_len == 0) {
+      while (tokens_since_prefix > 0) {
+        token_ids.pop_back();
+        --tokens_since_prefix;
+      }
+      token_ids.push_back(unk_token_id);
+      begin = window_end[word_len - 1];
+      after_spacing = vkcom::is_spacing_char(window[word_len - 1]);
+      next = begin;
+      // UNK skips the window of the longest token of the vocab, not the shorter one probed.
+      if (!vkcom::is_punctuation(window[0])) {
+        for (size_t skip_len = word_len; skip_len < max_len && readCodePoint(next, end, &code_point)
+                                         && !vkcom::is_spacing_char(code_point);
+             skip_len++) {
+          begin = next;
+          after_spacing = false;
+        }
+        next = begin;
+      }
+      while (!after_spacing && readCodePoint(next, end, &code_point)
+             && !vkcom::is_spacing_char(code_point)) {
+        begin = next;
+      }
+    } else if (after_spacing
+               || (match_len < word_len ? vkcom::is_spacing_char(window[match_len])
+                                        : peekCodePoint(begin, end, &code_point)
+                                           && vkcom::is_spacing_char(code_point))) {
+      tokens_since_prefix = 0;
+    }
+
+    skip_spaces();
+  }
+
+  return token_ids;
+}
+
+template <typename Id>
+word_piece::BasicChunkedIds<Id>
+encodeFastBytes(const char *text, size_t size, const utils::CompiledVocab &vocab) {
+  static constexpr size_t kWorkBatch = 4'000'000;
+  static constexpr size_t kChunkSize = 1 << 18;
+
+  word_piece::BasicChunkedIds<Id> token_ids;
+  if (size < 2 * kWorkBatch) {
+    token_ids.chunks.push_back(encodeBytesWorker<Id>(text, text + size, vocab));
+    return token_ids;
+  }
+
+  // Chunks are split at ASCII spaces: such a byte is never a part of a valid multibyte
+  // sequence, so decoding of the chunks gives the same code points as decoding of the whole.
+  const size_t thread_count = std::min(utils::globalThreadPool().maxThreads(), size / kWorkBatch);
+  token_ids.chunks.resize(utils::dynamicChunkCount(size, kChunkSize));
+  utils::forEachDynamicChunk(
+   utils::globalThreadPool(),
+   size,
+   kChunkSize,
+   thread_count,
+   [text](size_t pos) {
+     return static_cast<uint8_t>(text[pos]) < 0x80
+         && vkcom::is_space(static_cast<uint8_t>(text[pos]));
+   },
+   [&](size_t chunk, size_t begin, size_t end) {
+     token_ids.chunks[chunk] = encodeBytesWorker<Id>(text + begin, text + end, vocab);
+   });
+  return token_ids;
+}
+
+} // namespace
+
+namespace word_piece::fast_bytes {
+
+struct Tokenizer::Impl {
+  utils::CompiledVocab vocab;
+};
+
+Tokenizer::Tokenizer(const std::vector<std::string> &vocab)
+ : impl_(new Impl{utils::CompiledVocab(utils::parseVocab(vocab))}) {}
+
+Tokenizer::Tokenizer(const std::string &vocab_file)
+ : impl_(new Impl{utils::CompiledVocab::fromFile(vocab_file)}) {}
+
+Tokenizer::Tokenizer(Tokenizer &&other) noexcept = default;
+
+Tokenizer &Tokenizer::operator=(Tokenizer &&other) noexcept = default;
+
+Tokenizer::~Tokenizer() = default;
+
+std::vector<int> Tokenizer::encode(const std::string &text) const {
+  return encodeFastBytes<int>(text.data(), text.size(), impl_->vocab).join();
+}
+
+std::vector<int> Tokenizer::encodeFile(const std::string &text_file) const {
+  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
+  return encodeFastBytes<int>(mmap.const_data(), mmap.size(), impl_->vocab).join();
+}
+
+void Tokenizer::encodeExternal(const std::string &text_file,
+                               const std::string &out_file,
+                               size_t memory_limit,
+                               OutputFormat format) const {
+  // No decoded copy of the text, only ids: at most one per byte.
+  const size_t id_bytes = utils::compactIds(impl_->vocab.size()) ? sizeof(uint16_t) : sizeof(int);
+  const size_t batch_size = memory_limit / id_bytes / utils::kExternalBatchesInFlight;
+  utils::IdWriter writer(out_file, format, impl_->vocab.contentHash(), impl_->vocab.size());
+  utils::encodeExternalCompact(
+   text_file,
+   batch_size,
+   false,
+   {},
+   impl_->vocab.size(),
+   [this](auto id, const char *text, size_t size, const std::vector<uint32_t> &) {
+     return encodeFastBytes<decltype(id)>(text, size, impl_->vocab);
+   },
+   writer);
+  writer.close();
+}
+
+std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab) {
+  return Tokenizer(vocab).encode(text);
+}
+
+std::vector<int> encode(const std::string &text_file, const std::string &vocab_file) {
+  return Tokenizer(vocab_file).encodeFile(text_file);
+}
+
+void encodeExternal(const std::string &text_file,
+                    const std::string &vocab_file,
+                    const std::string &out_file,
+                    size_t memory_limit,
+                    OutputFormat format) {
+  Tokenizer(vocab_file).encodeExternal(text_file, out_file, memory_limit, format);
+}
+
+} // namespace word_piece::fast_bytes
@@ -3,226 +3,686 @@
 #include "word_piece.hpp"
 
 #include <algorithm>
+#include <array>
 #include <cstring>
-#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include <boost/iostreams/device/mapped_file.hpp>
 
+#include "compiled_vocab.hpp"
+#include "external.hpp"
 #include "third_party/libsais.h"
 #include "third_party/utf8.hpp"
 #include "utils.hpp"
 
-template <typename Count>
-static void calcLcpImpl(const Count *str,
-                        const Count *suf_a,
-                        const std::vector<Count> &suf_array_index,
-                        std::vector<Count> &lcp,
-                        size_t begin,
-                        size_t end) {
+#if defined(_OPENMP)
+static constexpr bool kLibsaisMultithreaded = true;
+#else
+static constexpr bool kLibsaisMultithreaded = false;
+#endif
+
+static constexpr size_t kWorkBatch = 1'000'000;
+
+// Threads worth using for size items of linear work.
+static size_t workThreads(size_t size) {
+  if (size < 2 * kWorkBatch) {
+    return 1;
+  }
+  return std::min(utils::globalThreadPool().maxThreads(), size / kWorkBatch);
+}
+
+// Calls f(chunk, begin, end) for chunk_count equal parts of [0, size) on the thread pool and
+// waits for them. A single chunk runs on the calling thread.
+template <typename F>
+static void forEachChunk(size_t size, size_t chunk_count, const F &f) {
+  if (chunk_count <= 1) {
+    f(size_t{0}, size_t{0}, size);
+    return;
+  }
+  const size_t chunk_size = size / chunk_count + 1;
+  utils::TaskGroup tasks(utils::globalThreadPool());
+  for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+    const size_t begin = std::min(size, chunk * chunk_size);
+    const size_t end = std::min(size, begin + chunk_size);
+    tasks.submit([&f, chunk, begin, end] { f(chunk, begin, end); });
+  }
+  tasks.wait();
+}
+
+static bool isWordStart(const uint32_t *text, size_t pos) {
+  return pos == 0 || vkcom::is_spacing_char(text[pos]) || vkcom::is_spacing_char(text[pos - 1]);
+}
+
+// Common prefix of the suffixes at lhs and rhs, at most cap.
+static size_t
+commonPrefix(const uint32_t *text, size_t text_size, size_t lhs, size_t rhs, size_t cap) {
+  const size_t limit = std::min(cap, text_size - std::max(lhs, rhs));
+  size_t common = 0;
+  while (common < limit && text[lhs + common] == text[rhs + common]) {
+    common++;
+  }
+  return common;
+}
+
+// The top bit of an Lcp value flags a word start of the text, the rest is the common prefix.
+template <typename Lcp>
+constexpr Lcp kWordStartFlag = static_cast<Lcp>(Lcp{1} << (8 * sizeof(Lcp) - 1));
+
+template <typename Count, typename Lcp>
+static void calcPlcpImpl(const uint32_t *text,
+                         size_t text_size,
+                         const std::vector<Count> &phi,
+                         size_t first_suffix,
+                         size_t cap,
+                         std::vector<Lcp> &plcp,
+                         size_t begin,
+                         size_t end) {
+  // plcp[i] >= plcp[i - 1] - 1 holds for the capped values as well.
   size_t prefix_len = 0;
   for (size_t i = begin; i < end; i++) {
-    const size_t sa_index = static_cast<size_t>(suf_array_index[i]);
-    if (sa_index + 1 != suf_array_index.size()) {
-      const size_t suf_index = static_cast<size_t>(suf_a[sa_index + 1]);
-
-      while (std::max(i, suf_index) + prefix_len < suf_array_index.size()
-             && str[i + prefix_len] == str[suf_index + prefix_len]) {
+    Lcp value = 0;
+    if (i == first_suffix) {
+      prefix_len = 0;
+    } else {
+      const size_t suf_index = static_cast<size_t>(phi[i]);
+      while (prefix_len < cap && std::max(i, suf_index) + prefix_len < text_size
+             && text[i + prefix_len] == text[suf_index + prefix_len]) {
         prefix_len++;
       }
-      lcp[sa_index] = static_cast<Count>(prefix_len);
+      value = static_cast<Lcp>(prefix_len);
       if (prefix_len > 0) {
         prefix_len--;
       }
     }
+    if (isWordStart(text, i)) {
+      value |= kWordStartFlag<Lcp>;
+    }
+    plcp[i] = value;
   }
 }
 
-template <typename Count>
-static std::vector<Count>
-calcLcp(const Count *str, const Count *suf_a, const std::vector<Count> &suf_array_index) {
-  static constexpr size_t kWorkBatch = 1'000'000;
-  const size_t total_length = suf_array_index.size();
+// lcp[i] is the common prefix of suffixes suf[i - 1] and suf[i] capped at cap, zero for i = 0,
+// with kWordStartFlag set if suf[i] starts a word.
+//
+// A true suffix array goes through the permuted LCP: plcp[suf[i]] = lcp[i] in text order through
+// phi[suf[i]] = suf[i - 1], which takes amortized O(1) per position and needs neither the inverse
+// suffix array nor the string in suffix array order. Suffixes sorted by their first cap symbols
+// only (see sortSuffixPrefixes) lack the plcp[i] >= plcp[i - 1] - 1 property, so their common
+// prefixes are counted directly, at most cap symbols each.
+template <typename Lcp, typename Count>
+static std::vector<Lcp> calcLcp(const uint32_t *text,
+                                size_t text_size,
+                                const Count *suf,
+                                size_t cap,
+                                bool exact_suffix_array) {
+  const size_t thread_count = workThreads(text_size);
+  std::vector<Lcp> lcp(text_size);
+
+  if (!exact_suffix_array) {
+    forEachChunk(text_size, thread_count, [&](size_t, size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        const size_t pos = static_cast<size_t>(suf[i]);
+        Lcp value = 0;
+        if (i > 0) {
+          value = static_cast<Lcp>(
+           commonPrefix(text, text_size, pos, static_cast<size_t>(suf[i - 1]), cap));
+        }
+        if (isWordStart(text, pos)) {
+          value |= kWordStartFlag<Lcp>;
+        }
+        lcp[i] = value;
+      }
+    });
+    return lcp;
+  }
 
-  std::vector<Count> lcp(total_length - 1);
+  // phi is dead before lcp is gathered, so that they are not alive at the same time.
+  std::vector<Lcp> plcp(text_size);
+  {
+    std::vector<Count> phi(text_size);
+    for (size_t i = 1; i < text_size; i++) {
+      phi[static_cast<size_t>(suf[i])] = suf[i - 1];
+    }
+    const size_t first_suffix = static_cast<size_t>(suf[0]);
+    forEachChunk(text_size, thread_count, [&](size_t, size_t begin, size_t end) {
+      calcPlcpImpl(text, text_size, phi, first_suffix, cap, plcp, begin, end);
+    });
+  }
+  forEachChunk(text_size, thread_count, [&](size_t, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      lcp[i] = plcp[static_cast<size_t>(suf[i])];
+    }
+  });
+  return lcp;
+}
 
-  if (total_length < 2 * kWorkBatch) {
-    calcLcpImpl(str, suf_a, suf_array_index, lcp, 0, total_length);
-  } else {
-    const size_t thread_count
-     = std::min(utils::globalThreadPool().maxThreads(), total_length / kWorkBatch);
-    const size_t work_batch = total_length / thread_count + 1;
-    size_t work_start = 0;
-    for (size_t i = 0; i < thread_count; i++) {
-      size_t work_end = std::min(total_length, work_start + work_batch);
-      utils::globalThreadPool().submit([str, suf_a, work_start, work_end, &suf_array_index, &lcp] {
-        calcLcpImpl(str, suf_a, suf_array_index, lcp, work_start, work_end);
-      });
-      work_start = work_end;
+// The vocab side of the suffix array is built once per vocab: only suffixes which start a token
+// matter to the sweeps, so it is the allowed tokens in sorted order (a token sorts before every
+// string it is a proper prefix of) and the common prefix of each with the previous one.
+struct LinearWordPieceVocab {
+  explicit LinearWordPieceVocab(utils::CompiledVocab compiled_vocab)
+   : vocab(std::move(compiled_vocab)) {
+    vocab_length = vocab.poolSize() + vocab.size();
+    for (size_t i = 0; i < vocab.size(); i++) {
+      const auto &token = vocab.token(i);
+      longest_word_vocab = std::max(longest_word_vocab, size_t{token.length});
+      if (!token.isMalformed() && !token.isSpecial()) {
+        sorted_tokens.push_back(static_cast<int>(i));
+      }
     }
+
+    std::stable_sort(sorted_tokens.begin(), sorted_tokens.end(), [this](int lhs, int rhs) {
+      return word(lhs) < word(rhs);
+    });
+    sorted_lcp.resize(sorted_tokens.size());
+    for (size_t i = 1; i < sorted_tokens.size(); i++) {
+      const auto prev = word(sorted_tokens[i - 1]);
+      const auto cur = word(sorted_tokens[i]);
+      const auto mismatch = std::mismatch(prev.begin(), prev.end(), cur.begin(), cur.end());
+      sorted_lcp[i] = static_cast<uint32_t>(mismatch.first - prev.begin());
+    }
+  }
+
+  std::basic_string_view<uint32_t> word(int token_id) const {
+    return {vocab.word(static_cast<size_t>(token_id)),
+            vocab.token(static_cast<size_t>(token_id)).length};
   }
 
-  utils::globalThreadPool().waitCompletion();
+  const utils::CompiledVocab vocab;
+  size_t vocab_length = 0;
+  size_t longest_word_vocab = 1;
+  std::vector<int> sorted_tokens;
+  std::vector<uint32_t> sorted_lcp;
+};
 
-  return lcp;
+// libsais builds 32-bit suffix arrays only, a 64-bit SACA would be another overload.
+static int32_t
+buildSuffixArray(int32_t *S, int32_t *suf, size_t total_length, uint32_t alphabet_size, size_t fs) {
+#if defined(_OPENMP)
+#pragma message "libsais compiled with openmp"
+  const int32_t threads_count = total_length > 10'000'000 ? 0 : 1;
+  return libsais_int_omp(S,
+                         suf,
+                         static_cast<int32_t>(total_length),
+                         static_cast<int32_t>(alphabet_size),
+                         static_cast<int32_t>(fs),
+                         threads_count);
+#else
+#pragma message "libsais compiled without openmp"
+  return libsais_int(S,
+                     suf,
+                     static_cast<int32_t>(total_length),
+                     static_cast<int32_t>(alphabet_size),
+                     static_cast<int32_t>(fs));
+#endif
 }
 
-static std::vector<int> encodeLinearWordPieceImpl(const std::vector<uint32_t> &text,
-                                                  const utils::WordPieceVocabulary &vocab) {
-  using Count = int32_t;
-  static_assert(std::is_same_v<Count, int32_t>, "64-bit unsupported"); // TODO
+// Sorts the text positions by the first cap symbols of their suffixes, a suffix which ends
+// earlier goes first, on the thread pool: a sample sort which splits positions into buckets by
+// sampled splitters, scatters them in place and sorts the buckets concurrently. Without OpenMP
+// libsais is single-threaded. Positions with equal prefixes come in any order, which is enough
+// for the sweeps: their common prefixes are capped at cap anyway.
+//
+// Symbols are renumbered densely and the first of them are packed into a 64-bit key, so most
+// comparisons do not touch the text: with a small alphabet the key is the whole prefix.
+template <typename Count>
+static void sortSuffixPrefixes(const uint32_t *text,
+                               size_t text_size,
+                               size_t cap,
+                               size_t thread_count,
+                               Count *suf) {
+  static constexpr size_t kBucketsPerThread = 8;
+  static constexpr size_t kOversampling = 32;
+
+  std::vector<uint32_t> chunk_max(thread_count);
+  forEachChunk(text_size, thread_count, [&](size_t chunk, size_t begin, size_t end) {
+    if (begin < end) {
+      chunk_max[chunk] = *std::max_element(text + begin, text + end);
+    }
+  });
+  const uint32_t max_symbol = *std::max_element(chunk_max.begin(), chunk_max.end());
+  std::vector<std::vector<uint64_t>> present(thread_count,
+                                             std::vector<uint64_t>(max_symbol / 64 + 1));
+  forEachChunk(text_size, thread_count, [&](size_t chunk, size_t begin, size_t end) {
+    for (size_t pos = begin; pos < end; pos++) {
+      present[chunk][text[pos] / 64] |= uint64_t{1} << (text[pos] % 64);
+    }
+  });
+  // 0 is the end of the text.
+  std::vector<uint32_t> symbol_rank(size_t{max_symbol} + 1);
+  uint32_t alphabet_size = 0;
+  for (size_t word = 0; word < present[0].size(); word++) {
+    uint64_t bits = 0;
+    for (const std::vector<uint64_t> &chunk_present : present) {
+      bits |= chunk_present[word];
+    }
+    for (; bits != 0; bits &= bits - 1) {
+      symbol_rank[word * 64 + static_cast<size_t>(__builtin_ctzll(bits))] = ++alphabet_size;
+    }
+  }
+  present.clear();
 
-  size_t total_length = text.size() + 1;
-  size_t longest_word_vocab = 1;
-  for (const auto &token : vocab.tokens) {
-    total_length += token.word.size() + 1;
-    longest_word_vocab = std::max(longest_word_vocab, token.word.size());
+  size_t symbol_bits = 1;
+  while ((uint64_t{1} << symbol_bits) <= alphabet_size) {
+    symbol_bits++;
   }
+  const size_t key_symbols = std::min(cap, 64 / symbol_bits);
+  const auto key_of = [&](size_t pos) {
+    uint64_t key = 0;
+    for (size_t k = 0; k < key_symbols; k++) {
+      key = key << symbol_bits | (pos + k < text_size ? symbol_rank[text[pos + k]] : 0);
+    }
+    return key;
+  };
+  // Compares (key, position) pairs, the text only if the keys are equal.
+  using Keyed = std::pair<uint64_t, Count>;
+  const auto less = [text, text_size, cap, key_symbols](const Keyed &lhs, const Keyed &rhs) {
+    if (lhs.first != rhs.first || key_symbols == cap) {
+      return lhs.first < rhs.first;
+    }
+    const size_t lhs_pos = std::min(text_size, static_cast<size_t>(lhs.second) + key_symbols);
+    const size_t rhs_pos = std::min(text_size, static_cast<size_t>(rhs.second) + key_symbols);
+    const size_t rest = cap - key_symbols;
+    return std::lexicographical_compare(text + lhs_pos,
+                                        text + lhs_pos + std::min(rest, text_size - lhs_pos),
+                                        text + rhs_pos,
+                                        text + rhs_pos + std::min(rest, text_size - rhs_pos));
+  };
+  const auto keyed = [&key_of](size_t pos) { return Keyed{key_of(pos), static_cast<Count>(pos)}; };
 
-  Count *S = new Count[total_length];
-  uint32_t alphabet_size = 1;
+  const size_t bucket_count = thread_count * kBucketsPerThread;
+  std::vector<Keyed> sample(bucket_count * kOversampling);
+  std::mt19937_64 rnd(text_size);
+  for (Keyed &item : sample) {
+    item = keyed(rnd() % text_size);
+  }
+  std::sort(sample.begin(), sample.end(), less);
+  std::vector<Keyed> splitters(bucket_count - 1);
+  for (size_t i = 0; i < splitters.size(); i++) {
+    splitters[i] = sample[(i + 1) * kOversampling];
+  }
+  const auto bucket_of = [&splitters, &less, &keyed](size_t pos) {
+    return static_cast<size_t>(
+     std::upper_bound(splitters.begin(), splitters.end(), keyed(pos), less) - splitters.begin());
+  };
 
-  {
-    size_t pos = 0;
-    for (uint32_t c : text) {
-      S[pos++] = static_cast<Count>(c);
-      alphabet_size = std::max(alphabet_size, c);
-    }
-    S[pos++] = 1;
-    for (const utils::WordPieceToken &token : vocab.tokens) {
-      for (uint32_t c : token.word) {
-        S[pos++] = static_cast<Count>(c);
-        alphabet_size = std::max(alphabet_size, c);
-      }
-      S[pos++] = 1;
+  std::vector<std::vector<size_t>> offsets(thread_count, std::vector<size_t>(bucket_count));
+  forEachChunk(text_size, thread_count, [&](size_t chunk, size_t begin, size_t end) {
+    for (size_t pos = begin; pos < end; pos++) {
+      offsets[chunk][bucket_of(pos)]++;
+    }
+  });
+  std::vector<size_t> bucket_begin(bucket_count + 1);
+  for (size_t bucket = 0, offset = 0; bucket < bucket_count; bucket++) {
+    bucket_begin[bucket] = offset;
+    for (size_t chunk = 0; chunk < thread_count; chunk++) {
+      const size_t count = offsets[chunk][bucket];
+      offsets[chunk][bucket] = offset;
+      offset += count;
     }
   }
-
-  ++alphabet_size; // [0; max symbol]
-  if (total_length > 2'000'000'000ull || alphabet_size > 2'000'000'000) {
-    throw std::runtime_error("64bit not implemented");
+  bucket_begin[bucket_count] = text_size;
+  forEachChunk(text_size, thread_count, [&](size_t chunk, size_t begin, size_t end) {
+    for (size_t pos = begin; pos < end; pos++) {
+      suf[offsets[chunk][bucket_of(pos)]++] = static_cast<Count>(pos);
+    }
+  });
+
+  // Keys of a bucket live only while it is sorted, a few buckets at a time.
+  utils::TaskGroup tasks(utils::globalThreadPool());
+  for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+    tasks.submit([suf, &bucket_begin, &less, &keyed, bucket] {
+      Count *begin = suf + bucket_begin[bucket];
+      const size_t size = bucket_begin[bucket + 1] - bucket_begin[bucket];
+      std::vector<Keyed> items(size);
+      for (size_t i = 0; i < size; i++) {
+        items[i] = keyed(static_cast<size_t>(begin[i]));
+      }
+      std::sort(items.begin(), items.end(), less);
+      for (size_t i = 0; i < size; i++) {
+        begin[i] = items[i].second;
+      }
+    });
   }
+  tasks.wait();
+}
 
-  size_t fs = 0;
-  if (total_length > 1'000'000 && total_length > alphabet_size && alphabet_size < 100'000'000) {
-    fs = 6 * alphabet_size;
-    if (fs > total_length) {
-      fs = 4 * alphabet_size;
+// Where the sorted tokens go among the text suffixes: token j goes right before text rank
+// insert_at[j] and has common prefix token_lcp[j] with the element before it in the merged
+// order. lcp[i] of a rank right after tokens becomes the common prefix with the last of them,
+// its flag is kept. A text suffix which ends inside a token goes before it. Chunks of tokens are
+// searched for in the suffix array concurrently instead of merging it with the whole text.
+template <typename Count, typename Lcp>
+static void placeTokens(const uint32_t *text,
+                        size_t text_size,
+                        const Count *suf,
+                        const LinearWordPieceVocab &compiled,
+                        std::vector<Lcp> &lcp,
+                        std::vector<size_t> &insert_at,
+                        std::vector<Lcp> &token_lcp) {
+  const std::vector<int> &tokens = compiled.sorted_tokens;
+  insert_at.resize(tokens.size());
+  token_lcp.resize(tokens.size());
+  const size_t thread_count
+   = std::min(utils::globalThreadPool().maxThreads(), tokens.size() / 1'000 + 1);
+
+  // Common prefix of a token with the suffix at rank, which is at most the token length.
+  const auto token_common = [&](size_t j, size_t rank) {
+    const auto word = compiled.word(tokens[j]);
+    const size_t pos = static_cast<size_t>(suf[rank]);
+    const size_t limit = std::min(word.size(), text_size - pos);
+    size_t common = 0;
+    while (common < limit && text[pos + common] == word[common]) {
+      common++;
     }
-    if (fs > total_length) {
-      fs = alphabet_size;
+    return common;
+  };
+
+  const auto text_first = [&](size_t j, size_t rank) {
+    const auto word = compiled.word(tokens[j]);
+    const size_t pos = static_cast<size_t>(suf[rank]);
+    const size_t common = token_common(j, rank);
+    return common < word.size() && (pos + common == text_size || text[pos + common] < word[common]);
+  };
+
+  // insert_at is non-decreasing, so a token gallops from the place of the previous one: short
+  // texts take O(text + tokens) like a merge.
+  forEachChunk(tokens.size(), thread_count, [&](size_t, size_t begin, size_t end) {
+    for (size_t j = begin; j < end; j++) {
+      size_t lo = j > begin ? insert_at[j - 1] : 0;
+      size_t hi = lo;
+      for (size_t step = 1; hi < text_size && text_first(j, hi); step *= 2) {
+        lo = hi + 1;
+        hi = std::min(text_size, hi + step);
+      }
+      while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (text_first(j, mid)) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      insert_at[j] = lo;
+    }
+  });
+
+  forEachChunk(tokens.size(), thread_count, [&](size_t, size_t begin, size_t end) {
+    for (size_t j = begin; j < end; j++) {
+      const size_t rank = insert_at[j];
+      if (j > 0 && insert_at[j - 1] == rank) {
+        token_lcp[j] = static_cast<Lcp>(compiled.sorted_lcp[j]);
+      } else {
+        token_lcp[j] = static_cast<Lcp>(rank > 0 ? token_common(j, rank - 1) : 0);
+      }
+      const bool last_before_rank = j + 1 == tokens.size() || insert_at[j + 1] != rank;
+      if (last_before_rank && rank < text_size) {
+        lcp[rank] = static_cast<Lcp>((lcp[rank] & kWordStartFlag<Lcp>) | token_common(j, rank));
+      }
+    }
+  });
+}
+
+static constexpr int kNoMatchedSuffix = -1;
+
+// (token, |token|) of suffix tokens and of prefix tokens, lengths increase to the top.
+template <typename Lcp>
+using TokenStacks = std::array<std::vector<std::pair<int, Lcp>>, 2>;
+
+// Text suffixes in rank order with the sorted tokens placed among them, see placeTokens.
+template <typename Count, typename Lcp>
+struct MergedOrder {
+  const Count *suf;
+  size_t text_size;
+  const std::vector<Lcp> &lcp;
+  const std::vector<size_t> &insert_at;
+  const std::vector<Lcp> &token_lcp;
+  const LinearWordPieceVocab &compiled;
+};
+
+// Sweeps the monotonic stacks over the merged elements of text ranks [lo, hi): the ranks and
+// the tokens right before them, and the tokens after the last rank if hi is the end. Goes left
+// to right, or right to left, starting from stacks. Answers go to best if it is given, the
+// right sweep keeps the left answer if it is strictly longer. Returns the smallest common
+// prefix the stacks were cut to: whatever came in longer than it is gone at the end.
+template <typename Count, typename Lcp>
+static size_t sweepTokens(const MergedOrder<Count, Lcp> &merged,
+                          size_t lo,
+                          size_t hi,
+                          bool right_side,
+                          TokenStacks<Lcp> &stacks,
+                          std::vector<int> *best) {
+  const utils::CompiledVocab &vocab = merged.compiled.vocab;
+  const std::vector<int> &tokens = merged.compiled.sorted_tokens;
+  const std::vector<size_t> &insert_at = merged.insert_at;
+  const std::vector<Lcp> &lcp = merged.lcp;
+  const std::vector<Lcp> &token_lcp = merged.token_lcp;
+
+  size_t min_common = std::numeric_limits<size_t>::max();
+  const auto pop = [&stacks, &min_common](size_t common) {
+    min_common = std::min(min_common, common);
+    for (auto &st : stacks) {
+      while (!st.empty() && static_cast<size_t>(st.back().second) > common) {
+        st.pop_back();
+      }
+    }
+  };
+  const auto push = [&stacks, &tokens, &vocab](size_t j) {
+    const auto &token = vocab.token(static_cast<size_t>(tokens[j]));
+    stacks[token.isPrefix()].emplace_back(tokens[j], static_cast<Lcp>(token.length));
+  };
+  const auto visit_text = [&](size_t rank) {
+    const auto &st = stacks[(lcp[rank] & kWordStartFlag<Lcp>) != 0];
+    if (best == nullptr || st.empty()) {
+      return;
     }
+    int &current = (*best)[static_cast<size_t>(merged.suf[rank])];
+    if (!right_side || current == kNoMatchedSuffix
+        || vocab.token(static_cast<size_t>(current)).length
+            <= static_cast<size_t>(st.back().second)) {
+      current = st.back().first;
+    }
+  };
+  const auto first_token = [&insert_at](size_t rank) {
+    return static_cast<size_t>(std::lower_bound(insert_at.begin(), insert_at.end(), rank)
+                               - insert_at.begin());
+  };
+
+  if (!right_side) {
+    for (size_t i = lo, j = first_token(lo); i < hi; i++) {
+      for (; j < tokens.size() && insert_at[j] == i; j++) {
+        pop(token_lcp[j]);
+        push(j);
+      }
+      pop(lcp[i] & ~kWordStartFlag<Lcp>);
+      visit_text(i);
+    }
+    return min_common;
   }
-  Count *suf = new Count[total_length + fs];
-  Count saca_rc = 0;
 
-#if defined(_OPENMP)
-#pragma message "libsais compiled with openmp"
-  Count threads_count = total_length > 10'000'000 ? 0 : 1;
-  saca_rc = libsais_int_omp(S,
-                            suf,
-                            static_cast<Count>(total_length),
-                            static_cast<Count>(alphabet_size),
-                            static_cast<Count>(fs),
-                            threads_count);
-#else
-#pragma message "libsais compiled without openmp"
-  saca_rc = libsais_int(S,
-                        suf,
-                        static_cast<Count>(total_length),
-                        static_cast<Count>(alphabet_size),
-                        static_cast<Count>(fs));
-#endif
+  size_t j = hi == merged.text_size ? tokens.size() : first_token(hi);
+  // Common prefix with the element visited last, that is the next one in the merged order.
+  size_t next_common = 0;
+  if (hi < merged.text_size) {
+    next_common = j < tokens.size() && insert_at[j] == hi ? token_lcp[j]
+                                                          : lcp[hi] & ~kWordStartFlag<Lcp>;
+  }
+  for (size_t i = hi;;) {
+    for (; j > 0 && insert_at[j - 1] == i; j--) {
+      pop(next_common);
+      push(j - 1);
+      next_common = token_lcp[j - 1];
+    }
+    if (i == lo) {
+      break;
+    }
+    --i;
+    pop(next_common);
+    visit_text(i);
+    next_common = lcp[i] & ~kWordStartFlag<Lcp>;
+  }
+  return min_common;
+}
 
-  if (saca_rc != 0) {
-    throw std::runtime_error("SACA return code: " + std::to_string(saca_rc));
+// Stacks at the start of a segment from the ones at the start of the previous one (in the sweep
+// direction) and what the previous segment does to empty stacks.
+template <typename Lcp>
+static TokenStacks<Lcp> seedStacks(const TokenStacks<Lcp> &incoming,
+                                   size_t min_common,
+                                   const TokenStacks<Lcp> &local) {
+  TokenStacks<Lcp> stacks;
+  for (size_t kind = 0; kind < stacks.size(); kind++) {
+    for (const auto &item : incoming[kind]) {
+      if (static_cast<size_t>(item.second) > min_common) {
+        break;
+      }
+      stacks[kind].push_back(item);
+    }
+    stacks[kind].insert(stacks[kind].end(), local[kind].begin(), local[kind].end());
   }
+  return stacks;
+}
 
-  // NOTE: libsais has PLCP and LCP functions, but they will take longer.
-  std::vector<Count> suf_array_index(total_length);
-  for (size_t i = 0; i < total_length; i++) {
-    suf_array_index[static_cast<size_t>(suf[i])] = static_cast<Count>(i);
+// For every text position the longest allowed token of the kind the position needs (prefix
+// tokens at word starts, suffix tokens elsewhere) which the text continues with there, or
+// kNoMatchedSuffix. A token continues the suffix of rank r iff the common prefix of all ranks
+// between the token and r is at least its length, so a monotonic stack of tokens swept left to
+// right over the suffix array merged with the tokens and then right to left finds them. Both
+// kinds share the sweeps.
+//
+// The sweeps run by segments of ranks on the thread pool. A stack holds at most one token per
+// length, so segments first sweep from empty stacks without answering, which gives what each
+// segment leaves to the next one and how short it cuts what it got. Seeding every segment from
+// its predecessors is then sequential but costs O(segments * longest token).
+template <typename Count, typename Lcp>
+static std::vector<int> closestTokens(const uint32_t *text,
+                                      size_t text_size,
+                                      const Count *suf,
+                                      bool exact_suffix_array,
+                                      const LinearWordPieceVocab &compiled) {
+  std::vector<Lcp> lcp
+   = calcLcp<Lcp>(text, text_size, suf, compiled.longest_word_vocab + 1, exact_suffix_array);
+  std::vector<size_t> insert_at;
+  std::vector<Lcp> token_lcp;
+  placeTokens(text, text_size, suf, compiled, lcp, insert_at, token_lcp);
+  const MergedOrder<Count, Lcp> merged{suf, text_size, lcp, insert_at, token_lcp, compiled};
+
+  std::vector<int> best(text_size, kNoMatchedSuffix);
+  const size_t segment_count = workThreads(text_size);
+  if (segment_count == 1) {
+    TokenStacks<Lcp> stacks;
+    sweepTokens(merged, 0, text_size, false, stacks, &best);
+    stacks = {};
+    sweepTokens(merged, 0, text_size, true, stacks, &best);
+    return best;
   }
 
-  std::vector<Count> lcp = calcLcp<Count>(S, suf, suf_array_index);
-  delete[] S;
-  delete[] suf;
+  std::vector<size_t> bounds(segment_count + 1);
+  for (size_t i = 0; i <= segment_count; i++) {
+    bounds[i] = text_size / segment_count * i + std::min(i, text_size % segment_count);
+  }
+  std::vector<TokenStacks<Lcp>> left_local(segment_count);
+  std::vector<TokenStacks<Lcp>> right_local(segment_count);
+  std::vector<size_t> left_min(segment_count);
+  std::vector<size_t> right_min(segment_count);
+  forEachChunk(segment_count, segment_count, [&](size_t segment, size_t, size_t) {
+    left_min[segment] = sweepTokens(
+     merged, bounds[segment], bounds[segment + 1], false, left_local[segment], nullptr);
+    right_min[segment] = sweepTokens(
+     merged, bounds[segment], bounds[segment + 1], true, right_local[segment], nullptr);
+  });
+
+  std::vector<TokenStacks<Lcp>> left_in(segment_count);
+  std::vector<TokenStacks<Lcp>> right_in(segment_count);
+  for (size_t segment = 1; segment < segment_count; segment++) {
+    left_in[segment]
+     = seedStacks(left_in[segment - 1], left_min[segment - 1], left_local[segment - 1]);
+  }
+  for (size_t segment = segment_count - 1; segment-- > 0;) {
+    right_in[segment]
+     = seedStacks(right_in[segment + 1], right_min[segment + 1], right_local[segment + 1]);
+  }
 
-  static constexpr int kNoMatchedSuffix = -1;
-  std::vector<int> who(total_length, kNoMatchedSuffix);
+  forEachChunk(segment_count, segment_count, [&](size_t segment, size_t, size_t) {
+    sweepTokens(merged, bounds[segment], bounds[segment + 1], false, left_in[segment], &best);
+    sweepTokens(merged, bounds[segment], bounds[segment + 1], true, right_in[segment], &best);
+  });
+  return best;
+}
 
-  size_t vocab_start_pos = text.size() + 1;
-  for (size_t i = 0; i < vocab.tokens.size(); i++) {
-    who[static_cast<size_t>(suf_array_index[vocab_start_pos])] = static_cast<int>(i);
-    vocab_start_pos += vocab.tokens[i].word.size() + 1;
+// Encodes text[0, text_size) with a suffix array of the text merged with the sorted tokens.
+// Count must hold the text size, spans are in code point indices of the segment.
+template <typename Count, typename Id>
+static word_piece::BasicChunkedIds<Id>
+encodeLinearWordPieceSegment(const uint32_t *text,
+                             size_t text_size,
+                             const LinearWordPieceVocab &compiled,
+                             std::vector<word_piece::TokenSpan> *spans) {
+  const utils::CompiledVocab &vocab = compiled.vocab;
+  const size_t longest_word_vocab = compiled.longest_word_vocab;
+
+  if (text_size > static_cast<size_t>(std::numeric_limits<Count>::max())) {
+    throw std::runtime_error("Text is too long for the suffix array");
   }
-  const auto get_closest
-   = [longest_word_vocab, total_length, &lcp, &who, &vocab](bool right_side,
-                                                            bool is_prefix_predicate) {
-       std::vector<int> result(total_length, kNoMatchedSuffix);
-       // (i, |i|); i is index in ts
-       std::vector<std::pair<int, Count>> st;
-       st.reserve(longest_word_vocab);
-       for (size_t i = 0; i < total_length; i++) {
-         if (i > 0) {
-           const size_t index = right_side ? total_length - i - 1 : i - 1;
-           while (!st.empty() && st.back().second > lcp[index]) {
-             st.pop_back();
-           }
-         }
 
-         const size_t index = right_side ? total_length - 1 - i : i;
-         if (who[index] != kNoMatchedSuffix) {
-           const auto &token = vocab.tokens[static_cast<size_t>(who[index])];
-           if (token.is_prefix == is_prefix_predicate && !token.is_malformed && !token.is_special) {
-             Count len = static_cast<Count>(token.word.size());
-             st.emplace_back(who[index], len);
-           }
-         }
-         if (!st.empty()) {
-           result[i] = st.back().first;
-         }
-       }
-       return result;
-     };
+  std::unique_ptr<Count[]> suf;
+  const size_t thread_count = workThreads(text_size);
+  const bool exact_suffix_array = kLibsaisMultithreaded || thread_count == 1;
+  if (!exact_suffix_array) {
+    suf.reset(new Count[text_size]);
+    sortSuffixPrefixes(text, text_size, longest_word_vocab + 1, thread_count, suf.get());
+  } else {
+    // Only the suffix array outlives S, which is freed before anything else is allocated.
+    std::unique_ptr<Count[]> S(new Count[text_size]);
+    uint32_t alphabet_size = 1;
+    for (size_t i = 0; i < text_size; i++) {
+      S[i] = static_cast<Count>(text[i]);
+      alphabet_size = std::max(alphabet_size, text[i]);
+    }
+    ++alphabet_size; // [0; max symbol]
 
-  std::vector<int> best_left_prefix;
-  std::vector<int> best_right_prefix;
-  std::vector<int> best_left_suffix;
-  std::vector<int> best_right_suffix;
-  {
-    static constexpr size_t kWorkBatch = 1'000'000;
-    if (total_length < kWorkBatch) {
-      best_left_prefix = get_closest(false, true);
-      best_right_prefix = get_closest(true, true);
-      best_left_suffix = get_closest(false, false);
-      best_right_suffix = get_closest(true, false);
-    } else {
-      utils::globalThreadPool().submit(
-       [&best_left_prefix, &get_closest] { best_left_prefix = get_closest(false, true); });
-      utils::globalThreadPool().submit(
-       [&best_right_prefix, &get_closest] { best_right_prefix = get_closest(true, true); });
-      utils::globalThreadPool().submit(
-       [&best_left_suffix, &get_closest] { best_left_suffix = get_closest(false, false); });
-      utils::globalThreadPool().submit(
-       [&best_right_suffix, &get_closest] { best_right_suffix = get_closest(true, false); });
-      utils::globalThreadPool().waitCompletion();
+    size_t fs = 0;
+    if (text_size > 1'000'000 && text_size > alphabet_size && alphabet_size < 100'000'000) {
+      fs = 6 * alphabet_size;
+      if (fs > text_size) {
+        fs = 4 * alphabet_size;
+      }
+      if (fs > text_size) {
+        fs = alphabet_size;
+      }
     }
+    suf.reset(new Count[text_size + fs]);
+    const Count saca_rc = buildSuffixArray(S.get(), suf.get(), text_size, alphabet_size, fs);
+    if (saca_rc != 0) {
+      throw std::runtime_error("SACA return code: " + std::to_string(saca_rc));
+    }
+  }
+
+  // Tokens are at most longest_word_vocab long, so longer common prefixes are all alike.
+  std::vector<int> best;
+  if (longest_word_vocab < kWordStartFlag<uint8_t> - 1) {
+    best = closestTokens<Count, uint8_t>(text, text_size, suf.get(), exact_suffix_array, compiled);
+  } else {
+    best = closestTokens<Count, uint32_t>(text, text_size, suf.get(), exact_suffix_array, compiled);
   }
+  suf.reset();
 
-  const auto is_word_prefix = [&text](size_t index) {
-    // std::cout << index << ' ' << vkcom::is_spacing_char(text[index]) << std::endl;
+  const auto is_word_prefix = [text](size_t index) {
     return index == 0 || vkcom::is_spacing_char(text[index])
         || vkcom::is_spacing_char(text[index - 1]);
   };
 
   const auto match_word_piece
-   = [&, unk_token_id = vocab.unk_token_id](size_t match_index, size_t end) {
-       const size_t vocab_length = total_length - text.size();
-       std::vector<int> token_ids;
-       token_ids.reserve((end - match_index) * vocab.tokens.size() / vocab_length);
+   = [&, unk_token_id = utils::toId<Id>(vocab.unkTokenId())](
+      size_t match_index, size_t end, std::vector<word_piece::TokenSpan> *spans) {
+       std::vector<Id> token_ids;
+       token_ids.reserve((end - match_index) * vocab.size() / compiled.vocab_length);
 
        while (match_index != end && vkcom::is_space(text[match_index])) {
          ++match_index;
@@ -231,32 +691,27 @@ static std::vector<int> encodeLinearWordPieceImpl(const std::vector<uint32_t> &t
        size_t tokens_since_prefix = 0;
 
        while (match_index < end) {
-         const size_t left_sa_id = static_cast<size_t>(suf_array_index[match_index]);
-         const size_t right_sa_id = total_length - 1 - left_sa_id;
-         const bool prefix = is_word_prefix(match_index);
-         const int x = prefix ? best_left_prefix[left_sa_id] : best_left_suffix[left_sa_id];
-         const int y = prefix ? best_right_prefix[right_sa_id] : best_right_suffix[right_sa_id];
-
-         if (x != kNoMatchedSuffix || y != kNoMatchedSuffix) {
-           int token_id;
-           if (x != kNoMatchedSuffix && y != kNoMatchedSuffix) {
-             token_id = vocab.tokens[static_cast<size_t>(x)].word.size()
-                        > vocab.tokens[static_cast<size_t>(y)].word.size()
-                       ? x
-                       : y;
-           } else {
-             token_id = std::max(x, y);
-           }
+         const int token_id = best[match_index];
+         if (token_id != kNoMatchedSuffix) {
            ++tokens_since_prefix;
-           token_ids.push_back(token_id);
-           match_index += vocab.tokens[static_cast<size_t>(token_id)].word.size();
+           token_ids.push_back(static_cast<Id>(token_id));
+           const size_t token_length = vocab.token(static_cast<size_t>(token_id)).length;
+           if (spans != nullptr) {
+             spans->push_back({match_index, match_index + token_length});
+           }
+           match_index += token_length;
 
            if (match_index != end && is_word_prefix(match_index)) {
              tokens_since_prefix = 0;
            }
          } else {
+           size_t word_begin = match_index;
            while (tokens_since_prefix > 0) {
              token_ids.pop_back();
+             if (spans != nullptr) {
+               word_begin = spans->back().begin;
+               spans->pop_back();
+             }
              --tokens_since_prefix;
            }
            token_ids.push_back(unk_token_id);
@@ -264,6 +719,9 @@ static std::vector<int> encodeLinearWordPieceImpl(const std::vector<uint32_t> &t
            while (match_index != end && !is_word_prefix(match_index)) {
              ++match_index;
            }
+           if (spans != nullptr) {
+             spans->push_back({word_begin, match_index});
+           }
          }
          while (match_index != end && vkcom::is_space(text[match_index])) {
            ++match_index;
@@ -273,104 +731,210 @@ static std::vector<int> encodeLinearWordPieceImpl(const std::vector<uint32_t> &t
        return token_ids;
      };
 
-  std::vector<int> token_ids;
-  {
-    static constexpr size_t kWorkBatch = 1'000'000;
-
-    if (text.size() < 2 * kWorkBatch) {
-      token_ids = match_word_piece(0, text.size());
-    } else {
-      const size_t thread_count
-       = std::min(utils::globalThreadPool().maxThreads(), text.size() / kWorkBatch);
-      const size_t work_batch = text.size() / thread_count + 1;
-      std::vector<std::vector<int>> per_thread_token_ids(thread_count);
-      size_t work_start = 0;
-      for (size_t thread_id = 0; thread_id < thread_count && work_start < text.size();
-           thread_id++) {
-        size_t work_end = std::min(text.size(), work_start + work_batch);
-        while (work_end < text.size() && !vkcom::is_space(text[work_end])) {
-          ++work_end;
-        }
-        utils::globalThreadPool().submit(
-         [thread_id, work_start, work_end, &match_word_piece, &per_thread_token_ids] {
-           per_thread_token_ids[thread_id] = match_word_piece(work_start, work_end);
-         });
-        work_start = work_end;
+  static constexpr size_t kChunkSize = 1 << 16;
+  word_piece::BasicChunkedIds<Id> token_ids;
+  if (thread_count == 1) {
+    token_ids.chunks.push_back(match_word_piece(0, text_size, spans));
+  } else {
+    const size_t chunk_count = utils::dynamicChunkCount(text_size, kChunkSize);
+    token_ids.chunks.resize(chunk_count);
+    std::vector<std::vector<word_piece::TokenSpan>> chunk_spans(spans != nullptr ? chunk_count : 0);
+    utils::forEachDynamicChunk(
+     utils::globalThreadPool(),
+     text_size,
+     kChunkSize,
+     thread_count,
+     [text](size_t pos) { return vkcom::is_space(text[pos]); },
+     [&](size_t chunk, size_t begin, size_t end) {
+       token_ids.chunks[chunk]
+        = match_word_piece(begin, end, spans != nullptr ? &chunk_spans[chunk] : nullptr);
+     });
+
+    if (spans != nullptr) {
+      for (const std::vector<word_piece::TokenSpan> &segment : chunk_spans) {
+        spans->insert(spans->end(), segment.begin(), segment.end());
       }
-      utils::globalThreadPool().waitCompletion();
+    }
+  }
+
+  return token_ids;
+}
+
+template <typename Id>
+static word_piece::BasicChunkedIds<Id>
+encodeLinearWordPieceImpl(const std::vector<uint32_t> &text,
+                          const LinearWordPieceVocab &compiled,
+                          std::vector<word_piece::TokenSpan> *spans) {
+  // The vendored libsais sorts at most 2^31 - 1 symbols. A longer text is split at spaces into
+  // segments which fit: no token crosses a space, so the ids are the same as with one array.
+  static constexpr size_t kMaxSegment = std::numeric_limits<int32_t>::max();
+  if (text.size() <= kMaxSegment) {
+    return encodeLinearWordPieceSegment<int32_t, Id>(text.data(), text.size(), compiled, spans);
+  }
 
-      size_t token_count = 0;
-      for (size_t thread_id = 0; thread_id < thread_count; thread_id++) {
-        token_count += per_thread_token_ids[thread_id].size();
+  word_piece::BasicChunkedIds<Id> token_ids;
+  for (size_t begin = 0; begin < text.size();) {
+    size_t end = text.size();
+    if (end - begin > kMaxSegment) {
+      end = begin + kMaxSegment;
+      while (end > begin && !vkcom::is_space(text[end])) {
+        --end;
       }
-      token_ids.resize(token_count);
-      work_start = 0;
-      for (size_t thread_id = 0; thread_id < thread_count; thread_id++) {
-        std::vector<int> &segment = per_thread_token_ids[thread_id];
-        if (!segment.empty()) {
-          std::memcpy(token_ids.data() + work_start, segment.data(), segment.size() * sizeof(int));
-          work_start += segment.size();
-        }
+      if (end == begin) {
+        throw std::runtime_error("No space to split the text for the suffix array");
       }
     }
+    const size_t spans_before = spans != nullptr ? spans->size() : 0;
+    word_piece::BasicChunkedIds<Id> segment_ids = encodeLinearWordPieceSegment<int32_t, Id>(
+     text.data() + begin, end - begin, compiled, spans);
+    for (std::vector<Id> &chunk : segment_ids.chunks) {
+      token_ids.chunks.push_back(std::move(chunk));
+    }
+    if (spans != nullptr) {
+      for (size_t i = spans_before; i < spans->size(); i++) {
+        (*spans)[i].begin += begin;
+        (*spans)[i].end += begin;
+      }
+    }
+    begin = end;
   }
-
   return token_ids;
 }
 
-static std::vector<int>
-encodeLinearWordPiece(const char *text, size_t size, const utils::WordPieceVocabulary &vocab) {
+template <typename Id>
+static word_piece::BasicChunkedIds<Id>
+encodeLinearWordPiece(const char *text,
+                      size_t size,
+                      const LinearWordPieceVocab &compiled,
+                      std::vector<word_piece::TokenSpan> *spans = nullptr) {
+  if (spans != nullptr) {
+    spans->clear();
+  }
   if (size == 0) {
     return {};
   }
-  const std::vector<uint32_t> text_utf8 = utils::parseText(text, size, utils::globalThreadPool());
-  return encodeLinearWordPieceImpl(text_utf8, vocab);
+  // Spans of normalized text map through the source of every code point.
+  const bool normalized = compiled.vocab.normalization().enabled();
+  std::vector<size_t> invalid_positions;
+  std::vector<size_t> source_offsets;
+  const std::vector<uint32_t> text_utf8
+   = utils::parseText(text,
+                      size,
+                      utils::globalThreadPool(),
+                      spans != nullptr && !normalized ? &invalid_positions : nullptr,
+                      compiled.vocab.normalization(),
+                      spans != nullptr && normalized ? &source_offsets : nullptr);
+  word_piece::BasicChunkedIds<Id> token_ids
+   = encodeLinearWordPieceImpl<Id>(text_utf8, compiled, spans);
+  if (spans != nullptr && normalized) {
+    utils::spansToByteOffsets(text, source_offsets, spans->data(), spans->size());
+  } else if (spans != nullptr) {
+    utils::spansToByteOffsets(text, size, invalid_positions, spans->data(), spans->size());
+  }
+  return token_ids;
 }
 
 namespace word_piece::linear {
 
+struct Tokenizer::Impl {
+  LinearWordPieceVocab compiled;
+};
+
+Tokenizer::Tokenizer(const std::vector<std::string> &vocab, const Normalization &normalization)
+ : impl_(new Impl{
+  LinearWordPieceVocab(utils::CompiledVocab(utils::parseVocab(vocab, normalization)))}) {}
+
+Tokenizer::Tokenizer(const std::string &vocab_file, const Normalization &normalization)
+ : impl_(new Impl{
+  LinearWordPieceVocab(utils::CompiledVocab::fromFile(vocab_file, normalization))}) {}
+
+Tokenizer::Tokenizer(Tokenizer &&other) noexcept = default;
+
+Tokenizer &Tokenizer::operator=(Tokenizer &&other) noexcept = default;
+
+Tokenizer::~Tokenizer() = default;
+
+std::vector<int> Tokenizer::encode(const std::string &text, std::vector<TokenSpan> *spans) const {
+  return encodeChunked(text, spans).join();
+}
+
+std::vector<int> Tokenizer::encodeFile(const std::string &text_file,
+                                       std::vector<TokenSpan> *spans) const {
+  return encodeFileChunked(text_file, spans).join();
+}
+
+size_t Tokenizer::idBytes() const {
+  return utils::compactIds(impl_->compiled.vocab.size()) ? 2 : 4;
+}
+
+template <typename Id>
+BasicChunkedIds<Id> Tokenizer::encodeChunked(const std::string &text,
+                                             std::vector<TokenSpan> *spans) const {
+  if (sizeof(Id) < idBytes()) {
+    throw std::runtime_error("Vocab is too large for 16-bit ids");
+  }
+  return encodeLinearWordPiece<Id>(text.data(), text.size(), impl_->compiled, spans);
+}
+
+template <typename Id>
+BasicChunkedIds<Id> Tokenizer::encodeFileChunked(const std::string &text_file,
+                                                 std::vector<TokenSpan> *spans) const {
+  if (sizeof(Id) < idBytes()) {
+    throw std::runtime_error("Vocab is too large for 16-bit ids");
+  }
+  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
+  return encodeLinearWordPiece<Id>(mmap.const_data(), mmap.size(), impl_->compiled, spans);
+}
+
+template ChunkedIds Tokenizer::encodeChunked<int>(const std::string &,
+                                                 std::vector<TokenSpan> *) const;
+template BasicChunkedIds<uint16_t>
+Tokenizer::encodeChunked<uint16_t>(const std::string &, std::vector<TokenSpan> *) const;
+template ChunkedIds Tokenizer::encodeFileChunked<int>(const std::string &,
+                                                     std::vector<TokenSpan> *) const;
+template BasicChunkedIds<uint16_t>
+Tokenizer::encodeFileChunked<uint16_t>(const std::string &, std::vector<TokenSpan> *) const;
+
+void Tokenizer::encodeExternal(const std::string &text_file,
+                               const std::string &out_file,
+                               size_t memory_limit,
+                               OutputFormat format) const {
+  // Per byte of a batch: 4 of code points for every batch in flight, about 10 of the suffix
+  // array pipeline for the batch being encoded and the ids.
+  const size_t batch_size = memory_limit / 10 / utils::kExternalBatchesInFlight;
+  const utils::CompiledVocab &vocab = impl_->compiled.vocab;
+  utils::IdWriter writer(out_file, format, vocab.contentHash(), vocab.size());
+  utils::encodeExternalCompact(
+   text_file,
+   batch_size,
+   true,
+   vocab.normalization(),
+   vocab.size(),
+   [this](auto id, const char *, size_t, const std::vector<uint32_t> &code_points) {
+     using Id = decltype(id);
+     if (code_points.empty()) {
+       return BasicChunkedIds<Id>();
+     }
+     return encodeLinearWordPieceImpl<Id>(code_points, impl_->compiled, nullptr);
+   },
+   writer);
+  writer.close();
+}
+
 std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab) {
-  const utils::WordPieceVocabulary vocab_utf8 = utils::parseVocab(vocab);
-  return encodeLinearWordPiece(text.data(), text.size(), vocab_utf8);
+  return Tokenizer(vocab).encode(text);
 }
 
 std::vector<int> encode(const std::string &text_file, const std::string &vocab_file) {
-  const utils::WordPieceVocabulary vocab_utf8 = utils::readVocabFromFile(vocab_file);
-  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
-  return encodeLinearWordPiece(mmap.const_data(), mmap.size(), vocab_utf8);
+  return Tokenizer(vocab_file).encodeFile(text_file);
 }
 
 void encodeExternal(const std::string &text_file,
                     const std::string &vocab_file,
                     const std::string &out_file,
-                    size_t memory_limit) {
-  const utils::WordPieceVocabulary vocab_utf8 = utils::readVocabFromFile(vocab_file);
-
-  const size_t maxTextBatch = memory_limit / 20; // because of SAIS
-  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
-  const char *begin = mmap.const_data();
-  size_t size = mmap.size();
-
-  std::ofstream fout(out_file);
-  while (size > 0) {
-    size_t batch;
-    if (size > maxTextBatch) {
-      batch = maxTextBatch;
-      while (batch < size
-             && !vkcom::starts_with_space(begin + batch - 1, static_cast<int64_t>(size - batch))) {
-        batch++;
-      }
-    } else {
-      batch = size;
-    }
-
-    std::vector<int> ids = encodeLinearWordPiece(begin, batch, vocab_utf8);
-    for (int id : ids) {
-      fout << id << ' ';
-    }
-    begin += batch;
-    size -= batch;
-  }
+                    size_t memory_limit,
+                    OutputFormat format) {
+  Tokenizer(vocab_file).encodeExternal(text_file, out_file, memory_limit, format);
 }
 
 } // namespace word_piece::linear
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# Copyright (c) 2023 Gleb Koveshnikov
+#
+# Generates utf8_classes.hpp: two-level table of character classes for all of Unicode.
+#   space       -- White_Space property, plus U+2581 (sentencepiece space token)
+#   punctuation -- ASCII symbols 33-47, 58-64, 91-96, 123-126 and general categories P*,
+#                  same as BERT's _is_punctuation
+#   chinese     -- CJK ideograph blocks, same as BERT's _is_chinese_char
+#
+# Usage: python3 gen_utf8_classes.py > utf8_classes.hpp
+
+import sys
+import unicodedata
+
+SPACE = 1
+PUNCTUATION = 2
+CHINESE = 4
+
+BLOCK_BITS = 8
+MAX_CODE_POINT = 0x110000
+
+WHITE_SPACE = [*range(0x09, 0x0E), 0x20, 0x85, 0xA0, 0x1680, *range(0x2000, 0x200B),
+               0x2028, 0x2029, 0x202F, 0x205F, 0x3000]
+SPACE_TOKEN = 0x2581
+
+CHINESE_RANGES = [(0x4E00, 0x9FFF), (0x3400, 0x4DBF), (0x20000, 0x2A6DF), (0x2A700, 0x2B73F),
+                  (0x2B740, 0x2B81F), (0x2B820, 0x2CEAF), (0xF900, 0xFAFF), (0x2F800, 0x2FA1F)]
+
+
+def char_class(cp):
+    result = 0
+    if cp in WHITE_SPACE or cp == SPACE_TOKEN:
+        result |= SPACE
+    if (33 <= cp <= 47 or 58 <= cp <= 64 or 91 <= cp <= 96 or 123 <= cp <= 126
+            or unicodedata.category(chr(cp)).startswith('P')):
+        result |= PUNCTUATION
+    if any(lo <= cp <= hi for lo, hi in CHINESE_RANGES):
+        result |= CHINESE
+    return result
+
+
+def main():
+    block_size = 1 << BLOCK_BITS
+    blocks = []
+    block_ids = {}
+    index = []
+    for block_begin in range(0, MAX_CODE_POINT, block_size):
+        block = tuple(char_class(cp) for cp in range(block_begin, block_begin + block_size))
+        if block not in block_ids:
+            block_ids[block] = len(blocks)
+            blocks.append(block)
+        index.append(block_ids[block])
+    # Code points past U+10FFFF (INVALID_UNICODE included) map to the all-zero block.
+    index.append(block_ids[tuple([0] * block_size)])
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('// Generated by gen_utf8_classes.py from Unicode %s, do not edit.\n\n'
+              % unicodedata.unidata_version)
+    out.write('#pragma once\n\n#include <cstdint>\n\nnamespace vkcom {\n\n')
+    out.write('constexpr uint32_t CHAR_CLASS_BLOCK_BITS = %d;\n\n' % BLOCK_BITS)
+    out.write('constexpr uint32_t CHAR_CLASS_INDEX_SIZE = %d;\n\n' % len(index))
+    out.write('alignas(64) inline constexpr uint8_t CHAR_CLASS_INDEX[%d] = {\n' % len(index))
+    for i in range(0, len(index), 24):
+        out.write('    ' + ', '.join(str(x) for x in index[i:i + 24]) + ',\n')
+    out.write('};\n\n')
+    out.write('alignas(64) inline constexpr uint8_t CHAR_CLASS_BLOCKS[%d][%d] = {\n'
+              % (len(blocks), block_size))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, block_size, 32):
+            out.write('        ' + ', '.join(str(x) for x in block[i:i + 32]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n\n} // namespace vkcom\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+# Copyright (c) 2023 Gleb Koveshnikov
+#
+# Generates utf8_folding.hpp: two-level table of BERT's BasicTokenizer normalization for all
+# of Unicode, one record per distinct behaviour.
+#   control -- dropped by clean_text: NUL, U+FFFD and general categories C* but "\t\n\r",
+#              same as BERT's _clean_text
+#   lower       -- str.lower() of the single code point (no final sigma)
+#   strip       -- NFD without nonspacing marks (Mn), same as BERT's _run_strip_accents
+#   lower_strip -- strip of lower
+# Every mapping is a code point delta, a drop or an expansion in FOLD_EXPANSIONS. Hangul
+# syllables are decomposed by the algorithm instead, they only have the HANGUL flag.
+#
+# Usage: python3 gen_utf8_folding.py > utf8_folding.hpp
+
+import sys
+import unicodedata
+
+BLOCK_BITS = 8
+MAX_CODE_POINT = 0x110000
+
+KIND_DELTA = 0
+KIND_DROP = 1
+KIND_EXPANSION = 2
+
+CONTROL = 1 << 6
+HANGUL = 1 << 7
+
+HANGUL_BEGIN = 0xAC00
+HANGUL_END = 0xD7A4
+
+
+def is_control(c):
+    if c in '\t\n\r':
+        return False
+    return ord(c) in (0, 0xFFFD) or unicodedata.category(c).startswith('C')
+
+
+def strip_accents(s):
+    return ''.join(c for c in unicodedata.normalize('NFD', s) if unicodedata.category(c) != 'Mn')
+
+
+def main():
+    expansions = []
+    expansion_ids = {}
+
+    def mapping(cp, result):
+        if len(result) == 0:
+            return KIND_DROP, 0
+        if len(result) == 1:
+            return KIND_DELTA, ord(result) - cp
+        # A code point never expands past its UTF-8 length and the length fits in 2 bits, the
+        # decoder relies on both.
+        assert len(result) <= min(3, len(chr(cp).encode('utf-8', 'surrogatepass')))
+        if result not in expansion_ids:
+            expansion_ids[result] = len(expansions)
+            expansions.extend(ord(c) for c in result)
+        return KIND_EXPANSION, (expansion_ids[result] << 2) | len(result)
+
+    records = []
+    record_ids = {}
+
+    def record_id(record):
+        if record not in record_ids:
+            record_ids[record] = len(records)
+            records.append(record)
+        return record_ids[record]
+
+    # The identity is record 0, it is also used past U+10FFFF.
+    record_id(((0, 0, 0), 0))
+    codes = []
+    for cp in range(MAX_CODE_POINT):
+        c = chr(cp)
+        flags = CONTROL if is_control(c) else 0
+        if HANGUL_BEGIN <= cp < HANGUL_END:
+            codes.append(record_id(((0, 0, 0), flags | HANGUL)))
+            continue
+        values = []
+        for index, result in enumerate((c.lower(), strip_accents(c), strip_accents(c.lower()))):
+            kind, value = mapping(cp, result)
+            flags |= kind << (2 * index)
+            values.append(value)
+        codes.append(record_id((tuple(values), flags)))
+
+    block_size = 1 << BLOCK_BITS
+    blocks = []
+    block_ids = {}
+    index = []
+    for block_begin in range(0, MAX_CODE_POINT, block_size):
+        block = tuple(codes[block_begin:block_begin + block_size])
+        if block not in block_ids:
+            block_ids[block] = len(blocks)
+            blocks.append(block)
+        index.append(block_ids[block])
+    assert len(blocks) <= 256
+    assert len(records) <= 1 << 16
+
+    out = sys.stdout
+    out.write('// Generated by gen_utf8_folding.py from Unicode %s, do not edit.\n\n'
+              % unicodedata.unidata_version)
+    out.write('#pragma once\n\n#include <cstdint>\n\nnamespace vkcom {\n\n')
+    out.write('// mapping[i] is lower, strip and lower_strip, flags has their kinds in bits 2i, 2i + 1.\n')
+    out.write('struct FoldRecord {\n    int32_t mapping[3];\n    uint32_t flags;\n};\n\n')
+    out.write('constexpr uint32_t FOLD_DELTA = %d;\n' % KIND_DELTA)
+    out.write('constexpr uint32_t FOLD_DROP = %d;\n' % KIND_DROP)
+    out.write('constexpr uint32_t FOLD_EXPANSION = %d;\n' % KIND_EXPANSION)
+    out.write('constexpr uint32_t FOLD_CONTROL = %d;\n' % CONTROL)
+    out.write('constexpr uint32_t FOLD_HANGUL = %d;\n\n' % HANGUL)
+    out.write('constexpr uint32_t FOLD_BLOCK_BITS = %d;\n\n' % BLOCK_BITS)
+    out.write('constexpr uint32_t FOLD_INDEX_SIZE = %d;\n\n' % len(index))
+    out.write('alignas(64) inline constexpr uint8_t FOLD_INDEX[%d] = {\n' % len(index))
+    for i in range(0, len(index), 24):
+        out.write('    ' + ', '.join(str(x) for x in index[i:i + 24]) + ',\n')
+    out.write('};\n\n')
+    out.write('alignas(64) inline constexpr uint16_t FOLD_BLOCKS[%d][%d] = {\n'
+              % (len(blocks), block_size))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, block_size, 24):
+            out.write('        ' + ', '.join(str(x) for x in block[i:i + 24]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n\n')
+    out.write('alignas(64) inline constexpr FoldRecord FOLD_RECORDS[%d] = {\n' % len(records))
+    for values, flags in records:
+        out.write('    {{%d, %d, %d}, %d},\n' % (*values, flags))
+    out.write('};\n\n')
+    out.write('inline constexpr uint32_t FOLD_EXPANSIONS[%d] = {\n' % len(expansions))
+    for i in range(0, len(expansions), 12):
+        out.write('    ' + ', '.join(str(x) for x in expansions[i:i + 12]) + ',\n')
+    out.write('};\n\n} // namespace vkcom\n')
+
+
+if __name__ == '__main__':
+    main()
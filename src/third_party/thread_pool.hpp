@@ -5,18 +5,112 @@
 
 #include <atomic>
 #include <condition_variable>
-#include <functional>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace utils {
 
-class ThreadPool {
+// Move-only void() callable. Callables up to kInlineSize bytes, which is every lambda of the
+// pool users (a few indices and references), live inside the task without an allocation.
+class Task {
   public:
-    using Task = std::function<void()>;
+    static constexpr size_t kInlineSize = 96;
+
+    Task() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F &&f) { // NOLINT: implicit like std::function
+        using Callable = std::decay_t<F>;
+        if constexpr (sizeof(Callable) <= kInlineSize
+                      && alignof(Callable) <= alignof(std::max_align_t)
+                      && std::is_nothrow_move_constructible_v<Callable>) {
+            new (storage_) Callable(std::forward<F>(f));
+            ops_ = &kInlineOps<Callable>;
+        } else {
+            new (storage_) Callable *(new Callable(std::forward<F>(f)));
+            ops_ = &kHeapOps<Callable>;
+        }
+    }
 
+    Task(Task &&other) noexcept : ops_(other.ops_) {
+        if (ops_ != nullptr) {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            reset();
+            ops_ = other.ops_;
+            if (ops_ != nullptr) {
+                ops_->move(storage_, other.storage_);
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() { reset(); }
+
+    explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+    void operator()() { ops_->invoke(storage_); }
+
+  private:
+    struct Ops {
+        void (*invoke)(void *storage);
+        // Moves the callable from src into the raw dst and destroys what is left in src.
+        void (*move)(void *dst, void *src) noexcept;
+        void (*destroy)(void *storage) noexcept;
+    };
+
+    template <typename Callable>
+    static constexpr Ops kInlineOps{
+        [](void *storage) { (*static_cast<Callable *>(storage))(); },
+        [](void *dst, void *src) noexcept {
+            new (dst) Callable(std::move(*static_cast<Callable *>(src)));
+            static_cast<Callable *>(src)->~Callable();
+        },
+        [](void *storage) noexcept { static_cast<Callable *>(storage)->~Callable(); }};
+
+    template <typename Callable>
+    static constexpr Ops kHeapOps{
+        [](void *storage) { (**static_cast<Callable **>(storage))(); },
+        [](void *dst, void *src) noexcept {
+            new (dst) Callable *(*static_cast<Callable **>(src));
+        },
+        [](void *storage) noexcept { delete *static_cast<Callable **>(storage); }};
+
+    void reset() noexcept {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+    const Ops *ops_ = nullptr;
+};
+
+class TaskGroup;
+
+// Work-stealing pool: every worker owns a deque, runs its own tasks newest first and steals the
+// oldest ones of the others when it runs out. Tasks submitted from outside the pool are spread
+// over the deques round-robin. Each deque has its own mutex, so submitters and workers rarely
+// meet on one lock. Tasks are submitted and waited for through a TaskGroup.
+class ThreadPool {
   public:
     ThreadPool(size_t thread_count) {
         if (thread_count == 0) {
@@ -26,33 +120,21 @@ class ThreadPool {
             thread_count = 8;
         }
         for (size_t thread = 0; thread < thread_count; ++thread) {
-            threads_.emplace_back([this] {
-                while (!stop_.load(std::memory_order_relaxed)) {
-                    std::unique_lock<std::mutex> lock(mutex_);
-                    work_cv_.wait(lock, [this] {
-                        return stop_.load(std::memory_order_relaxed) || !task_queue_.empty();
-                    });
-                    if (stop_.load(std::memory_order_relaxed)) {
-                        break;
-                    }
-                    if (task_queue_.empty()) {
-                        continue;
-                    }
-                    ++active_tasks_;
-                    auto task = std::move(task_queue_.front());
-                    task_queue_.pop();
-                    lock.unlock();
-                    task();
-                    lock.lock();
-                    --active_tasks_;
-                    complete_cv_.notify_one();
-                }
-            });
+            queues_.push_back(std::make_unique<WorkQueue>());
+        }
+        for (size_t thread = 0; thread < thread_count; ++thread) {
+            threads_.emplace_back([this, thread] { workerLoop(thread); });
         }
     }
 
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
     ~ThreadPool() {
-        stop_.store(true, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
         work_cv_.notify_all();
         for (auto &thread : threads_) {
             if (thread.joinable()) {
@@ -61,31 +143,171 @@ class ThreadPool {
         }
     }
 
+    [[nodiscard]] size_t maxThreads() const noexcept { return threads_.size(); }
+
+  private:
+    friend class TaskGroup;
+
+    static constexpr size_t kNotWorker = static_cast<size_t>(-1);
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
     void submit(Task &&task) {
+        size_t queue = currentWorker();
+        if (queue == kNotWorker) {
+            queue = next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+        }
         {
-            std::lock_guard<std::mutex> lg(mutex_);
-            task_queue_.emplace(std::move(task));
+            std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+            queues_[queue]->tasks.push_back(std::move(task));
+        }
+        queued_.fetch_add(1);
+        if (sleepers_.load() > 0) {
+            // Taking the lock orders the notification after a sleeper has checked queued_.
+            { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+            work_cv_.notify_one();
         }
-        work_cv_.notify_one();
     }
 
-    void waitCompletion() {
-        std::unique_lock<std::mutex> lock(mutex_);
-        if (active_tasks_ != 0 || !task_queue_.empty()) {
-            complete_cv_.wait(lock, [this] { return active_tasks_ == 0 && task_queue_.empty(); });
+    // Runs one queued task on the calling thread, false if there is none.
+    bool runOne() {
+        const size_t worker = currentWorker();
+        Task task = pop(worker);
+        if (!task) {
+            return false;
         }
+        task();
+        return true;
     }
 
-    [[nodiscard]] size_t maxThreads() const noexcept { return threads_.size(); }
+    Task pop(size_t worker) {
+        if (queued_.load(std::memory_order_relaxed) == 0) {
+            return {};
+        }
+        const size_t queue_count = queues_.size();
+        size_t first = worker;
+        if (worker != kNotWorker) {
+            WorkQueue &own = *queues_[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                Task task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued_.fetch_sub(1);
+                return task;
+            }
+        } else {
+            first = next_queue_.load(std::memory_order_relaxed);
+        }
+        for (size_t i = 1; i <= queue_count; i++) {
+            WorkQueue &victim = *queues_[(first + i) % queue_count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                Task task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued_.fetch_sub(1);
+                return task;
+            }
+        }
+        return {};
+    }
 
-  private:
-    std::atomic<bool> stop_{false};
-    size_t active_tasks_{0};
-    std::mutex mutex_;
+    void workerLoop(size_t worker) {
+        current_pool_ = this;
+        current_worker_ = worker;
+        while (true) {
+            if (Task task = pop(worker)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            sleepers_.fetch_add(1);
+            work_cv_.wait(lock, [this] { return stop_ || queued_.load() > 0; });
+            sleepers_.fetch_sub(1);
+            if (stop_ && queued_.load() == 0) {
+                break;
+            }
+        }
+    }
+
+    size_t currentWorker() const noexcept {
+        return current_pool_ == this ? current_worker_ : kNotWorker;
+    }
+
+    static inline thread_local const ThreadPool *current_pool_ = nullptr;
+    static inline thread_local size_t current_worker_ = kNotWorker;
+
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::atomic<size_t> next_queue_{0};
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> sleepers_{0};
+    bool stop_ = false;
+    std::mutex sleep_mutex_;
     std::condition_variable work_cv_;
-    std::condition_variable complete_cv_;
     std::vector<std::thread> threads_;
-    std::queue<Task> task_queue_;
+};
+
+// Tasks of one caller. wait() returns once all of them are done and does not wait for tasks
+// of anyone else sharing the pool. Until then the waiting thread runs queued tasks itself and
+// sleeps only while its last tasks run on other threads. The first exception thrown by a task
+// is rethrown from wait().
+class TaskGroup {
+  public:
+    explicit TaskGroup(ThreadPool &pool) : pool_(pool) {}
+
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    // Tasks reference the group, so it does not go away before them.
+    ~TaskGroup() { waitTasks(); }
+
+    template <typename F>
+    void submit(F &&f) {
+        pending_.fetch_add(1);
+        pool_.submit([this, f = std::forward<F>(f)]() mutable {
+            try {
+                f();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error_) {
+                    error_ = std::current_exception();
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.fetch_sub(1) == 1) {
+                done_cv_.notify_all();
+            }
+        });
+    }
+
+    void wait() {
+        waitTasks();
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::swap(error, error_);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+  private:
+    void waitTasks() noexcept {
+        while (pending_.load() > 0 && pool_.runOne()) {
+        }
+        // The last task signals under the mutex, so the group outlives it.
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this] { return pending_.load() == 0; });
+    }
+
+    ThreadPool &pool_;
+    std::atomic<size_t> pending_{0};
+    std::mutex mutex_;
+    std::condition_variable done_cv_;
+    std::exception_ptr error_;
 };
 
 } // namespace utils
@@ -3,10 +3,14 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <string>
 #include <vector>
 
+#include "utf8_classes.hpp"
+
 namespace vkcom {
 
 constexpr uint32_t INVALID_UNICODE = 0x110000;
@@ -15,13 +19,27 @@ constexpr uint32_t SPACE_TOKEN = 9601;
 
 constexpr uint32_t SHARP_SIGN = static_cast<uint32_t>('#');
 
-bool is_space(uint32_t ch);
+constexpr uint8_t SPACE_CLASS = 1;
+
+constexpr uint8_t PUNCTUATION_CLASS = 2;
+
+constexpr uint8_t CHINESE_CLASS = 4;
+
+constexpr uint8_t SPACING_CLASS = SPACE_CLASS | PUNCTUATION_CLASS | CHINESE_CLASS;
+
+// Class bitmask of a code point, see gen_utf8_classes.py. Anything past U+10FFFF is 0.
+inline uint8_t char_class(uint32_t ch) {
+    const uint32_t block = std::min(ch >> CHAR_CLASS_BLOCK_BITS, CHAR_CLASS_INDEX_SIZE - 1);
+    return CHAR_CLASS_BLOCKS[CHAR_CLASS_INDEX[block]][ch & ((1u << CHAR_CLASS_BLOCK_BITS) - 1)];
+}
+
+inline bool is_space(uint32_t ch) { return (char_class(ch) & SPACE_CLASS) != 0; }
 
-bool is_punctuation(uint32_t ch);
+inline bool is_punctuation(uint32_t ch) { return (char_class(ch) & PUNCTUATION_CLASS) != 0; }
 
-bool is_chinese_char(uint32_t ch);
+inline bool is_chinese_char(uint32_t ch) { return (char_class(ch) & CHINESE_CLASS) != 0; }
 
-bool is_spacing_char(uint32_t ch);
+inline bool is_spacing_char(uint32_t ch) { return (char_class(ch) & SPACING_CLASS) != 0; }
 
 bool check_byte(char x);
 
@@ -0,0 +1,351 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#include "word_piece.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "compiled_vocab.hpp"
+#include "external.hpp"
+#include "third_party/thread_pool.hpp"
+#include "third_party/utf8.hpp"
+#include "utils.hpp"
+
+// Flat array trie over vocab with failure links and failure pops (LinMaxMatch from
+// "Fast WordPiece Tokenization", 2021). Prefix tokens hang from kPrefixRoot, suffix tokens
+// (without ##) hang from kSuffixRoot. When node u has no edge for the next character, tokens
+// fail_pops(u) are emitted and matching continues from fail(u), so every character is
+// consumed once and the whole word is matched in O(n) without backtracking.
+struct TrieWordPieceVocab {
+  static constexpr uint32_t kPrefixRoot = 0;
+  static constexpr uint32_t kSuffixRoot = 1;
+  static constexpr uint32_t kNoNode = UINT32_MAX;
+
+  explicit TrieWordPieceVocab(utils::CompiledVocab compiled_vocab)
+   : vocab(std::move(compiled_vocab)) {
+    buildTrie();
+    buildFailureLinks();
+  }
+
+  uint32_t child(uint32_t node, uint32_t c) const {
+    const uint32_t *begin = edge_chars.data() + edge_begin[node];
+    const uint32_t *end = edge_chars.data() + edge_begin[node + 1];
+    const uint32_t *it = std::lower_bound(begin, end, c);
+    if (it == end || *it != c) {
+      return kNoNode;
+    }
+    return edge_targets[static_cast<size_t>(it - edge_chars.data())];
+  }
+
+  const utils::CompiledVocab vocab;
+
+  // Node u has edges [edge_begin[u], edge_begin[u + 1]) sorted by character.
+  std::vector<uint32_t> edge_begin;
+  std::vector<uint32_t> edge_chars;
+  std::vector<uint32_t> edge_targets;
+
+  std::vector<int> token_id; // -1 if node is not a token
+  std::vector<uint32_t> fail;
+  // Node u pops fail_pops[fail_pops_begin[u], fail_pops_begin[u + 1]).
+  std::vector<uint32_t> fail_pops_begin;
+  std::vector<int> fail_pops;
+
+ private:
+  void buildTrie() {
+    std::unordered_map<uint64_t, uint32_t> children;
+    std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> edges; // (parent, char, child)
+    uint32_t node_count = 2;
+    token_id.assign(node_count, -1);
+
+    for (size_t i = 0; i < vocab.size(); i++) {
+      const auto &token = vocab.token(i);
+      if (token.isSpecial() || token.isMalformed()) {
+        continue;
+      }
+      uint32_t node = token.isPrefix() ? kPrefixRoot : kSuffixRoot;
+      const uint32_t *word = vocab.word(i);
+      for (const uint32_t *it = word; it != word + token.length; it++) {
+        const uint64_t key = (static_cast<uint64_t>(node) << 32u) | *it;
+        auto [child_it, inserted] = children.emplace(key, node_count);
+        if (inserted) {
+          edges.emplace_back(node, *it, node_count);
+          token_id.push_back(-1);
+          ++node_count;
+        }
+        node = child_it->second;
+      }
+      token_id[node] = static_cast<int>(i); // the last duplicate wins
+    }
+
+    std::sort(edges.begin(), edges.end());
+    edge_begin.assign(node_count + 1, 0);
+    edge_chars.reserve(edges.size());
+    edge_targets.reserve(edges.size());
+    for (const auto &[parent, c, target] : edges) {
+      ++edge_begin[parent + 1];
+      edge_chars.push_back(c);
+      edge_targets.push_back(target);
+    }
+    for (size_t node = 0; node < node_count; node++) {
+      edge_begin[node + 1] += edge_begin[node];
+    }
+  }
+
+  void buildFailureLinks() {
+    const size_t node_count = token_id.size();
+    fail.assign(node_count, kNoNode);
+    std::vector<std::vector<int>> pops(node_count);
+
+    // Breadth-first from both roots: fail(u) always has a shorter string than u.
+    std::queue<uint32_t> queue;
+    queue.push(kPrefixRoot);
+    queue.push(kSuffixRoot);
+    while (!queue.empty()) {
+      const uint32_t parent = queue.front();
+      queue.pop();
+      for (uint32_t edge = edge_begin[parent]; edge < edge_begin[parent + 1]; edge++) {
+        const uint32_t c = edge_chars[edge];
+        const uint32_t node = edge_targets[edge];
+        queue.push(node);
+
+        if (token_id[node] != -1) {
+          pops[node] = {token_id[node]};
+          fail[node] = kSuffixRoot;
+          continue;
+        }
+        std::vector<int> node_pops = pops[parent];
+        uint32_t link = fail[parent];
+        while (link != kNoNode && child(link, c) == kNoNode) {
+          node_pops.insert(node_pops.end(), pops[link].begin(), pops[link].end());
+          link = fail[link];
+        }
+        if (link != kNoNode) {
+          fail[node] = child(link, c);
+          pops[node] = std::move(node_pops);
+        }
+      }
+    }
+
+    fail_pops_begin.assign(node_count + 1, 0);
+    for (size_t node = 0; node < node_count; node++) {
+      fail_pops_begin[node + 1] = fail_pops_begin[node] + static_cast<uint32_t>(pops[node].size());
+      fail_pops.insert(fail_pops.end(), pops[node].begin(), pops[node].end());
+    }
+  }
+};
+
+// Appends MaxMatch of text [begin, end) starting from node to token_ids.
+// Returns false if the segment cannot be tokenized, token_ids are then partially filled.
+template <typename Id>
+static bool matchSegment(const TrieWordPieceVocab &trie,
+                         const uint32_t *begin,
+                         const uint32_t *end,
+                         uint32_t node,
+                         std::vector<Id> &token_ids) {
+  const auto pop = [&trie, &token_ids](uint32_t &current) {
+    if (trie.fail[current] == TrieWordPieceVocab::kNoNode) {
+      return false;
+    }
+    token_ids.insert(token_ids.end(),
+                     trie.fail_pops.begin() + trie.fail_pops_begin[current],
+                     trie.fail_pops.begin() + trie.fail_pops_begin[current + 1]);
+    current = trie.fail[current];
+    return true;
+  };
+
+  for (; begin != end; ++begin) {
+    uint32_t next;
+    while ((next = trie.child(node, *begin)) == TrieWordPieceVocab::kNoNode) {
+      if (!pop(node)) {
+        return false;
+      }
+    }
+    node = next;
+  }
+  while (node != TrieWordPieceVocab::kSuffixRoot && node != TrieWordPieceVocab::kPrefixRoot) {
+    if (!pop(node)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Id>
+static word_piece::BasicChunkedIds<Id> encodeTrieWordPieceImpl(const std::vector<uint32_t> &text,
+                                                               const TrieWordPieceVocab &trie) {
+  const auto worker = [&text, &trie, unk_token_id = utils::toId<Id>(trie.vocab.unkTokenId())](
+                       size_t begin, size_t end) {
+    std::vector<Id> token_ids;
+    token_ids.reserve((end - begin) / 4 + 1);
+
+    while (begin != end) {
+      if (vkcom::is_space(text[begin])) {
+        ++begin;
+        continue;
+      }
+
+      // Every position here starts a word: either the chunk start or right after a spacing char.
+      size_t word_end = begin + 1;
+      if (!vkcom::is_punctuation(text[begin])) {
+        while (word_end != end && !vkcom::is_spacing_char(text[word_end])) {
+          ++word_end;
+        }
+      }
+      const uint32_t *word_begin = text.data() + begin;
+      const size_t rollback = token_ids.size();
+
+      if (word_end == begin + 1 || !vkcom::is_chinese_char(text[begin])) {
+        if (!matchSegment(trie, word_begin, text.data() + word_end, trie.kPrefixRoot, token_ids)) {
+          token_ids.resize(rollback);
+          token_ids.push_back(unk_token_id);
+        }
+        begin = word_end;
+        continue;
+      }
+
+      // A chinese character is a word by itself, but the fast engine lets a prefix token
+      // continue over the following letters. Keep exactly the same behaviour.
+      int longest_id = -1;
+      size_t longest_len = 0;
+      uint32_t node = trie.kPrefixRoot;
+      for (size_t len = 1; begin + len <= word_end; len++) {
+        node = trie.child(node, text[begin + len - 1]);
+        if (node == TrieWordPieceVocab::kNoNode) {
+          break;
+        }
+        if (trie.token_id[node] != -1) {
+          longest_id = trie.token_id[node];
+          longest_len = len;
+        }
+      }
+
+      if (longest_id == -1) {
+        // The fast engine skips min(max_len, word length) characters, then to the next word.
+        token_ids.push_back(unk_token_id);
+        begin = trie.vocab.maxTokenLength() == 1 ? begin + 1 : word_end;
+      } else if (longest_len == 1) {
+        token_ids.push_back(static_cast<Id>(longest_id));
+        begin += 1;
+      } else {
+        token_ids.push_back(static_cast<Id>(longest_id));
+        if (!matchSegment(trie,
+                          word_begin + longest_len,
+                          text.data() + word_end,
+                          trie.kSuffixRoot,
+                          token_ids)) {
+          token_ids.resize(rollback);
+          token_ids.push_back(unk_token_id);
+        }
+        begin = word_end;
+      }
+    }
+
+    return token_ids;
+  };
+
+  static constexpr size_t kWorkBatch = 1'000'000;
+  static constexpr size_t kChunkSize = 1 << 16;
+  word_piece::BasicChunkedIds<Id> token_ids;
+  if (text.size() < 2 * kWorkBatch) {
+    token_ids.chunks.push_back(worker(0, text.size()));
+  } else {
+    const size_t thread_count
+     = std::min(utils::globalThreadPool().maxThreads(), text.size() / kWorkBatch);
+    token_ids.chunks.resize(utils::dynamicChunkCount(text.size(), kChunkSize));
+    utils::forEachDynamicChunk(
+     utils::globalThreadPool(),
+     text.size(),
+     kChunkSize,
+     thread_count,
+     [&text](size_t pos) { return vkcom::is_space(text[pos]); },
+     [&](size_t chunk, size_t begin, size_t end) {
+       token_ids.chunks[chunk] = worker(begin, end);
+     });
+  }
+
+  return token_ids;
+}
+
+static word_piece::ChunkedIds
+encodeTrieWordPiece(const char *text, size_t size, const TrieWordPieceVocab &trie) {
+  if (size == 0) {
+    return {};
+  }
+  const std::vector<uint32_t> text_utf8 = utils::parseText(
+   text, size, utils::globalThreadPool(), nullptr, trie.vocab.normalization());
+  return encodeTrieWordPieceImpl<int>(text_utf8, trie);
+}
+
+namespace word_piece::trie {
+
+struct Tokenizer::Impl {
+  TrieWordPieceVocab trie;
+};
+
+Tokenizer::Tokenizer(const std::vector<std::string> &vocab, const Normalization &normalization)
+ : impl_(new Impl{
+  TrieWordPieceVocab(utils::CompiledVocab(utils::parseVocab(vocab, normalization)))}) {}
+
+Tokenizer::Tokenizer(const std::string &vocab_file, const Normalization &normalization)
+ : impl_(new Impl{TrieWordPieceVocab(utils::CompiledVocab::fromFile(vocab_file, normalization))}) {}
+
+Tokenizer::Tokenizer(Tokenizer &&other) noexcept = default;
+
+Tokenizer &Tokenizer::operator=(Tokenizer &&other) noexcept = default;
+
+Tokenizer::~Tokenizer() = default;
+
+std::vector<int> Tokenizer::encode(const std::string &text) const {
+  return encodeTrieWordPiece(text.data(), text.size(), impl_->trie).join();
+}
+
+std::vector<int> Tokenizer::encodeFile(const std::string &text_file) const {
+  boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
+  return encodeTrieWordPiece(mmap.const_data(), mmap.size(), impl_->trie).join();
+}
+
+void Tokenizer::encodeExternal(const std::string &text_file,
+                               const std::string &out_file,
+                               size_t memory_limit,
+                               OutputFormat format) const {
+  const size_t batch_size = memory_limit / 2 / utils::kExternalBatchesInFlight;
+  const utils::CompiledVocab &vocab = impl_->trie.vocab;
+  utils::IdWriter writer(out_file, format, vocab.contentHash(), vocab.size());
+  utils::encodeExternalCompact(
+   text_file,
+   batch_size,
+   true,
+   vocab.normalization(),
+   vocab.size(),
+   [this](auto id, const char *, size_t, const std::vector<uint32_t> &code_points) {
+     return encodeTrieWordPieceImpl<decltype(id)>(code_points, impl_->trie);
+   },
+   writer);
+  writer.close();
+}
+
+std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab) {
+  return Tokenizer(vocab).encode(text);
+}
+
+std::vector<int> encode(const std::string &text_file, const std::string &vocab_file) {
+  return Tokenizer(vocab_file).encodeFile(text_file);
+}
+
+void encodeExternal(const std::string &text_file,
+                    const std::string &vocab_file,
+                    const std::string &out_file,
+                    size_t memory_limit,
+                    OutputFormat format) {
+  Tokenizer(vocab_file).encodeExternal(text_file, out_file, memory_limit, format);
+}
+
+} // namespace word_piece::trie
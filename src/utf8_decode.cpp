@@ -0,0 +1,642 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#include "utf8_decode.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WORD_PIECE_X86 1
+#include <immintrin.h>
+#endif
+
+#include "third_party/utf8.hpp"
+#include "third_party/utf8_folding.hpp"
+
+namespace utils {
+
+namespace {
+
+// Decodes whole sequences starting before stop, the last one may end after it.
+const char *decodeScalarUntil(const char *begin,
+                              const char *it,
+                              const char *stop,
+                              const char *end,
+                              uint32_t *&out,
+                              std::vector<size_t> *invalid_positions) {
+  while (it < stop) {
+    uint64_t utf8_len = 0;
+    const uint32_t code_point = vkcom::chars_to_utf8(it, end - it, &utf8_len);
+    if (code_point != vkcom::INVALID_UNICODE) {
+      *out++ = code_point;
+    } else if (invalid_positions != nullptr) {
+      invalid_positions->push_back(static_cast<size_t>(it - begin));
+    }
+    it += utf8_len;
+  }
+  return it;
+}
+
+size_t decodeScalar(const char *begin,
+                    const char *end,
+                    uint32_t *out,
+                    std::vector<size_t> *invalid_positions) {
+  uint32_t *out_begin = out;
+  decodeScalarUntil(begin, begin, end, end, out, invalid_positions);
+  return static_cast<size_t>(out - out_begin);
+}
+
+#ifdef WORD_PIECE_X86
+
+// Byte masks of a window: bit i describes byte i.
+struct WindowMasks {
+  uint32_t continuation; // 10xxxxxx
+  uint32_t lead2;        // >= 0xc0, sequence of two or more bytes
+  uint32_t lead3;        // >= 0xe0
+  uint32_t lead4;        // >= 0xf0
+  uint32_t invalid_lead; // 0xc0, 0xc1 or >= 0xf5, never valid
+  uint32_t e0;
+  uint32_t ed;
+  uint32_t f0;
+  uint32_t f4;
+  uint32_t ge90;
+  uint32_t gea0;
+};
+
+// Validates sequences starting before limit on byte masks: every lead byte is followed by
+// the right number of continuation bytes, there are no stray continuation bytes, overlong
+// forms, surrogates or code points above U+10FFFF (the last three are decided by the lead
+// byte and the first continuation byte). Windows go with a fixed stride of limit bytes, so
+// the next load never waits for this check: *carry marks the bytes at the window begin which
+// finish a sequence of the previous window and is updated for the next one.
+bool validateWindow(const WindowMasks &masks, size_t limit, uint32_t *carry, uint32_t *starts) {
+  const uint32_t limit_mask = (1u << limit) - 1;
+  *starts = ~masks.continuation & limit_mask;
+  const uint32_t next_ge90 = masks.ge90 >> 1u;
+  const uint32_t next_gea0 = masks.gea0 >> 1u;
+  const uint32_t invalid = masks.invalid_lead | (masks.e0 & ~next_gea0) | (masks.ed & next_gea0)
+                         | (masks.f0 & ~next_ge90) | (masks.f4 & next_ge90);
+  const uint32_t tails = ((masks.lead2 & *starts) << 1u) | ((masks.lead3 & *starts) << 2u)
+                       | ((masks.lead4 & *starts) << 3u);
+  // Continuation bytes past limit which are not tails are left to the next window.
+  if ((invalid & *starts) != 0 || (tails & ~masks.continuation) != 0
+      || ((masks.continuation ^ (tails | *carry)) & limit_mask) != 0) {
+    return false;
+  }
+  *carry = tails >> limit;
+  return true;
+}
+
+struct ShuffleTable {
+  uint8_t shuffle[16][16];
+};
+
+// pshufb controls moving the selected 32-bit lanes to the front.
+constexpr ShuffleTable makeCompress4Table() {
+  ShuffleTable table{};
+  for (size_t mask = 0; mask < 16; mask++) {
+    size_t lane = 0;
+    for (size_t k = 0; k < 4; k++) {
+      if (((mask >> k) & 1u) != 0) {
+        for (size_t j = 0; j < 4; j++) {
+          table.shuffle[mask][lane * 4 + j] = static_cast<uint8_t>(k * 4 + j);
+        }
+        ++lane;
+      }
+    }
+    for (; lane < 4; lane++) {
+      for (size_t j = 0; j < 4; j++) {
+        table.shuffle[mask][lane * 4 + j] = 0x80;
+      }
+    }
+  }
+  return table;
+}
+
+struct PermutationTable {
+  uint32_t permutation[256][8];
+};
+
+// vpermd indices moving the selected 32-bit lanes to the front.
+constexpr PermutationTable makeCompress8Table() {
+  PermutationTable table{};
+  for (size_t mask = 0; mask < 256; mask++) {
+    size_t lane = 0;
+    for (uint32_t k = 0; k < 8; k++) {
+      if (((mask >> k) & 1u) != 0) {
+        table.permutation[mask][lane++] = k;
+      }
+    }
+  }
+  return table;
+}
+
+// Lane k of group g decodes the sequence whose lead byte is 4g + k. Every byte of the lane
+// selects the lead byte (to broadcast the sequence length) ...
+constexpr ShuffleTable makeLaneLeadTable() {
+  ShuffleTable table{};
+  for (size_t group = 0; group < 3; group++) {
+    for (size_t k = 0; k < 16; k++) {
+      table.shuffle[group][k] = static_cast<uint8_t>(group * 4 + k / 4);
+    }
+  }
+  return table;
+}
+
+// ... and then byte j of the lane takes byte lead + length - 4 + j, so the sequence ends up
+// right aligned in the lane. Entries hold lead - 4 + j, the length is added at runtime.
+constexpr ShuffleTable makeLaneIndexTable() {
+  ShuffleTable table{};
+  for (size_t group = 0; group < 3; group++) {
+    for (size_t k = 0; k < 16; k++) {
+      table.shuffle[group][k] = static_cast<uint8_t>(group * 4 + k / 4 + k % 4 - 4);
+    }
+  }
+  return table;
+}
+
+alignas(64) constexpr ShuffleTable kCompress4 = makeCompress4Table();
+alignas(64) constexpr PermutationTable kCompress8 = makeCompress8Table();
+alignas(64) constexpr ShuffleTable kLaneLead = makeLaneLeadTable();
+alignas(64) constexpr ShuffleTable kLaneIndex = makeLaneIndexTable();
+
+// By the high nibble of a byte: sequence length (0 for continuation bytes) and payload bits.
+alignas(16) constexpr uint8_t kLengthByNibble[16] = {1, 1, 1, 1, 1, 1, 1, 1,
+                                                     0, 0, 0, 0, 2, 2, 3, 4};
+alignas(16) constexpr uint8_t kPayloadByNibble[16] = {0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+                                                      0x7f, 0x7f, 0x3f, 0x3f, 0x3f, 0x3f,
+                                                      0x1f, 0x1f, 0x0f, 0x07};
+
+// Byte j of a lane is j: lanes whose j + length < 4 are zeroed.
+constexpr uint32_t kLaneBytePositions = 0x03020100;
+// pmaddubsw weights 64, 1 merge byte pairs, pmaddwd weights 4096, 1 merge the halves.
+constexpr int16_t kPairWeights = 0x0140;
+constexpr int32_t kHalfWeights = 0x00011000;
+
+__attribute__((target("sse4.1,popcnt"))) uint32_t geMask128(__m128i bytes, uint8_t bound) {
+  const __m128i ge
+   = _mm_cmpeq_epi8(_mm_max_epu8(bytes, _mm_set1_epi8(static_cast<char>(bound))), bytes);
+  return static_cast<uint32_t>(_mm_movemask_epi8(ge));
+}
+
+__attribute__((target("sse4.1,popcnt"))) uint32_t eqMask128(__m128i bytes, uint8_t value) {
+  return static_cast<uint32_t>(
+   _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(value)))));
+}
+
+__attribute__((target("sse4.1,popcnt"))) WindowMasks windowMasks128(__m128i bytes) {
+  const uint32_t lead2 = geMask128(bytes, 0xc0);
+  const uint32_t ge80 = static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+  return WindowMasks{ge80 & ~lead2,
+                     lead2,
+                     geMask128(bytes, 0xe0),
+                     geMask128(bytes, 0xf0),
+                     (lead2 & ~geMask128(bytes, 0xc2)) | geMask128(bytes, 0xf5),
+                     eqMask128(bytes, 0xe0),
+                     eqMask128(bytes, 0xed),
+                     eqMask128(bytes, 0xf0),
+                     eqMask128(bytes, 0xf4),
+                     geMask128(bytes, 0x90),
+                     geMask128(bytes, 0xa0)};
+}
+
+// Decodes four sequences whose lead bytes are selected by lead_table, see kLaneLead.
+__attribute__((target("sse4.1,popcnt"))) __m128i decodeGroup128(__m128i payload,
+                                                                __m128i lengths,
+                                                                const uint8_t *lead_table,
+                                                                const uint8_t *index_table) {
+  const __m128i lane_lengths
+   = _mm_shuffle_epi8(lengths, _mm_load_si128(reinterpret_cast<const __m128i *>(lead_table)));
+  const __m128i zeroed
+   = _mm_cmpgt_epi8(_mm_set1_epi8(4),
+                    _mm_add_epi8(lane_lengths, _mm_set1_epi32(kLaneBytePositions)));
+  const __m128i gather = _mm_or_si128(
+   _mm_add_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(index_table)), lane_lengths),
+   zeroed);
+  const __m128i lanes = _mm_shuffle_epi8(payload, gather);
+  return _mm_madd_epi16(_mm_maddubs_epi16(lanes, _mm_set1_epi16(kPairWeights)),
+                        _mm_set1_epi32(kHalfWeights));
+}
+
+constexpr size_t kStride128 = 12;
+
+// Decodes sequences starting in the first 12 bytes of a 16-byte window.
+// Returns false if the window needs the scalar path.
+__attribute__((target("sse4.1,popcnt"))) bool decodeWindow128(__m128i bytes,
+                                                             uint32_t *carry,
+                                                             uint32_t *&out) {
+  uint32_t starts = 0;
+  if (!validateWindow(windowMasks128(bytes), kStride128, carry, &starts)) {
+    return false;
+  }
+  const __m128i nibbles = _mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0x0f));
+  const __m128i lengths = _mm_shuffle_epi8(
+   _mm_load_si128(reinterpret_cast<const __m128i *>(kLengthByNibble)), nibbles);
+  const __m128i payload = _mm_and_si128(
+   bytes,
+   _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i *>(kPayloadByNibble)),
+                    nibbles));
+  for (size_t group = 0; group < 3; group++) {
+    const __m128i code_points = decodeGroup128(
+     payload, lengths, kLaneLead.shuffle[group], kLaneIndex.shuffle[group]);
+    const uint32_t lanes = (starts >> (group * 4)) & 0xfu;
+    const __m128i compress
+     = _mm_load_si128(reinterpret_cast<const __m128i *>(kCompress4.shuffle[lanes]));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_shuffle_epi8(code_points, compress));
+    out += __builtin_popcount(lanes);
+  }
+  return true;
+}
+
+// Decodes sequences starting in [it, it + stride) after a window failed validation,
+// skipping bytes decoded with the previous window. Returns carry for the next window.
+uint32_t decodeWindowScalar(const char *begin,
+                            const char *it,
+                            size_t stride,
+                            uint32_t carry,
+                            const char *end,
+                            uint32_t *&out,
+                            std::vector<size_t> *invalid_positions) {
+  const char *next = decodeScalarUntil(
+   begin, it + __builtin_popcount(carry), it + stride, end, out, invalid_positions);
+  return (1u << static_cast<size_t>(next - (it + stride))) - 1;
+}
+
+// Stores are full vectors, so the vector loops need a whole window of input ahead: then the
+// output never gets ahead of the input and out can not overflow.
+__attribute__((target("sse4.1,popcnt"))) void
+decodeLoop128(const char *begin,
+              const char *&it_ref,
+              const char *end,
+              uint32_t *&out_ref,
+              std::vector<size_t> *invalid_positions) {
+  static constexpr size_t kWindow = 16;
+
+  // Vector stores may alias anything, so the cursors are kept in locals.
+  const char *it = it_ref;
+  uint32_t *out = out_ref;
+  uint32_t carry = 0;
+  while (static_cast<size_t>(end - it) >= kWindow) {
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(it));
+    if (carry == 0 && _mm_movemask_epi8(bytes) == 0) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_cvtepu8_epi32(bytes));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4),
+                       _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 8),
+                       _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 12),
+                       _mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12)));
+      it += kWindow;
+      out += kWindow;
+      continue;
+    }
+    if (!decodeWindow128(bytes, &carry, out)) {
+      carry = decodeWindowScalar(begin, it, kStride128, carry, end, out, invalid_positions);
+    }
+    it += kStride128;
+  }
+  it_ref = it + __builtin_popcount(carry);
+  out_ref = out;
+}
+
+__attribute__((target("sse4.1,popcnt"))) size_t
+decodeSse41(const char *begin,
+            const char *end,
+            uint32_t *out,
+            std::vector<size_t> *invalid_positions) {
+  uint32_t *out_begin = out;
+  const char *it = begin;
+  decodeLoop128(begin, it, end, out, invalid_positions);
+  decodeScalarUntil(begin, it, end, end, out, invalid_positions);
+  return static_cast<size_t>(out - out_begin);
+}
+
+__attribute__((target("avx2,popcnt"))) uint32_t geMask256(__m256i bytes, uint8_t bound) {
+  const __m256i ge
+   = _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, _mm256_set1_epi8(static_cast<char>(bound))), bytes);
+  return static_cast<uint32_t>(_mm256_movemask_epi8(ge));
+}
+
+__attribute__((target("avx2,popcnt"))) uint32_t eqMask256(__m256i bytes, uint8_t value) {
+  return static_cast<uint32_t>(
+   _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(static_cast<char>(value)))));
+}
+
+__attribute__((target("avx2,popcnt"))) WindowMasks windowMasks256(__m256i bytes) {
+  const uint32_t lead2 = geMask256(bytes, 0xc0);
+  const auto ge80 = static_cast<uint32_t>(_mm256_movemask_epi8(bytes));
+  return WindowMasks{ge80 & ~lead2,
+                     lead2,
+                     geMask256(bytes, 0xe0),
+                     geMask256(bytes, 0xf0),
+                     (lead2 & ~geMask256(bytes, 0xc2)) | geMask256(bytes, 0xf5),
+                     eqMask256(bytes, 0xe0),
+                     eqMask256(bytes, 0xed),
+                     eqMask256(bytes, 0xf0),
+                     eqMask256(bytes, 0xf4),
+                     geMask256(bytes, 0x90),
+                     geMask256(bytes, 0xa0)};
+}
+
+constexpr size_t kStride256 = 24;
+
+// Decodes sequences starting in the first 24 bytes of a 32-byte window, reads up to
+// 36 bytes. Returns false if the window needs the scalar path.
+__attribute__((target("avx2,popcnt"))) bool decodeWindow256(const char *it,
+                                                            __m256i bytes,
+                                                            uint32_t *carry,
+                                                            uint32_t *&out) {
+  uint32_t starts = 0;
+  if (!validateWindow(windowMasks256(bytes), kStride256, carry, &starts)) {
+    return false;
+  }
+  const __m256i length_table = _mm256_broadcastsi128_si256(
+   _mm_load_si128(reinterpret_cast<const __m128i *>(kLengthByNibble)));
+  const __m256i payload_table = _mm256_broadcastsi128_si256(
+   _mm_load_si128(reinterpret_cast<const __m128i *>(kPayloadByNibble)));
+  const __m256i lead = _mm256_broadcastsi128_si256(
+   _mm_load_si128(reinterpret_cast<const __m128i *>(kLaneLead.shuffle[0])));
+  const __m256i index = _mm256_broadcastsi128_si256(
+   _mm_load_si128(reinterpret_cast<const __m128i *>(kLaneIndex.shuffle[0])));
+  for (size_t group = 0; group < 3; group++) {
+    // pshufb works within 128-bit halves, so each half loads the bytes of its four lanes.
+    const char *group_begin = it + group * 8;
+    const __m256i group_bytes = _mm256_inserti128_si256(
+     _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group_begin))),
+     _mm_loadu_si128(reinterpret_cast<const __m128i *>(group_begin + 4)),
+     1);
+    const __m256i nibbles
+     = _mm256_and_si256(_mm256_srli_epi16(group_bytes, 4), _mm256_set1_epi8(0x0f));
+    const __m256i lengths = _mm256_shuffle_epi8(length_table, nibbles);
+    const __m256i payload
+     = _mm256_and_si256(group_bytes, _mm256_shuffle_epi8(payload_table, nibbles));
+
+    const __m256i lane_lengths = _mm256_shuffle_epi8(lengths, lead);
+    const __m256i zeroed
+     = _mm256_cmpgt_epi8(_mm256_set1_epi8(4),
+                         _mm256_add_epi8(lane_lengths, _mm256_set1_epi32(kLaneBytePositions)));
+    const __m256i gather = _mm256_or_si256(_mm256_add_epi8(index, lane_lengths), zeroed);
+    const __m256i lanes = _mm256_shuffle_epi8(payload, gather);
+    const __m256i code_points
+     = _mm256_madd_epi16(_mm256_maddubs_epi16(lanes, _mm256_set1_epi16(kPairWeights)),
+                         _mm256_set1_epi32(kHalfWeights));
+
+    const uint32_t lane_mask = (starts >> (group * 8)) & 0xffu;
+    const __m256i compress = _mm256_load_si256(
+     reinterpret_cast<const __m256i *>(kCompress8.permutation[lane_mask]));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out),
+                        _mm256_permutevar8x32_epi32(code_points, compress));
+    out += __builtin_popcount(lane_mask);
+  }
+  return true;
+}
+
+__attribute__((target("avx2,popcnt"))) size_t decodeAvx2(const char *begin,
+                                                         const char *end,
+                                                         uint32_t *out,
+                                                         std::vector<size_t> *invalid_positions) {
+  static constexpr size_t kWindow = 32;
+  static constexpr size_t kWindowRead = 36; // group loads reach past the window
+
+  uint32_t *out_begin = out;
+  const char *it = begin;
+  uint32_t carry = 0;
+  while (static_cast<size_t>(end - it) >= kWindowRead) {
+    const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(it));
+    if (carry == 0 && _mm256_movemask_epi8(bytes) == 0) {
+      const __m128i low = _mm256_castsi256_si128(bytes);
+      const __m128i high = _mm256_extracti128_si256(bytes, 1);
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), _mm256_cvtepu8_epi32(low));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 8),
+                          _mm256_cvtepu8_epi32(_mm_srli_si128(low, 8)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 16), _mm256_cvtepu8_epi32(high));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 24),
+                          _mm256_cvtepu8_epi32(_mm_srli_si128(high, 8)));
+      it += kWindow;
+      out += kWindow;
+      continue;
+    }
+    if (!decodeWindow256(it, bytes, &carry, out)) {
+      carry = decodeWindowScalar(begin, it, kStride256, carry, end, out, invalid_positions);
+    }
+    it += kStride256;
+  }
+  it += __builtin_popcount(carry);
+  decodeLoop128(begin, it, end, out, invalid_positions);
+  decodeScalarUntil(begin, it, end, end, out, invalid_positions);
+  return static_cast<size_t>(out - out_begin);
+}
+
+#endif // WORD_PIECE_X86
+
+// Index of the mapping of vkcom::FoldRecord, -1 if code points are not mapped.
+int foldMapping(const word_piece::Normalization &normalization) {
+  if (normalization.lower_case && normalization.strip_accents) {
+    return 2;
+  }
+  return normalization.strip_accents ? 1 : normalization.lower_case ? 0 : -1;
+}
+
+// Appends the normalized code point to out, returns the new end.
+uint32_t *foldCodePoint(uint32_t code_point, int mapping, bool clean_text, uint32_t *out) {
+  static constexpr uint32_t kHangulBegin = 0xAC00;
+  static constexpr uint32_t kJamoL = 0x1100;
+  static constexpr uint32_t kJamoV = 0x1161;
+  static constexpr uint32_t kJamoT = 0x11A7;
+  static constexpr uint32_t kJamoVCount = 21;
+  static constexpr uint32_t kJamoTCount = 28;
+
+  if (code_point < 0x80) {
+    if (clean_text && (code_point < 0x20 || code_point == 0x7F) && code_point != '\t'
+        && code_point != '\n' && code_point != '\r') {
+      return out;
+    }
+    // Mappings 0 and 2 lowercase.
+    if ((mapping == 0 || mapping == 2) && code_point - 'A' < 26) {
+      code_point += 'a' - 'A';
+    }
+    *out++ = code_point;
+    return out;
+  }
+  if ((code_point >> vkcom::FOLD_BLOCK_BITS) >= vkcom::FOLD_INDEX_SIZE) {
+    *out++ = code_point;
+    return out;
+  }
+
+  const vkcom::FoldRecord &record
+   = vkcom::FOLD_RECORDS[vkcom::FOLD_BLOCKS[vkcom::FOLD_INDEX[code_point >> vkcom::FOLD_BLOCK_BITS]]
+                                          [code_point & ((1u << vkcom::FOLD_BLOCK_BITS) - 1)]];
+  if (clean_text && (record.flags & vkcom::FOLD_CONTROL) != 0) {
+    return out;
+  }
+  if (mapping < 0) {
+    *out++ = code_point;
+    return out;
+  }
+  if ((record.flags & vkcom::FOLD_HANGUL) != 0) {
+    if (mapping == 0) {
+      *out++ = code_point;
+      return out;
+    }
+    const uint32_t index = code_point - kHangulBegin;
+    *out++ = kJamoL + index / (kJamoVCount * kJamoTCount);
+    *out++ = kJamoV + index % (kJamoVCount * kJamoTCount) / kJamoTCount;
+    if (index % kJamoTCount != 0) {
+      *out++ = kJamoT + index % kJamoTCount;
+    }
+    return out;
+  }
+  const int32_t value = record.mapping[mapping];
+  switch ((record.flags >> (2 * mapping)) & 3u) {
+    case vkcom::FOLD_DELTA:
+      *out++ = static_cast<uint32_t>(static_cast<int32_t>(code_point) + value);
+      break;
+    case vkcom::FOLD_EXPANSION:
+      for (int32_t i = 0; i < (value & 3); i++) {
+        *out++ = vkcom::FOLD_EXPANSIONS[(value >> 2) + i];
+      }
+      break;
+    default: // FOLD_DROP
+      break;
+  }
+  return out;
+}
+
+Utf8Isa detectUtf8Isa() {
+#ifdef WORD_PIECE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return Utf8Isa::kAvx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return Utf8Isa::kSse41;
+  }
+#endif
+  return Utf8Isa::kScalar;
+}
+
+} // namespace
+
+Utf8Isa bestUtf8Isa() {
+  static const Utf8Isa isa = detectUtf8Isa();
+  return isa;
+}
+
+const char *utf8IsaName(Utf8Isa isa) {
+  switch (isa) {
+    case Utf8Isa::kScalar:
+      return "scalar";
+    case Utf8Isa::kSse41:
+      return "sse4.1";
+    case Utf8Isa::kAvx2:
+      return "avx2";
+  }
+  return "unknown";
+}
+
+size_t decodeUtf8(const char *begin,
+                  const char *end,
+                  uint32_t *out,
+                  std::vector<size_t> *invalid_positions) {
+  return decodeUtf8(bestUtf8Isa(), begin, end, out, invalid_positions);
+}
+
+size_t decodeUtf8(Utf8Isa isa,
+                  const char *begin,
+                  const char *end,
+                  uint32_t *out,
+                  std::vector<size_t> *invalid_positions) {
+  if (static_cast<int>(isa) > static_cast<int>(bestUtf8Isa())) {
+    throw std::runtime_error(std::string("UTF-8 decoder ") + utf8IsaName(isa)
+                             + " is not supported by this CPU");
+  }
+  switch (isa) {
+#ifdef WORD_PIECE_X86
+    case Utf8Isa::kAvx2:
+      return decodeAvx2(begin, end, out, invalid_positions);
+    case Utf8Isa::kSse41:
+      return decodeSse41(begin, end, out, invalid_positions);
+#endif
+    default:
+      return decodeScalar(begin, end, out, invalid_positions);
+  }
+}
+
+size_t normalizeCodePoints(const uint32_t *code_points,
+                           size_t size,
+                           uint32_t *out,
+                           const word_piece::Normalization &normalization) {
+  const int mapping = foldMapping(normalization);
+  uint32_t *out_begin = out;
+  for (size_t i = 0; i < size; i++) {
+    out = foldCodePoint(code_points[i], mapping, normalization.clean_text, out);
+  }
+  return static_cast<size_t>(out - out_begin);
+}
+
+size_t decodeUtf8(const char *begin,
+                  const char *end,
+                  uint32_t *out,
+                  const word_piece::Normalization &normalization,
+                  std::vector<size_t> *invalid_positions,
+                  std::vector<size_t> *source_offsets) {
+  // Blocks are decoded into a buffer which stays in L1 and normalized from it into out.
+  static constexpr size_t kBlockSize = 4096;
+
+  if (!normalization.enabled() && source_offsets == nullptr) {
+    return decodeUtf8(begin, end, out, invalid_positions);
+  }
+  // Source offsets skip the dropped bytes, so they are collected even if the caller does not.
+  std::vector<size_t> dropped;
+  if (source_offsets != nullptr && invalid_positions == nullptr) {
+    invalid_positions = &dropped;
+  }
+  const int mapping = foldMapping(normalization);
+  uint32_t block[kBlockSize];
+  uint32_t *out_begin = out;
+  for (const char *block_begin = begin; block_begin < end;) {
+    const char *block_end = block_begin + std::min<size_t>(kBlockSize, end - block_begin);
+    // Moves the end back to the start of a sequence it cuts. Without a symbol start in the
+    // last three bytes the end is not inside a valid sequence.
+    for (size_t back = 0; block_end < end && back < 4; back++) {
+      if (vkcom::check_symbol_start(*(block_end - back))) {
+        block_end -= back;
+        break;
+      }
+    }
+    const size_t invalid_before = invalid_positions != nullptr ? invalid_positions->size() : 0;
+    const size_t length = decodeUtf8(block_begin, block_end, block, invalid_positions);
+    if (invalid_positions != nullptr) {
+      for (size_t i = invalid_before; i < invalid_positions->size(); i++) {
+        (*invalid_positions)[i] += static_cast<size_t>(block_begin - begin);
+      }
+    }
+    if (source_offsets == nullptr) {
+      for (size_t i = 0; i < length; i++) {
+        out = foldCodePoint(block[i], mapping, normalization.clean_text, out);
+      }
+    } else {
+      // Walks the bytes of the block along its code points: every valid sequence is as long
+      // as the UTF-8 encoding of its code point.
+      size_t byte = static_cast<size_t>(block_begin - begin);
+      size_t next_invalid = invalid_before;
+      for (size_t i = 0; i < length; i++) {
+        while (next_invalid < invalid_positions->size()
+               && (*invalid_positions)[next_invalid] == byte) {
+          ++byte;
+          ++next_invalid;
+        }
+        uint32_t *folded = foldCodePoint(block[i], mapping, normalization.clean_text, out);
+        source_offsets->insert(source_offsets->end(), static_cast<size_t>(folded - out), byte);
+        out = folded;
+        byte += block[i] < 0x80 ? 1 : block[i] < 0x800 ? 2 : block[i] < 0x10000 ? 3 : 4;
+      }
+    }
+    block_begin = block_end;
+  }
+  return static_cast<size_t>(out - out_begin);
+}
+
+} // namespace utils
@@ -0,0 +1,58 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "word_piece.hpp"
+
+namespace utils {
+
+// Instruction sets of the UTF-8 decoder, from the slowest. The best supported one is picked
+// at runtime, so a portable build still gets the vector paths.
+enum class Utf8Isa {
+  kScalar,
+  kSse41,
+  kAvx2,
+};
+
+Utf8Isa bestUtf8Isa();
+
+const char *utf8IsaName(Utf8Isa isa);
+
+// Decodes [begin, end) exactly like vkcom::decode_utf8: a byte which does not start a valid
+// sequence is dropped and decoding resumes from the next byte. Offsets of dropped bytes
+// (relative to begin) are appended to invalid_positions if it is not null.
+// out must have room for end - begin code points. Returns the number of written code points.
+size_t decodeUtf8(const char *begin,
+                  const char *end,
+                  uint32_t *out,
+                  std::vector<size_t> *invalid_positions = nullptr);
+
+// Same with an explicit instruction set, which must not be better than bestUtf8Isa().
+size_t decodeUtf8(Utf8Isa isa,
+                  const char *begin,
+                  const char *end,
+                  uint32_t *out,
+                  std::vector<size_t> *invalid_positions = nullptr);
+
+// Decodes like decodeUtf8 and normalizes every code point in the same pass. A code point never
+// becomes more code points than it has bytes, so out needs room for end - begin code points.
+// The offset (relative to begin) of the source code point of every written code point is
+// appended to source_offsets if it is not null.
+size_t decodeUtf8(const char *begin,
+                  const char *end,
+                  uint32_t *out,
+                  const word_piece::Normalization &normalization,
+                  std::vector<size_t> *invalid_positions = nullptr,
+                  std::vector<size_t> *source_offsets = nullptr);
+
+// Normalizes decoded code points, out needs room for 3 * size of them.
+size_t normalizeCodePoints(const uint32_t *code_points,
+                           size_t size,
+                           uint32_t *out,
+                           const word_piece::Normalization &normalization);
+
+} // namespace utils
@@ -2,15 +2,28 @@
 
 #include "utils.hpp"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <cstddef>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "third_party/thread_pool.hpp"
 #include "third_party/utf8.hpp"
+#include "utf8_decode.hpp"
 
 static constexpr std::string_view kUnkTokenIdStr = "[UNK]";
 
@@ -27,58 +40,379 @@ ThreadPool &globalThreadPool(size_t n_threads) {
   return thread_pool;
 }
 
-void writeToFile(const std::string &file, const std::vector<int> &ids) {
-  std::ofstream fout(file);
-  for (int id : ids) {
-    fout << id << ' ';
+namespace {
+
+std::atomic<bool> work_stats_enabled{false};
+std::mutex work_stats_mutex;
+std::vector<std::chrono::nanoseconds> work_stats;
+
+} // namespace
+
+void enableWorkStats(bool enable) { work_stats_enabled = enable; }
+
+bool workStatsEnabled() { return work_stats_enabled.load(std::memory_order_relaxed); }
+
+void addBusyTime(size_t participant, std::chrono::nanoseconds busy) {
+  std::lock_guard<std::mutex> lock(work_stats_mutex);
+  if (work_stats.size() <= participant) {
+    work_stats.resize(participant + 1);
+  }
+  work_stats[participant] += busy;
+}
+
+std::vector<std::chrono::nanoseconds> takeWorkStats() {
+  std::lock_guard<std::mutex> lock(work_stats_mutex);
+  return std::exchange(work_stats, {});
+}
+
+namespace {
+
+constexpr size_t kIdBufferSize = 1 << 20;
+// "-2147483648 "
+constexpr size_t kMaxTextIdSize = 12;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool kLittleEndianHost = false;
+#else
+constexpr bool kLittleEndianHost = true;
+#endif
+
+template <typename T>
+void storeLittleEndian(char *out, T value) {
+  if constexpr (kLittleEndianHost) {
+    std::memcpy(out, &value, sizeof(T));
+  } else {
+    for (size_t i = 0; i < sizeof(T); i++) {
+      out[i] = static_cast<char>(static_cast<std::make_unsigned_t<T>>(value) >> (8 * i));
+    }
+  }
+}
+
+template <typename T>
+T loadLittleEndian(const char *in) {
+  std::make_unsigned_t<T> value = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    value |= static_cast<std::make_unsigned_t<T>>(static_cast<uint8_t>(in[i])) << (8 * i);
+  }
+  return static_cast<T>(value);
+}
+
+// Back from toId: word_piece::kUnkId16 is UNK.
+int fromId(int id) { return id; }
+
+int fromId(uint16_t id) {
+  return id == word_piece::kUnkId16 ? WordPieceVocabulary::kDefaultUnkTokenId : id;
+}
+
+void writeAll(int fd, const char *data, size_t size, const std::string &file) {
+  while (size > 0) {
+    const ssize_t written = ::write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Cannot write to " + file + ": " + std::strerror(errno));
+    }
+    data += written;
+    size -= static_cast<size_t>(written);
+  }
+}
+
+} // namespace
+
+IdWriter::IdWriter(const std::string &file,
+                   word_piece::OutputFormat format,
+                   uint64_t vocab_hash,
+                   size_t vocab_size)
+ : file_(file),
+   format_(format),
+   // 0xFFFF is UNK, so the largest id must be less. Unknown vocab size gets full width.
+   id_bytes_(vocab_size > 0 && compactIds(vocab_size) ? 2 : 4),
+   buffer_(new char[kIdBufferSize]) {
+  fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    throw std::runtime_error("Cannot open " + file + ": " + std::strerror(errno));
+  }
+  if (format_ == word_piece::OutputFormat::kBinary) {
+    char *header = buffer_.get();
+    std::memset(header, 0, sizeof(IdFileHeader));
+    std::memcpy(header + offsetof(IdFileHeader, magic), IdFileHeader::kMagic, 8);
+    storeLittleEndian(header + offsetof(IdFileHeader, version), IdFileHeader::kVersion);
+    storeLittleEndian(header + offsetof(IdFileHeader, id_bytes), id_bytes_);
+    storeLittleEndian(header + offsetof(IdFileHeader, vocab_hash), vocab_hash);
+    storeLittleEndian(header + offsetof(IdFileHeader, token_count), IdFileHeader::kUnknownCount);
+    buffered_ = sizeof(IdFileHeader);
+  }
+}
+
+IdWriter::~IdWriter() {
+  if (fd_ >= 0) {
+    try {
+      close();
+    } catch (const std::exception &) {
+      ::close(fd_);
+    }
+  }
+}
+
+void IdWriter::write(const int *ids, size_t count) { writeIds(ids, count); }
+
+void IdWriter::write(const uint16_t *ids, size_t count) { writeIds(ids, count); }
+
+template <typename Id>
+void IdWriter::writeIds(const Id *ids, size_t count) {
+  token_count_ += count;
+  if (format_ == word_piece::OutputFormat::kText) {
+    for (const Id *it = ids; it != ids + count; it++) {
+      if (kIdBufferSize - buffered_ < kMaxTextIdSize) {
+        flush();
+      }
+      char *out = buffer_.get() + buffered_;
+      char *end = std::to_chars(out, out + kMaxTextIdSize, fromId(*it)).ptr;
+      *end++ = ' ';
+      buffered_ = static_cast<size_t>(end - buffer_.get());
+    }
+    return;
+  }
+
+  while (count > 0) {
+    const size_t batch = std::min(count, (kIdBufferSize - buffered_) / id_bytes_);
+    if (batch == 0) {
+      flush();
+      continue;
+    }
+    char *out = buffer_.get() + buffered_;
+    if (id_bytes_ == sizeof(Id) && kLittleEndianHost) {
+      std::memcpy(out, ids, batch * sizeof(Id));
+    } else if (id_bytes_ == 4) {
+      for (size_t i = 0; i < batch; i++) {
+        storeLittleEndian(out + 4 * i, static_cast<int32_t>(fromId(ids[i])));
+      }
+    } else {
+      for (size_t i = 0; i < batch; i++) {
+        storeLittleEndian(out + 2 * i, toId<uint16_t>(fromId(ids[i])));
+      }
+    }
+    buffered_ += batch * id_bytes_;
+    ids += batch;
+    count -= batch;
+  }
+}
+
+void IdWriter::flush() {
+  writeAll(fd_, buffer_.get(), buffered_, file_);
+  buffered_ = 0;
+}
+
+void IdWriter::close() {
+  if (fd_ < 0) {
+    return;
+  }
+  flush();
+  if (format_ == word_piece::OutputFormat::kBinary) {
+    char count[sizeof(uint64_t)];
+    storeLittleEndian(count, token_count_);
+    // A pipe keeps kUnknownCount.
+    if (::pwrite(fd_, count, sizeof(count), offsetof(IdFileHeader, token_count)) < 0
+        && errno != ESPIPE) {
+      throw std::runtime_error("Cannot write to " + file_ + ": " + std::strerror(errno));
+    }
+  }
+  const int fd = fd_;
+  fd_ = -1;
+  if (::close(fd) != 0) {
+    throw std::runtime_error("Cannot close " + file_ + ": " + std::strerror(errno));
   }
 }
 
-std::vector<uint32_t> parseText(const char *text, size_t size, ThreadPool &thread_pool) {
+std::vector<int> readIdsFromFile(const std::string &file) {
+  std::ifstream fin(file, std::ios::binary);
+  if (!fin) {
+    throw std::runtime_error("Cannot open " + file);
+  }
+  std::stringstream stream;
+  stream << fin.rdbuf();
+  const std::string data = stream.str();
+
+  std::vector<int> ids;
+  if (data.size() >= sizeof(IdFileHeader)
+      && std::memcmp(data.data(), IdFileHeader::kMagic, sizeof(IdFileHeader::kMagic)) == 0) {
+    const char *header = data.data();
+    const auto version = loadLittleEndian<uint32_t>(header + offsetof(IdFileHeader, version));
+    const auto id_bytes = loadLittleEndian<uint32_t>(header + offsetof(IdFileHeader, id_bytes));
+    const auto token_count
+     = loadLittleEndian<uint64_t>(header + offsetof(IdFileHeader, token_count));
+    const size_t payload = data.size() - sizeof(IdFileHeader);
+    if (version != IdFileHeader::kVersion || (id_bytes != 2 && id_bytes != 4)
+        || payload % id_bytes != 0
+        || (token_count != IdFileHeader::kUnknownCount && token_count != payload / id_bytes)) {
+      throw std::runtime_error("Id file " + file + " is malformed");
+    }
+    ids.resize(payload / id_bytes);
+    const char *in = header + sizeof(IdFileHeader);
+    for (size_t i = 0; i < ids.size(); i++) {
+      if (id_bytes == 4) {
+        ids[i] = loadLittleEndian<int32_t>(in + 4 * i);
+      } else {
+        const auto id = loadLittleEndian<uint16_t>(in + 2 * i);
+        ids[i] = id == 0xFFFF ? -1 : id;
+      }
+    }
+    return ids;
+  }
+
+  const char *it = data.data();
+  const char *end = data.data() + data.size();
+  while (true) {
+    while (it != end && std::isspace(static_cast<unsigned char>(*it))) {
+      ++it;
+    }
+    if (it == end) {
+      break;
+    }
+    int id = 0;
+    const auto [next, error] = std::from_chars(it, end, id);
+    if (error != std::errc()) {
+      throw std::runtime_error("Id file " + file + " is malformed");
+    }
+    ids.push_back(id);
+    it = next;
+  }
+  return ids;
+}
+
+std::vector<uint32_t> parseText(const char *text,
+                                size_t size,
+                                ThreadPool &thread_pool,
+                                std::vector<size_t> *invalid_positions,
+                                const word_piece::Normalization &normalization,
+                                std::vector<size_t> *source_offsets) {
   static constexpr size_t kWorkBatch = 5'000'000;
+  static constexpr size_t kChunkSize = 1 << 18;
 
+  // Every chunk is decoded in place at its byte offset: a code point never takes less than
+  // a byte, so chunks do not overlap and are then moved together without extra buffers.
+  std::vector<uint32_t> text_utf8(size);
+  size_t text_utf8_size = 0;
   if (size < 2 * kWorkBatch) {
-    return vkcom::decode_utf8(text, text + size);
+    text_utf8_size = decodeUtf8(
+     text, text + size, text_utf8.data(), normalization, invalid_positions, source_offsets);
   } else {
     const size_t thread_count = std::min(thread_pool.maxThreads(), size / kWorkBatch);
-    const size_t work_batch = size / thread_count + 1;
-    std::vector<std::vector<uint32_t>> per_thread_text_utf8(thread_count);
-    size_t work_start = 0;
-    for (size_t thread_id = 0; thread_id < thread_count && work_start < size; thread_id++) {
-      size_t work_end = std::min(size, work_start + work_batch);
-      while (work_end < size && !vkcom::check_symbol_start(text[work_end])) {
-        ++work_end;
+    const size_t chunk_count = dynamicChunkCount(size, kChunkSize);
+    std::vector<size_t> chunk_starts(chunk_count);
+    std::vector<size_t> chunk_sizes(chunk_count);
+    std::vector<std::vector<size_t>> chunk_invalid_positions(chunk_count);
+    std::vector<std::vector<size_t>> chunk_source_offsets(chunk_count);
+    forEachDynamicChunk(
+     thread_pool,
+     size,
+     kChunkSize,
+     thread_count,
+     [text](size_t pos) { return vkcom::check_symbol_start(text[pos]); },
+     [&](size_t chunk, size_t begin, size_t end) {
+       chunk_starts[chunk] = begin;
+       chunk_sizes[chunk] = decodeUtf8(
+        text + begin,
+        text + end,
+        text_utf8.data() + begin,
+        normalization,
+        invalid_positions != nullptr ? &chunk_invalid_positions[chunk] : nullptr,
+        source_offsets != nullptr ? &chunk_source_offsets[chunk] : nullptr);
+     });
+
+    for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+      const size_t chunk_start = chunk_starts[chunk];
+      if (chunk_sizes[chunk] != 0 && text_utf8_size != chunk_start) {
+        std::memmove(text_utf8.data() + text_utf8_size,
+                     text_utf8.data() + chunk_start,
+                     chunk_sizes[chunk] * sizeof(uint32_t));
       }
-      thread_pool.submit([thread_id, work_start, work_end, text, &per_thread_text_utf8] {
-        const char *begin = text + work_start;
-        const size_t len = work_end - work_start;
-        per_thread_text_utf8[thread_id] = vkcom::decode_utf8(begin, begin + len);
-      });
-      work_start = work_end;
-    }
-
-    thread_pool.waitCompletion();
-    size_t text_utf8_size = 0;
-    for (size_t thread_id = 0; thread_id < thread_count; thread_id++) {
-      text_utf8_size += per_thread_text_utf8[thread_id].size();
-    }
-    std::vector<uint32_t> text_utf8(text_utf8_size);
-    text_utf8.resize(text_utf8_size);
-    work_start = 0;
-    for (size_t thread_id = 0; thread_id < thread_count; thread_id++) {
-      std::vector<uint32_t> &segment = per_thread_text_utf8[thread_id];
-      if (!segment.empty()) {
-        std::memcpy(text_utf8.data() + work_start,
-                    segment.data(),
-                    segment.size() * sizeof(uint32_t));
-        work_start += segment.size();
+      text_utf8_size += chunk_sizes[chunk];
+      if (invalid_positions != nullptr) {
+        for (size_t position : chunk_invalid_positions[chunk]) {
+          invalid_positions->push_back(chunk_start + position);
+        }
       }
+      if (source_offsets != nullptr) {
+        for (size_t offset : chunk_source_offsets[chunk]) {
+          source_offsets->push_back(chunk_start + offset);
+        }
+        std::vector<size_t>().swap(chunk_source_offsets[chunk]);
+      }
+    }
+  }
+  text_utf8.resize(text_utf8_size);
+  // Mostly non-ASCII text leaves most of the buffer unused.
+  if (text_utf8_size < size / 2) {
+    text_utf8.shrink_to_fit();
+  }
+  return text_utf8;
+}
+
+namespace {
+
+// Length of the valid sequence which starts with lead.
+size_t utf8SequenceLength(char lead) {
+  const auto byte = static_cast<uint8_t>(lead);
+  return byte < 0x80 ? 1 : byte < 0xE0 ? 2 : byte < 0xF0 ? 3 : 4;
+}
+
+} // namespace
+
+void spansToByteOffsets(const char *text,
+                        size_t size,
+                        const std::vector<size_t> &invalid_positions,
+                        word_piece::TokenSpan *spans,
+                        size_t count) {
+  const auto sequence_length = [text](size_t position) {
+    return utf8SequenceLength(text[position]);
+  };
+
+  // byte is the first byte of the code point with index code_point, spans only move it forward.
+  size_t byte = 0;
+  size_t code_point = 0;
+  size_t next_invalid = 0;
+  const auto skip_invalid = [&] {
+    while (next_invalid < invalid_positions.size() && invalid_positions[next_invalid] == byte) {
+      ++byte;
+      ++next_invalid;
     }
-    return text_utf8;
+  };
+  const auto seek = [&](size_t target) {
+    while (code_point < target && byte < size) {
+      byte += sequence_length(byte);
+      ++code_point;
+      skip_invalid();
+    }
+  };
+
+  skip_invalid();
+  for (size_t i = 0; i < count; i++) {
+    word_piece::TokenSpan &span = spans[i];
+    seek(span.begin);
+    span.begin = byte;
+    // The end is right after the last code point, not at the next one: invalid bytes between
+    // them do not belong to the token.
+    seek(span.end - 1);
+    span.end = byte + sequence_length(byte);
   }
 }
 
-WordPieceToken::WordPieceToken(const std::string &encoded_word)
+void spansToByteOffsets(const char *text,
+                        const std::vector<size_t> &source_offsets,
+                        word_piece::TokenSpan *spans,
+                        size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    word_piece::TokenSpan &span = spans[i];
+    const size_t last = source_offsets[span.end - 1];
+    span.begin = source_offsets[span.begin];
+    span.end = last + utf8SequenceLength(text[last]);
+  }
+}
+
+WordPieceToken::WordPieceToken(const std::string &encoded_word,
+                               const word_piece::Normalization &normalization)
  : is_prefix(true), is_special(false), is_malformed(false), word(vkcom::decode_utf8(encoded_word)) {
   if (isSuffixVocab(word)) {
     is_prefix = false;
@@ -86,6 +420,17 @@ WordPieceToken::WordPieceToken(const std::string &encoded_word)
   } else if (isSpecialToken(word)) {
     is_special = true;
   }
+  if (normalization.enabled() && !is_special && !word.empty()) {
+    std::vector<uint32_t> normalized(3 * word.size());
+    normalized.resize(
+     normalizeCodePoints(word.data(), word.size(), normalized.data(), normalization));
+    if (normalized.empty()) {
+      is_malformed = true;
+      std::cerr << "Vocab word is empty after normalization: " << encoded_word << std::endl;
+    } else {
+      word = std::move(normalized);
+    }
+  }
 
   bool all_punctuation = true;
   for (uint32_t code_point : word) {
@@ -105,23 +450,27 @@ WordPieceToken::WordPieceToken(const std::string &encoded_word)
   }
 }
 
-WordPieceVocabulary parseVocab(const std::vector<std::string> &vocab) {
+WordPieceVocabulary parseVocab(const std::vector<std::string> &vocab,
+                               const word_piece::Normalization &normalization) {
   WordPieceVocabulary vocab_utf8;
+  vocab_utf8.normalization = normalization;
   vocab_utf8.tokens.reserve(vocab.size());
   int token_id = 0;
   for (const std::string &word : vocab) {
     if (word == kUnkTokenIdStr) {
       vocab_utf8.unk_token_id = token_id;
     }
-    WordPieceToken token(word);
+    WordPieceToken token(word, normalization);
     vocab_utf8.tokens.push_back(std::move(token));
     ++token_id;
   }
   return vocab_utf8;
 }
 
-WordPieceVocabulary readVocabFromFile(const std::string &file) {
+WordPieceVocabulary readVocabFromFile(const std::string &file,
+                                      const word_piece::Normalization &normalization) {
   WordPieceVocabulary vocab_utf8;
+  vocab_utf8.normalization = normalization;
   std::ifstream fin(file);
   std::string word;
   int token_id = 0;
@@ -129,7 +478,7 @@ WordPieceVocabulary readVocabFromFile(const std::string &file) {
     if (word == kUnkTokenIdStr) {
       vocab_utf8.unk_token_id = token_id;
     }
-    WordPieceToken token(word);
+    WordPieceToken token(word, normalization);
     vocab_utf8.tokens.push_back(std::move(token));
     ++token_id;
   }
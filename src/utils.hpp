@@ -2,10 +2,17 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "third_party/thread_pool.hpp"
+#include "word_piece.hpp"
 
 namespace utils {
 
@@ -13,12 +20,203 @@ int64_t currentTs();
 
 ThreadPool &globalThreadPool(size_t n_threads = 0);
 
-void writeToFile(const std::string &file, const std::vector<int> &ids);
+// Busy time of the participants of forEachDynamicChunk, for measuring load imbalance. It is
+// collected only while enabled, participant i of every loop adds to entry i.
+void enableWorkStats(bool enable);
+
+bool workStatsEnabled();
+
+void addBusyTime(size_t participant, std::chrono::nanoseconds busy);
+
+// Returns the busy time collected so far and resets it.
+std::vector<std::chrono::nanoseconds> takeWorkStats();
+
+inline size_t dynamicChunkCount(size_t size, size_t chunk_size) {
+  return (size + chunk_size - 1) / chunk_size;
+}
+
+// Splits [0, size) at the first boundary at or after every multiple of chunk_size into
+// dynamicChunkCount(size, chunk_size) chunks and calls f(chunk, begin, end) for the non-empty
+// ones. is_boundary(pos) tells if a chunk may start at pos. A chunk without a boundary in its
+// nominal range is empty, so a long stretch without boundaries is scanned once and goes to the
+// chunk before it.
+//
+// thread_count participants, the calling thread and thread_count - 1 pool tasks, pull chunks
+// from a shared cursor: a slow region of the input keeps one of them busy while the others take
+// the rest, instead of deciding the wall time as one of thread_count equal parts would.
+template <typename IsBoundary, typename F>
+void forEachDynamicChunk(ThreadPool &thread_pool,
+                         size_t size,
+                         size_t chunk_size,
+                         size_t thread_count,
+                         const IsBoundary &is_boundary,
+                         const F &f) {
+  const size_t chunk_count = dynamicChunkCount(size, chunk_size);
+  // The first boundary in [from, limit), limit if there is none.
+  const auto next_boundary = [&is_boundary](size_t from, size_t limit) {
+    while (from < limit && !is_boundary(from)) {
+      ++from;
+    }
+    return from;
+  };
+
+  std::atomic<size_t> cursor{0};
+  const bool collect_stats = workStatsEnabled();
+  const auto participant = [&](size_t index) {
+    std::chrono::steady_clock::duration busy{};
+    for (size_t chunk; (chunk = cursor.fetch_add(1, std::memory_order_relaxed)) < chunk_count;) {
+      const auto start = collect_stats ? std::chrono::steady_clock::now()
+                                       : std::chrono::steady_clock::time_point{};
+      const size_t nominal_end = std::min(size, (chunk + 1) * chunk_size);
+      const size_t begin = chunk == 0 ? 0 : next_boundary(chunk * chunk_size, nominal_end);
+      if (begin < nominal_end) {
+        f(chunk, begin, next_boundary(nominal_end, size));
+      }
+      if (collect_stats) {
+        busy += std::chrono::steady_clock::now() - start;
+      }
+    }
+    if (collect_stats) {
+      addBusyTime(index, std::chrono::duration_cast<std::chrono::nanoseconds>(busy));
+    }
+  };
+
+  if (thread_count <= 1 || chunk_count <= 1) {
+    participant(0);
+    return;
+  }
+  TaskGroup tasks(thread_pool);
+  for (size_t index = 1; index < std::min(thread_count, chunk_count); index++) {
+    tasks.submit([&participant, index] { participant(index); });
+  }
+  participant(0);
+  tasks.wait();
+}
+
+// True if ids of a vocab with vocab_size tokens fit in uint16_t.
+inline bool compactIds(size_t vocab_size) { return vocab_size < word_piece::kUnkId16; }
+
+// Converts an id of the vocab to Id. Only UNK may be negative, it becomes word_piece::kUnkId16.
+template <typename Id>
+Id toId(int id) {
+  if constexpr (std::is_same_v<Id, int>) {
+    return id;
+  } else {
+    return id < 0 ? word_piece::kUnkId16 : static_cast<Id>(id);
+  }
+}
+
+// Header of binary id files, 64 bytes in little-endian byte order. token_count is
+// kUnknownCount if the file was not closed properly or cannot be seeked.
+struct IdFileHeader {
+  static constexpr char kMagic[8] = {'W', 'P', 'I', 'D', 'S', '\0', '\0', '\0'};
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint64_t kUnknownCount = UINT64_MAX;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t id_bytes; // 2 or 4
+  uint64_t vocab_hash;
+  uint64_t token_count;
+  uint64_t reserved[4];
+};
+
+static_assert(sizeof(IdFileHeader) == 64);
+
+// Writes ids in one of word_piece::OutputFormat through a large buffer, flushed with plain
+// write() calls at offsets which are multiples of the buffer size.
+class IdWriter {
+ public:
+  IdWriter(const std::string &file,
+           word_piece::OutputFormat format,
+           uint64_t vocab_hash,
+           size_t vocab_size);
+
+  IdWriter(const IdWriter &) = delete;
+
+  IdWriter &operator=(const IdWriter &) = delete;
+
+  ~IdWriter();
+
+  void write(const int *ids, size_t count);
+
+  // word_piece::kUnkId16 is written as UNK, -1 in text.
+  void write(const uint16_t *ids, size_t count);
+
+  template <typename Id>
+  void write(const std::vector<Id> &ids) {
+    write(ids.data(), ids.size());
+  }
+
+  template <typename Id>
+  void write(const word_piece::BasicChunkedIds<Id> &ids) {
+    for (const std::vector<Id> &chunk : ids.chunks) {
+      write(chunk);
+    }
+  }
+
+  // Flushes the buffer and stores the token count in the header of a binary file.
+  void close();
+
+ private:
+  void flush();
+
+  template <typename Id>
+  void writeIds(const Id *ids, size_t count);
+
+  std::string file_;
+  word_piece::OutputFormat format_;
+  uint32_t id_bytes_;
+  int fd_ = -1;
+  std::unique_ptr<char[]> buffer_;
+  size_t buffered_ = 0;
+  uint64_t token_count_ = 0;
+};
 
-std::vector<uint32_t> parseText(const char *text, size_t size, ThreadPool &thread_pool);
+// ids is anything IdWriter::write takes.
+template <typename Ids>
+void writeToFile(const std::string &file,
+                 const Ids &ids,
+                 word_piece::OutputFormat format = word_piece::OutputFormat::kText,
+                 uint64_t vocab_hash = 0,
+                 size_t vocab_size = 0) {
+  IdWriter writer(file, format, vocab_hash, vocab_size);
+  writer.write(ids);
+  writer.close();
+}
+
+// Reads ids written in any of word_piece::OutputFormat, the format is detected by the magic.
+std::vector<int> readIdsFromFile(const std::string &file);
+
+// Decodes UTF-8 text with the best vector instruction set of the CPU and normalizes it in the
+// same pass. Invalid bytes are dropped, their offsets are appended to invalid_positions if it
+// is not null. source_offsets receives the byte offset of the source of every code point.
+std::vector<uint32_t> parseText(const char *text,
+                                size_t size,
+                                ThreadPool &thread_pool,
+                                std::vector<size_t> *invalid_positions = nullptr,
+                                const word_piece::Normalization &normalization = {},
+                                std::vector<size_t> *source_offsets = nullptr);
+
+// Turns spans in code point indices of the decoded text into byte offsets in text. Spans must
+// be ordered and must not overlap; invalid_positions are the bytes dropped by the decoder.
+void spansToByteOffsets(const char *text,
+                        size_t size,
+                        const std::vector<size_t> &invalid_positions,
+                        word_piece::TokenSpan *spans,
+                        size_t count);
+
+// Same for text decoded with normalization, source_offsets are the byte offsets in text of the
+// code points the decoded ones come from. A token ends after its last source code point.
+void spansToByteOffsets(const char *text,
+                        const std::vector<size_t> &source_offsets,
+                        word_piece::TokenSpan *spans,
+                        size_t count);
 
 struct WordPieceToken {
-  explicit WordPieceToken(const std::string &encoded_word);
+  // Special tokens are not normalized. A token which normalization leaves empty is malformed.
+  explicit WordPieceToken(const std::string &encoded_word,
+                          const word_piece::Normalization &normalization = {});
 
   bool is_prefix;
   bool is_special;
@@ -31,11 +229,15 @@ struct WordPieceVocabulary {
 
   std::vector<WordPieceToken> tokens;
   int unk_token_id = kDefaultUnkTokenId;
+  // The tokens are normalized with it, texts must be too.
+  word_piece::Normalization normalization;
 };
 
-WordPieceVocabulary parseVocab(const std::vector<std::string> &vocab);
+WordPieceVocabulary parseVocab(const std::vector<std::string> &vocab,
+                               const word_piece::Normalization &normalization = {});
 
-WordPieceVocabulary readVocabFromFile(const std::string &file);
+WordPieceVocabulary readVocabFromFile(const std::string &file,
+                                      const word_piece::Normalization &normalization = {});
 
 bool isSuffixVocab(const std::vector<uint32_t> &word);
 
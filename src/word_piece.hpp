@@ -2,37 +2,379 @@
 
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace word_piece {
 
+// Byte range [begin, end) of a token in the UTF-8 input. UNK covers the whole word it replaced.
+struct TokenSpan {
+  size_t begin;
+  size_t end;
+
+  bool operator==(const TokenSpan &other) const {
+    return begin == other.begin && end == other.end;
+  }
+};
+
+// Format of id files. kText is decimal ids separated by spaces. kBinary is utils::IdFileHeader
+// followed by little-endian ids: uint16_t if the vocab has less than 65535 tokens (UNK is
+// written as 0xFFFF), int32_t otherwise.
+enum class OutputFormat {
+  kText,
+  kBinary,
+};
+
+// Text normalization of BERT's BasicTokenizer, done on every code point while the text is
+// decoded. The vocab is normalized the same way when it is loaded, special tokens are kept.
+struct Normalization {
+  // Drops NUL, U+FFFD and control characters except "\t\n\r".
+  bool clean_text = false;
+  // Full Unicode lowercasing of single code points, final sigma is not special.
+  bool lower_case = false;
+  // NFD decomposition without nonspacing marks.
+  bool strip_accents = false;
+
+  // What uncased BERT models expect.
+  static Normalization uncased() { return {true, true, true}; }
+
+  bool enabled() const { return clean_text || lower_case || strip_accents; }
+
+  bool operator==(const Normalization &other) const {
+    return clean_text == other.clean_text && lower_case == other.lower_case
+        && strip_accents == other.strip_accents;
+  }
+};
+
+// Ids of a batch of texts in CSR layout: ids of text i are ids[offsets[i], offsets[i + 1]).
+// spans is parallel to ids when requested, byte offsets are relative to the text.
+struct BatchEncoding {
+  std::vector<int> ids;
+  std::vector<size_t> offsets;
+  std::vector<TokenSpan> spans;
+};
+
+// UNK in uint16_t ids, the same value as in binary id files. uint16_t ids need a vocab with
+// less than kUnkId16 tokens.
+constexpr uint16_t kUnkId16 = 0xFFFF;
+
+// Ids of one text as consecutive chunks in text order, as the threads of an engine produced them.
+// Iterating the chunks or writing them with utils::IdWriter skips the copy into one vector.
+// Id is int or uint16_t.
+template <typename Id>
+struct BasicChunkedIds {
+  std::vector<std::vector<Id>> chunks;
+
+  size_t size() const {
+    size_t total = 0;
+    for (const std::vector<Id> &chunk : chunks) {
+      total += chunk.size();
+    }
+    return total;
+  }
+
+  // Moves the ids into one vector. A single chunk is taken as is, otherwise every chunk is freed
+  // right after it is copied.
+  std::vector<Id> join() && {
+    if (chunks.size() == 1) {
+      return std::move(chunks[0]);
+    }
+    std::vector<Id> joined;
+    joined.reserve(size());
+    for (std::vector<Id> &chunk : chunks) {
+      joined.insert(joined.end(), chunk.begin(), chunk.end());
+      std::vector<Id>().swap(chunk);
+    }
+    chunks.clear();
+    return joined;
+  }
+};
+
+using ChunkedIds = BasicChunkedIds<int>;
+
 namespace linear {
 
+// Keeps the parsed vocabulary between calls. All methods are const and may be called
+// concurrently from many threads.
+class Tokenizer {
+ public:
+  // The vocab is normalized with normalization, texts are normalized while they are decoded.
+  explicit Tokenizer(const std::vector<std::string> &vocab,
+                     const Normalization &normalization = {});
+
+  // A vocab image must have been compiled with the same normalization.
+  explicit Tokenizer(const std::string &vocab_file, const Normalization &normalization = {});
+
+  Tokenizer(Tokenizer &&other) noexcept;
+
+  Tokenizer &operator=(Tokenizer &&other) noexcept;
+
+  ~Tokenizer();
+
+  // If spans is not null, it receives the byte range of every id. With normalization a span
+  // covers the source bytes of the code points the id was normalized from.
+  std::vector<int> encode(const std::string &text, std::vector<TokenSpan> *spans = nullptr) const;
+
+  std::vector<int> encodeFile(const std::string &text_file,
+                              std::vector<TokenSpan> *spans = nullptr) const;
+
+  // 2 if the ids fit in uint16_t, 4 otherwise.
+  size_t idBytes() const;
+
+  // Same ids as encode and encodeFile, left in the chunks the threads wrote. uint16_t ids need
+  // idBytes() == 2, UNK is kUnkId16 then.
+  template <typename Id = int>
+  BasicChunkedIds<Id> encodeChunked(const std::string &text,
+                                    std::vector<TokenSpan> *spans = nullptr) const;
+
+  template <typename Id = int>
+  BasicChunkedIds<Id> encodeFileChunked(const std::string &text_file,
+                                        std::vector<TokenSpan> *spans = nullptr) const;
+
+  void encodeExternal(const std::string &text_file,
+                      const std::string &out_file,
+                      size_t memory_limit,
+                      OutputFormat format = OutputFormat::kText) const;
+
+ private:
+  struct Impl;
+
+  std::unique_ptr<const Impl> impl_;
+};
+
 std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab);
 
 std::vector<int> encode(const std::string &text_file, const std::string &vocab_file);
 
 void encodeExternal(const std::string &text_file,
-                          const std::string &vocab_file,
-                          const std::string &out_file,
-                          size_t memory_limit);
+                    const std::string &vocab_file,
+                    const std::string &out_file,
+                    size_t memory_limit,
+                    OutputFormat format = OutputFormat::kText);
 
 } // namespace linear
 
 namespace fast {
 
+class StreamingEncoder;
+
+// Lookups in the word caches of a tokenizer, summed over all threads.
+struct WordCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+
+// Compiles the vocabulary into lookup tables once. All methods are const and may be called
+// concurrently from many threads.
+class Tokenizer {
+ public:
+  // Entries of the word cache of every thread, 64 bytes each.
+  static constexpr size_t kDefaultWordCacheSize = 4096;
+
+  // The vocab is normalized with normalization, texts are normalized while they are decoded.
+  // Every thread caches ids of up to word_cache_size recent words of at most 8 code points
+  // (a power of two, 0 turns the cache off). A thread keeps the cache of the last tokenizer
+  // which used it.
+  explicit Tokenizer(const std::vector<std::string> &vocab,
+                     const Normalization &normalization = {},
+                     size_t word_cache_size = kDefaultWordCacheSize);
+
+  // A vocab image must have been compiled with the same normalization.
+  explicit Tokenizer(const std::string &vocab_file,
+                     const Normalization &normalization = {},
+                     size_t word_cache_size = kDefaultWordCacheSize);
+
+  Tokenizer(Tokenizer &&other) noexcept;
+
+  Tokenizer &operator=(Tokenizer &&other) noexcept;
+
+  ~Tokenizer();
+
+  // If spans is not null, it receives the byte range of every id. With normalization a span
+  // covers the source bytes of the code points the id was normalized from.
+  std::vector<int> encode(const std::string &text, std::vector<TokenSpan> *spans = nullptr) const;
+
+  std::vector<int> encodeFile(const std::string &text_file,
+                              std::vector<TokenSpan> *spans = nullptr) const;
+
+  // 2 if the ids fit in uint16_t, 4 otherwise.
+  size_t idBytes() const;
+
+  // Same ids as encode and encodeFile, left in the chunks the threads wrote. uint16_t ids need
+  // idBytes() == 2, UNK is kUnkId16 then.
+  template <typename Id = int>
+  BasicChunkedIds<Id> encodeChunked(const std::string &text,
+                                    std::vector<TokenSpan> *spans = nullptr) const;
+
+  template <typename Id = int>
+  BasicChunkedIds<Id> encodeFileChunked(const std::string &text_file,
+                                        std::vector<TokenSpan> *spans = nullptr) const;
+
+  // Encodes every text on its own. Documents are spread over the global thread pool, each
+  // task decodes and encodes a run of documents into its own buffers. with_spans also fills
+  // BatchEncoding::spans.
+  BatchEncoding encodeBatch(const std::vector<std::string_view> &texts,
+                            bool with_spans = false) const;
+
+  // Joins the tokens of ids into UTF-8 text the way BERT does: a space before every word
+  // starting token but the first, "##" tokens are glued to the previous one, UNK is "[UNK]".
+  // Long inputs are decoded on the global thread pool. Throws on ids out of the vocab.
+  std::string decode(const std::vector<int> &ids) const;
+
+  // Decodes ids of every text of an encodeBatch result on its own.
+  std::vector<std::string> decodeBatch(const BatchEncoding &batch) const;
+
+  WordCacheStats wordCacheStats() const;
+
+  void encodeExternal(const std::string &text_file,
+                      const std::string &out_file,
+                      size_t memory_limit,
+                      OutputFormat format = OutputFormat::kText) const;
+
+ private:
+  friend class StreamingEncoder;
+
+  struct Impl;
+
+  std::unique_ptr<const Impl> impl_;
+};
+
+// Encodes a stream which arrives in chunks of any size, e.g. from a pipe or a socket. Partial
+// UTF-8 sequences and the unfinished word are carried to the next chunk, ids of finished words
+// are passed to the callback. Memory is the last chunk, about two longest tokens of code points
+// and the ids of one word, even for a stream without spaces. The ids are the same as encode of
+// the whole stream gives. The tokenizer must outlive the encoder.
+class StreamingEncoder {
+ public:
+  using Callback = std::function<void(const std::vector<int> &ids)>;
+
+  StreamingEncoder(const Tokenizer &tokenizer, Callback callback);
+
+  StreamingEncoder(StreamingEncoder &&other) noexcept;
+
+  StreamingEncoder &operator=(StreamingEncoder &&other) noexcept;
+
+  ~StreamingEncoder();
+
+  void feed(const char *data, size_t size);
+
+  // Encodes the rest of the stream. After that the encoder starts a new stream.
+  void finish();
+
+ private:
+  struct Impl;
+
+  std::unique_ptr<Impl> impl_;
+};
+
 std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab);
 
 std::vector<int> encode(const std::string &text_file, const std::string &vocab_file);
 
-std::vector<std::string> decode(const std::string vocab_file, const std::vector<int>& ids);
+// Tokens of ids one by one, suffix tokens with "##". Ids out of the vocab are skipped.
+std::vector<std::string> decode(const std::string &vocab_file, const std::vector<int> &ids);
 
 void encodeExternal(const std::string &text_file,
-                        const std::string &vocab_file,
-                        const std::string &out_file,
-                        size_t memory_limit);
+                    const std::string &vocab_file,
+                    const std::string &out_file,
+                    size_t memory_limit,
+                    OutputFormat format = OutputFormat::kText);
 
 } // namespace fast
 
+namespace fast_bytes {
+
+// The fast engine over UTF-8 bytes: the text is never widened to code points, so memory is
+// the mapped file plus ids. Gives the same ids as fast without normalization. All methods are
+// const and may be called concurrently from many threads.
+class Tokenizer {
+ public:
+  explicit Tokenizer(const std::vector<std::string> &vocab);
+
+  explicit Tokenizer(const std::string &vocab_file);
+
+  Tokenizer(Tokenizer &&other) noexcept;
+
+  Tokenizer &operator=(Tokenizer &&other) noexcept;
+
+  ~Tokenizer();
+
+  std::vector<int> encode(const std::string &text) const;
+
+  std::vector<int> encodeFile(const std::string &text_file) const;
+
+  void encodeExternal(const std::string &text_file,
+                      const std::string &out_file,
+                      size_t memory_limit,
+                      OutputFormat format = OutputFormat::kText) const;
+
+ private:
+  struct Impl;
+
+  std::unique_ptr<const Impl> impl_;
+};
+
+std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab);
+
+std::vector<int> encode(const std::string &text_file, const std::string &vocab_file);
+
+void encodeExternal(const std::string &text_file,
+                    const std::string &vocab_file,
+                    const std::string &out_file,
+                    size_t memory_limit,
+                    OutputFormat format = OutputFormat::kText);
+
+} // namespace fast_bytes
+
+namespace trie {
+
+// Vocab trie with precomputed failure links: single pass O(n) matching with memory
+// proportional to the vocab. All methods are const and may be called concurrently.
+class Tokenizer {
+ public:
+  // The vocab is normalized with normalization, texts are normalized while they are decoded.
+  explicit Tokenizer(const std::vector<std::string> &vocab,
+                     const Normalization &normalization = {});
+
+  // A vocab image must have been compiled with the same normalization.
+  explicit Tokenizer(const std::string &vocab_file, const Normalization &normalization = {});
+
+  Tokenizer(Tokenizer &&other) noexcept;
+
+  Tokenizer &operator=(Tokenizer &&other) noexcept;
+
+  ~Tokenizer();
+
+  std::vector<int> encode(const std::string &text) const;
+
+  std::vector<int> encodeFile(const std::string &text_file) const;
+
+  void encodeExternal(const std::string &text_file,
+                      const std::string &out_file,
+                      size_t memory_limit,
+                      OutputFormat format = OutputFormat::kText) const;
+
+ private:
+  struct Impl;
+
+  std::unique_ptr<const Impl> impl_;
+};
+
+std::vector<int> encode(const std::string &text, const std::vector<std::string> &vocab);
+
+std::vector<int> encode(const std::string &text_file, const std::string &vocab_file);
+
+void encodeExternal(const std::string &text_file,
+                    const std::string &vocab_file,
+                    const std::string &out_file,
+                    size_t memory_limit,
+                    OutputFormat format = OutputFormat::kText);
+
+} // namespace trie
+
 } // namespace word_piece
@@ -0,0 +1,280 @@
+// Copyright (c) 2023 Gleb Koveshnikov
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "src/compiled_vocab.hpp"
+#include "src/third_party/utf8.hpp"
+#include "src/utf8_decode.hpp"
+#include "src/utils.hpp"
+#include "src/word_piece.hpp"
+
+struct Probe {
+  bool is_prefix;
+  const uint32_t *begin;
+  size_t length;
+};
+
+template <typename F>
+static double nanosPerCall(size_t calls, F &&f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const auto finish = std::chrono::steady_clock::now();
+  return static_cast<double>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count())
+       / static_cast<double>(calls);
+}
+
+// Synthetic words glued from random prefix and suffix tokens, used if no text is given.
+static std::string synthesizeText(const utils::WordPieceVocabulary &vocab, size_t words) {
+  std::vector<const utils::WordPieceToken *> prefixes;
+  std::vector<const utils::WordPieceToken *> suffixes;
+  for (const auto &token : vocab.tokens) {
+    if (!token.is_special && !token.is_malformed) {
+      (token.is_prefix ? prefixes : suffixes).push_back(&token);
+    }
+  }
+  std::mt19937 rnd(17);
+  std::string text;
+  for (size_t i = 0; i < words && !prefixes.empty(); i++) {
+    text += vkcom::encode_utf8(prefixes[rnd() % prefixes.size()]->word);
+    while (!suffixes.empty() && rnd() % 3 == 0) {
+      text += vkcom::encode_utf8(suffixes[rnd() % suffixes.size()]->word);
+    }
+    text += ' ';
+  }
+  return text;
+}
+
+// Same probe sequence as the fast engine: from the longest window down to the first hit.
+static std::vector<Probe> collectProbes(const std::vector<uint32_t> &text,
+                                        const utils::CompiledVocab &vocab) {
+  std::vector<Probe> probes;
+  size_t begin = 0;
+  bool is_prefix = true;
+  while (begin < text.size()) {
+    if (vkcom::is_spacing_char(text[begin])) {
+      is_prefix = true;
+      ++begin;
+      continue;
+    }
+    size_t word_len = 0;
+    while (begin + word_len < text.size() && word_len < vocab.maxTokenLength()
+           && !vkcom::is_spacing_char(text[begin + word_len])) {
+      ++word_len;
+    }
+    size_t match_len = word_len;
+    for (; match_len > 0; --match_len) {
+      const uint32_t *probe_begin = text.data() + begin;
+      probes.push_back(Probe{is_prefix, probe_begin, match_len});
+      const uint64_t hash = utils::CompiledVocab::hashWord(probe_begin, match_len);
+      if (vocab.find(is_prefix, hash, probe_begin, match_len) != -1) {
+        break;
+      }
+    }
+    begin += std::max<size_t>(match_len, 1);
+    is_prefix = match_len == 0;
+  }
+  return probes;
+}
+
+static void benchLookup(const std::string &vocab_file, const std::string &text_file) {
+  using WordMap = std::unordered_map<vkcom::VectorSegment, int>;
+
+  const utils::WordPieceVocabulary vocab_utf8 = utils::readVocabFromFile(vocab_file);
+  const utils::CompiledVocab vocab(vocab_utf8);
+  WordMap prefix_to_id;
+  WordMap suffix_to_id;
+  for (size_t i = 0; i < vocab_utf8.tokens.size(); i++) {
+    const auto &token = vocab_utf8.tokens[i];
+    if (!token.is_special && !token.is_malformed) {
+      WordMap &word_to_id = token.is_prefix ? prefix_to_id : suffix_to_id;
+      word_to_id[vkcom::VectorSegmentBuilder(token.word).finish()] = static_cast<int>(i);
+    }
+  }
+
+  std::vector<uint32_t> text;
+  if (text_file.empty()) {
+    text = vkcom::decode_utf8(synthesizeText(vocab_utf8, 1'000'000));
+  } else {
+    boost::iostreams::mapped_file mmap(text_file, boost::iostreams::mapped_file::readonly);
+    text = utils::parseText(mmap.const_data(), mmap.size(), utils::globalThreadPool());
+  }
+  const std::vector<Probe> probes = collectProbes(text, vocab);
+
+  std::vector<vkcom::VectorSegment> segments;
+  std::vector<uint64_t> hashes;
+  segments.reserve(probes.size());
+  hashes.reserve(probes.size());
+  for (const Probe &probe : probes) {
+    segments.push_back(
+     vkcom::VectorSegmentBuilder(probe.begin, probe.begin + probe.length).finish());
+    hashes.push_back(utils::CompiledVocab::hashWord(probe.begin, probe.length));
+  }
+
+  size_t map_hits = 0;
+  const double map_ns = nanosPerCall(probes.size(), [&] {
+    for (size_t i = 0; i < probes.size(); i++) {
+      const WordMap &word_to_id = probes[i].is_prefix ? prefix_to_id : suffix_to_id;
+      map_hits += word_to_id.find(segments[i]) != word_to_id.end();
+    }
+  });
+  size_t table_hits = 0;
+  const double table_ns = nanosPerCall(probes.size(), [&] {
+    for (size_t i = 0; i < probes.size(); i++) {
+      const Probe &probe = probes[i];
+      table_hits += vocab.find(probe.is_prefix, hashes[i], probe.begin, probe.length) != -1;
+    }
+  });
+
+  if (map_hits != table_hits) {
+    throw std::runtime_error("Lookup results differ");
+  }
+  std::cout << "probes " << probes.size() << ", hits " << table_hits << std::endl;
+  std::cout << "std::unordered_map " << map_ns << " ns/probe" << std::endl;
+  std::cout << "CompiledVocab      " << table_ns << " ns/probe" << std::endl;
+}
+
+static void benchDecode(const std::string &text_file) {
+  boost::iostreams::mapped_file_source mmap(text_file);
+  const char *begin = mmap.data();
+  const char *end = begin + mmap.size();
+  std::vector<uint32_t> out(mmap.size());
+  size_t expected = 0;
+  // Warms up the page cache and the output buffer.
+  utils::decodeUtf8(utils::Utf8Isa::kScalar, begin, end, out.data());
+  for (int isa = 0; isa <= static_cast<int>(utils::bestUtf8Isa()); isa++) {
+    size_t decoded = 0;
+    const double ns
+     = nanosPerCall(mmap.size(), [&] {
+         decoded = utils::decodeUtf8(static_cast<utils::Utf8Isa>(isa), begin, end, out.data());
+       });
+    if (isa == 0) {
+      expected = decoded;
+    } else if (decoded != expected) {
+      throw std::runtime_error("Decoded lengths differ");
+    }
+    std::cout << utils::utf8IsaName(static_cast<utils::Utf8Isa>(isa)) << ' ' << ns << " ns/byte"
+              << std::endl;
+  }
+}
+
+// Short queries, one encode() call each against one encodeBatch() call.
+static void benchBatch(const std::string &vocab_file, const std::string &text_file) {
+  static constexpr size_t kQueries = 4096;
+  static constexpr size_t kQueryBytes = 64;
+
+  const word_piece::fast::Tokenizer tokenizer(vocab_file);
+  std::string text;
+  if (text_file.empty()) {
+    text = synthesizeText(utils::readVocabFromFile(vocab_file), kQueries * kQueryBytes / 4);
+  } else {
+    boost::iostreams::mapped_file_source mmap(text_file);
+    text.assign(mmap.data(), std::min(mmap.size(), kQueries * kQueryBytes));
+  }
+  std::vector<std::string> queries;
+  for (size_t begin = 0; begin < text.size() && queries.size() < kQueries; begin += kQueryBytes) {
+    queries.push_back(text.substr(begin, kQueryBytes));
+  }
+  const std::vector<std::string_view> texts(queries.begin(), queries.end());
+
+  size_t single_ids = 0;
+  const double single_ns = nanosPerCall(queries.size(), [&] {
+    for (const std::string &query : queries) {
+      single_ids += tokenizer.encode(query).size();
+    }
+  });
+  size_t batch_ids = 0;
+  const double batch_ns = nanosPerCall(queries.size(), [&] {
+    batch_ids = tokenizer.encodeBatch(texts).ids.size();
+  });
+
+  if (single_ids != batch_ids) {
+    throw std::runtime_error("Batch results differ");
+  }
+  std::cout << "queries " << queries.size() << ", ids " << batch_ids << std::endl;
+  std::cout << "encode      " << single_ns << " ns/query" << std::endl;
+  std::cout << "encodeBatch " << batch_ns << " ns/query" << std::endl;
+}
+
+// Many threads encoding small batches at once. Every encodeBatch() splits its batch into pool
+// tasks and waits for them, so callers share the pool and must not wait for each other's work.
+static void benchConcurrent(const std::string &vocab_file, const std::string &text_file) {
+  static constexpr size_t kCalls = 2048;
+  static constexpr size_t kQueriesPerCall = 64;
+  static constexpr size_t kQueryBytes = 1024;
+
+  const word_piece::fast::Tokenizer tokenizer(vocab_file);
+  std::string text;
+  if (text_file.empty()) {
+    text = synthesizeText(utils::readVocabFromFile(vocab_file), kQueriesPerCall * kQueryBytes);
+  } else {
+    boost::iostreams::mapped_file_source mmap(text_file);
+    text.assign(mmap.data(), std::min(mmap.size(), 4 * kQueriesPerCall * kQueryBytes));
+  }
+  std::vector<std::string> queries;
+  for (size_t begin = 0; begin < text.size(); begin += kQueryBytes) {
+    queries.push_back(text.substr(begin, kQueryBytes));
+  }
+  const std::vector<std::string_view> texts(
+   queries.begin(), queries.begin() + std::min(queries.size(), kQueriesPerCall));
+  const size_t expected_ids = tokenizer.encodeBatch(texts).ids.size();
+
+  const size_t pool_threads = utils::globalThreadPool().maxThreads();
+  size_t previous_callers = 0;
+  for (size_t callers : {size_t{1}, pool_threads, 4 * pool_threads}) {
+    if (callers == previous_callers) {
+      continue;
+    }
+    previous_callers = callers;
+    std::vector<size_t> wrong(callers);
+    const double ns = nanosPerCall(kCalls, [&] {
+      std::vector<std::thread> threads;
+      for (size_t caller = 0; caller < callers; caller++) {
+        threads.emplace_back([&, caller] {
+          for (size_t call = caller; call < kCalls; call += callers) {
+            wrong[caller] += tokenizer.encodeBatch(texts).ids.size() != expected_ids;
+          }
+        });
+      }
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+    });
+    for (size_t caller_wrong : wrong) {
+      if (caller_wrong != 0) {
+        throw std::runtime_error("Concurrent results differ");
+      }
+    }
+    std::cout << "callers " << callers << ", pool threads " << pool_threads << ": " << ns
+              << " ns/call of " << texts.size() << " queries" << std::endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    throw std::runtime_error(
+     "Usage: ./bench lookup <vocab_file> [text_file] | ./bench batch <vocab_file> [text_file] "
+     "| ./bench concurrent <vocab_file> [text_file] | ./bench decode <text_file>.");
+  }
+
+  const std::string mode = argv[1];
+  if (mode == "lookup") {
+    benchLookup(argv[2], argc >= 4 ? argv[3] : "");
+  } else if (mode == "batch") {
+    benchBatch(argv[2], argc >= 4 ? argv[3] : "");
+  } else if (mode == "concurrent") {
+    benchConcurrent(argv[2], argc >= 4 ? argv[3] : "");
+  } else if (mode == "decode") {
+    benchDecode(argv[2]);
+  } else {
+    throw std::runtime_error("Unknown mode");
+  }
+}
@@ -1,5 +1,9 @@
 // Copyright (c) 2023 Gleb Koveshnikov
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <exception>
 #include <fstream>
 #include <iostream>
@@ -7,23 +11,60 @@
 #include <string>
 #include <vector>
 
+#include "src/compiled_vocab.hpp"
 #include "src/utils.hpp"
 #include "src/word_piece.hpp"
 
 int main(int argc, char *argv[]) {
-  if (argc < 4 || argc > 7) {
+  // --binary, --stats and --uncased may go anywhere, the rest is positional.
+  std::vector<std::string> args;
+  auto format = word_piece::OutputFormat::kText;
+  bool print_stats = false;
+  word_piece::Normalization normalization;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--binary") {
+      format = word_piece::OutputFormat::kBinary;
+    } else if (std::string(argv[i]) == "--stats") {
+      print_stats = true;
+    } else if (std::string(argv[i]) == "--uncased") {
+      normalization = word_piece::Normalization::uncased();
+    } else {
+      args.emplace_back(argv[i]);
+    }
+  }
+
+  if (args.size() < 3 || args.size() > 6) {
     throw std::runtime_error("Usage: ./runner <mode> <text_file> <vocab_file> [n_threads] "
-                             "[out_file] [memory_limit_mb]. "
-                             "Modes: fast, linear, fast-external, linear-external.");
+                             "[out_file] [memory_limit_mb] [--binary] [--stats] [--uncased]. "
+                             "Modes: fast, fast-bytes, linear, trie, fast-external, "
+                             "fast-bytes-external, "
+                             "linear-external, trie-external, "
+                             "fast-stdin (text_file is ignored, the text is read from stdin). "
+                             "decode (text_file holds ids, out_file gets the text). "
+                             "--binary writes ids in the binary format instead of text. "
+                             "--stats prints busy time of every thread of chunked loops "
+                             "and word cache hits of fast modes. "
+                             "--uncased lowercases and strips accents of the text and the vocab "
+                             "(not in fast-bytes modes). "
+                             "Compile vocab image: "
+                             "./runner compile-vocab <vocab_file> <out_file>.");
+  }
+
+  const std::string mode = args[0];
+  if (mode == "compile-vocab") {
+    const utils::CompiledVocab vocab(utils::readVocabFromFile(args[1], normalization));
+    vocab.saveImage(args[2]);
+    std::cout << "Compiled " << vocab.size() << " tokens" << std::endl;
+    return 0;
   }
 
-  const std::string mode = argv[1];
-  const std::string text_file = argv[2];
-  const std::string vocab_file = argv[3];
-  const size_t n_threads = argc == 5 ? std::stoull(argv[4]) : 0;
-  const std::optional<std::string> out_file = argc >= 6 ? std::optional(argv[5]) : std::nullopt;
+  const std::string text_file = args[1];
+  const std::string vocab_file = args[2];
+  const size_t n_threads = args.size() >= 4 ? std::stoull(args[3]) : 0;
+  const std::optional<std::string> out_file
+   = args.size() >= 5 ? std::optional(args[4]) : std::nullopt;
   std::optional<size_t> memory_limit
-   = argc >= 7 ? std::optional(std::stoull(argv[6])) : std::nullopt;
+   = args.size() >= 6 ? std::optional(std::stoull(args[5])) : std::nullopt;
 
   if (memory_limit.has_value()) {
     if (*memory_limit < 50) {
@@ -32,34 +73,144 @@ int main(int argc, char *argv[]) {
     *memory_limit *= 1'000'000;
   }
 
+  // Takes a vector or word_piece::BasicChunkedIds of int or uint16_t.
+  const auto write_ids = [&](const auto &ids) {
+    if (!out_file) {
+      return;
+    }
+    if (format == word_piece::OutputFormat::kBinary) {
+      const utils::CompiledVocab vocab = utils::CompiledVocab::fromFile(vocab_file, normalization);
+      utils::writeToFile(*out_file, ids, format, vocab.contentHash(), vocab.size());
+    } else {
+      utils::writeToFile(*out_file, ids);
+    }
+  };
+
+  // Keeps ids in uint16_t if the vocab allows.
+  const auto encode_compact = [&](const auto &tokenizer) {
+    if (tokenizer.idBytes() == sizeof(uint16_t)) {
+      const auto ids = tokenizer.template encodeFileChunked<uint16_t>(text_file);
+      std::cout << "Total ids " << ids.size() << std::endl;
+      write_ids(ids);
+    } else {
+      const auto ids = tokenizer.encodeFileChunked(text_file);
+      std::cout << "Total ids " << ids.size() << std::endl;
+      write_ids(ids);
+    }
+  };
+
   [[maybe_unused]] auto &thread_pool = utils::globalThreadPool(n_threads);
+  utils::enableWorkStats(print_stats);
+
+  if (normalization.enabled() && mode.rfind("fast-bytes", 0) == 0) {
+    throw std::runtime_error("fast-bytes does not normalize text");
+  }
+
+  const auto print_word_cache = [&](const word_piece::fast::Tokenizer &tokenizer) {
+    if (print_stats) {
+      const word_piece::fast::WordCacheStats stats = tokenizer.wordCacheStats();
+      std::cout << "word cache hits " << stats.hits << " misses " << stats.misses << std::endl;
+    }
+  };
 
   if (mode == "fast") {
-    std::vector<int> ids = word_piece::fast::encode(text_file, vocab_file);
-    std::cout << "Total ids " << ids.size() << std::endl;
+    const word_piece::fast::Tokenizer tokenizer(vocab_file, normalization);
+    encode_compact(tokenizer);
+    print_word_cache(tokenizer);
+  } else if (mode == "fast-stdin") {
+    static constexpr size_t kChunkSize = 1 << 20;
+    const word_piece::fast::Tokenizer tokenizer(vocab_file, normalization);
+    std::optional<utils::IdWriter> writer;
     if (out_file) {
-      utils::writeToFile(*out_file, ids);
+      const utils::CompiledVocab vocab = utils::CompiledVocab::fromFile(vocab_file, normalization);
+      writer.emplace(*out_file, format, vocab.contentHash(), vocab.size());
+    }
+    size_t total_ids = 0;
+    word_piece::fast::StreamingEncoder encoder(tokenizer, [&](const std::vector<int> &ids) {
+      total_ids += ids.size();
+      if (writer) {
+        writer->write(ids);
+      }
+    });
+    std::vector<char> chunk(kChunkSize);
+    size_t read;
+    while ((read = std::fread(chunk.data(), 1, chunk.size(), stdin)) > 0) {
+      encoder.feed(chunk.data(), read);
     }
+    encoder.finish();
+    if (writer) {
+      writer->close();
+    }
+    std::cout << "Total ids " << total_ids << std::endl;
+    print_word_cache(tokenizer);
+  } else if (mode == "fast-bytes") {
+    std::vector<int> ids = word_piece::fast_bytes::encode(text_file, vocab_file);
+    std::cout << "Total ids " << ids.size() << std::endl;
+    write_ids(ids);
   } else if (mode == "linear") {
-    std::vector<int> ids = word_piece::linear::encode(text_file, vocab_file);
+    encode_compact(word_piece::linear::Tokenizer(vocab_file, normalization));
+  } else if (mode == "trie") {
+    std::vector<int> ids
+     = word_piece::trie::Tokenizer(vocab_file, normalization).encodeFile(text_file);
     std::cout << "Total ids " << ids.size() << std::endl;
-    if (out_file) {
-      utils::writeToFile(*out_file, ids);
-    }
+    write_ids(ids);
   } else if (mode == "fast-external") {
     if (!memory_limit.has_value()) {
       throw std::runtime_error("For external mode provide out_file and memory_limit");
     }
-    word_piece::fast::encodeExternal(text_file, vocab_file, out_file.value(), memory_limit.value());
+    const word_piece::fast::Tokenizer tokenizer(vocab_file, normalization);
+    tokenizer.encodeExternal(text_file, out_file.value(), memory_limit.value(), format);
+    print_word_cache(tokenizer);
+  } else if (mode == "fast-bytes-external") {
+    if (!memory_limit.has_value()) {
+      throw std::runtime_error("For external mode provide out_file and memory_limit");
+    }
+    word_piece::fast_bytes::encodeExternal(text_file,
+                                           vocab_file,
+                                           out_file.value(),
+                                           memory_limit.value(),
+                                           format);
   } else if (mode == "linear-external") {
     if (!memory_limit.has_value()) {
       throw std::runtime_error("For external mode provide out_file and memory_limit");
     }
-    word_piece::linear::encodeExternal(text_file,
-                                       vocab_file,
-                                       out_file.value(),
-                                       memory_limit.value());
+    word_piece::linear::Tokenizer(vocab_file, normalization)
+     .encodeExternal(text_file, out_file.value(), memory_limit.value(), format);
+  } else if (mode == "trie-external") {
+    if (!memory_limit.has_value()) {
+      throw std::runtime_error("For external mode provide out_file and memory_limit");
+    }
+    word_piece::trie::Tokenizer(vocab_file, normalization)
+     .encodeExternal(text_file, out_file.value(), memory_limit.value(), format);
+  } else if (mode == "decode") {
+    // text_file holds ids here, the decoded text goes to out_file.
+    const word_piece::fast::Tokenizer tokenizer(vocab_file, normalization);
+    const std::string text = tokenizer.decode(utils::readIdsFromFile(text_file));
+    std::cout << "Total bytes " << text.size() << std::endl;
+    if (out_file) {
+      std::ofstream(*out_file, std::ios::binary)
+       .write(text.data(), static_cast<std::streamsize>(text.size()));
+    }
   } else {
     throw std::runtime_error("Unknown mode");
   }
+
+  if (print_stats) {
+    // Threads which are busy for much less than the longest one waited for a straggler.
+    const std::vector<std::chrono::nanoseconds> busy = utils::takeWorkStats();
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds longest{0};
+    for (size_t thread = 0; thread < busy.size(); thread++) {
+      std::cout << "thread " << thread << " busy " << busy[thread].count() / 1'000'000 << " ms"
+                << std::endl;
+      total += busy[thread];
+      longest = std::max(longest, busy[thread]);
+    }
+    if (total.count() > 0) {
+      std::cout << "imbalance (longest / mean busy time) "
+                << static_cast<double>(longest.count() * static_cast<int64_t>(busy.size()))
+                    / static_cast<double>(total.count())
+                << std::endl;
+    }
+  }
 }
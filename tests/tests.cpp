@@ -1,18 +1,82 @@
 // Copyright (c) 2023 Gleb Koveshnikov
 
 #include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <new>
 #include <random>
 #include <set>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
+#include "src/compiled_vocab.hpp"
+#include "src/third_party/thread_pool.hpp"
+#include "src/third_party/utf8.hpp"
+#include "src/utf8_decode.hpp"
 #include "src/utils.hpp"
 #include "src/word_piece.hpp"
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+
+// Heap accounting for the memory tests: every operator new of the binary is counted, block sizes
+// are taken back from malloc_usable_size.
+static std::atomic<size_t> heap_live_bytes{0};
+static std::atomic<size_t> heap_peak_bytes{0};
+
+static void *countAllocation(void *ptr) {
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  const size_t live = heap_live_bytes += malloc_usable_size(ptr);
+  size_t peak = heap_peak_bytes.load();
+  while (live > peak && !heap_peak_bytes.compare_exchange_weak(peak, live)) {
+  }
+  return ptr;
+}
+
+static void countDeallocation(void *ptr) noexcept {
+  if (ptr != nullptr) {
+    heap_live_bytes -= malloc_usable_size(ptr);
+    std::free(ptr);
+  }
+}
+
+void *operator new(size_t size) { return countAllocation(std::malloc(size > 0 ? size : 1)); }
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, std::align_val_t align) {
+  const auto alignment = static_cast<size_t>(align);
+  return countAllocation(
+   std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment));
+}
+void *operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return operator new(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return operator new(size, std::nothrow);
+}
+void operator delete(void *ptr) noexcept { countDeallocation(ptr); }
+void operator delete[](void *ptr) noexcept { countDeallocation(ptr); }
+void operator delete(void *ptr, size_t) noexcept { countDeallocation(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { countDeallocation(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { countDeallocation(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { countDeallocation(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { countDeallocation(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { countDeallocation(ptr); }
+#endif
+
 static constexpr int kWordPieceVocabSize = 30'000;
 static constexpr int kUnkTokenId = utils::WordPieceVocabulary::kDefaultUnkTokenId;
 
@@ -85,6 +149,10 @@ void check(const std::string &s, std::vector<std::string> vocab, const std::vect
   assertEq(linear, expected, s, vocab);
   std::vector<int> fast = word_piece::fast::encode(s, vocab);
   assertEq(fast, expected, s, vocab);
+  std::vector<int> fast_bytes = word_piece::fast_bytes::encode(s, vocab);
+  assertEq(fast_bytes, expected, s, vocab);
+  std::vector<int> trie = word_piece::trie::encode(s, vocab);
+  assertEq(trie, expected, s, vocab);
 }
 
 void check(const std::string &s, std::vector<std::string> vocab) {
@@ -94,6 +162,10 @@ void check(const std::string &s, std::vector<std::string> vocab) {
   std::vector<int> linear = word_piece::linear::encode(s, vocab);
   std::vector<int> fast = word_piece::fast::encode(s, vocab);
   assertEq(linear, fast, s, vocab);
+  std::vector<int> fast_bytes = word_piece::fast_bytes::encode(s, vocab);
+  assertEq(fast_bytes, fast, s, vocab);
+  std::vector<int> trie = word_piece::trie::encode(s, vocab);
+  assertEq(trie, fast, s, vocab);
 }
 
 std::string randomString(std::mt19937 &rnd, size_t string_length) {
@@ -205,6 +277,64 @@ void testMaxMatch() {
          "##z"});
 }
 
+// The fast engine probes only lengths of tokens with the same first letter.
+void testFirstLengths() {
+  const std::string long_word(70, 'b');
+  check("abbb abbbbbb cbb " + long_word + " " + long_word.substr(0, 66),
+        {"a", "abbbbbb", "##bb", "##b", "c", long_word, long_word.substr(0, 65),
+         "##b" + long_word});
+  check("xy ay ya",
+        {"a", "y", "##y", "abcdefghij"},
+        std::vector<int>({kUnkTokenId, 0, 2, kUnkTokenId}));
+  // CJK characters next to letters, with and without tokens of their own.
+  check("中a 中bc a中 bc中bcd", {"a", "bc", "##bcd", "中", "##a"});
+  check("a中bc 文中 bc文", {"a", "bc", "中", "##bc", "文"});
+  // UNK of a CJK character without tokens still covers the letters which follow it in the
+  // window of the longest token, as before the pruning. Linear splits words at CJK characters
+  // there, so only the engines with this window are compared.
+  for (const auto &[text, expected] : std::vector<std::pair<std::string, std::vector<int>>>{
+        {"中bc", {kUnkTokenId}}, {"中a x", {kUnkTokenId, kUnkTokenId}}}) {
+    const std::vector<std::string> vocab = {"a", "bc"};
+    assertEq(word_piece::fast::encode(text, vocab), expected, text, vocab);
+    assertEq(word_piece::fast_bytes::encode(text, vocab), expected, text, vocab);
+    assertEq(word_piece::trie::encode(text, vocab), expected, text, vocab);
+  }
+
+  const utils::CompiledVocab vocab(utils::parseVocab({"a", "abbbbbb", "##bb", long_word}));
+  const utils::CompiledVocab::FirstLengths &a = vocab.firstLengths(true, 'a');
+  const utils::CompiledVocab::FirstLengths &b = vocab.firstLengths(true, 'b');
+  ++totalChecks();
+  if (a.max_length != 7 || !a.has(1) || a.has(2) || !a.has(7) || b.max_length != 70 || !b.has(64)
+      || !b.has(70) || b.has(63) || vocab.firstLengths(false, 'b').max_length != 2
+      || vocab.firstLengths(false, 'a').max_length != 0
+      || vocab.firstLengths(true, 'c').max_length != 0
+      || vocab.firstLengths(true, 0xFFFFFFFF).max_length != 0) {
+    throw std::runtime_error("Lengths of tokens by the first letter are wrong");
+  }
+}
+
+// Tokens are merged into the suffix array of the text, these are the orders which need care.
+void testLinearMerge() {
+  // The text ends inside a token, at its end, or shares a prefix with several of them.
+  check("ab", {"abc", "a", "##b"}, std::vector<int>({1, 2}));
+  check("abc", {"abc", "a", "##b"}, std::vector<int>({0}));
+  check("abc abcab", {"abc", "ab", "##cab", "##ca", "##c"}, std::vector<int>({0, kUnkTokenId}));
+  check("aaaa aaa", {"aaa", "aa", "a", "##a", "##aa"}, std::vector<int>({0, 3, 0}));
+  // Symbols which used to separate the vocab words.
+  check(std::string("a\x01b") + '\0' + "b", {"a", "##\x01", "##b", "\x01b"});
+
+  // One tokenizer, many texts: the vocab side is built once.
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 2'000);
+  const std::vector<std::string> vocab = randomSplit(sample, rnd, 200);
+  const word_piece::linear::Tokenizer linear_tokenizer(vocab);
+  const word_piece::fast::Tokenizer fast_tokenizer(vocab);
+  for (size_t length = 1; length < 200; length += 7) {
+    const std::string text = sample.substr(rnd() % (sample.size() - length), length);
+    assertEq(linear_tokenizer.encode(text), fast_tokenizer.encode(text), text, vocab);
+  }
+}
+
 void testUtf8() {
   check("привет мир", {"привет", "мир"}, std::vector<int>({0, 1}));
   check("привет мир", {"при", "##вет", "мир"}, std::vector<int>({0, 1, 2}));
@@ -216,6 +346,922 @@ void testUtf8() {
         std::vector<int>({0, 4, 3, 6, 2, 1, 5}));
 }
 
+void testCharClasses() {
+  const auto expect = [](uint32_t ch, uint8_t char_class) {
+    ++totalChecks();
+    if (vkcom::char_class(ch) != char_class) {
+      throw std::runtime_error("Wrong class of code point " + std::to_string(ch));
+    }
+  };
+  for (uint32_t ch : {0x20u, 0x09u, 0x0au, 0x0bu, 0x0du, 0x85u, 0xa0u, 0x2000u, 0x2028u, 0x3000u,
+                      vkcom::SPACE_TOKEN}) {
+    expect(ch, vkcom::SPACE_CLASS);
+  }
+  // ASCII symbols like BERT, then Unicode P* categories: ¡ « · ¿ ‐ ‹ 、 。 ！
+  for (uint32_t ch : {0x21u, 0x24u, 0x2bu, 0x40u, 0x60u, 0x7eu, 0xa1u, 0xabu, 0xb7u, 0xbfu,
+                      0x2010u, 0x2039u, 0x3001u, 0x3002u, 0xff01u}) {
+    expect(ch, vkcom::PUNCTUATION_CLASS);
+  }
+  for (uint32_t ch : {0x4e00u, 0x9fffu, 0x3400u, 0xf900u, 0x20000u, 0x2fa1fu}) {
+    expect(ch, vkcom::CHINESE_CLASS);
+  }
+  for (uint32_t ch : {0x00u, 0x61u, 0x44fu, 0xe9u, 0x202au, 0x3041u, 0x10ffffu,
+                      vkcom::INVALID_UNICODE, 0xffffffffu}) {
+    expect(ch, 0);
+  }
+
+  check("¿qué? 中文", {"qué", "¿", "?", "中", "文"}, std::vector<int>({1, 0, 2, 3, 4}));
+  check("a\u3000b", {"a", "b"}, std::vector<int>({0, 1}));
+}
+
+// Every span is inside the text, spans go in order, and a non-UNK span holds the token itself.
+void verifySpans(const std::string &text,
+                 const std::vector<std::string> &vocab,
+                 const std::vector<int> &ids,
+                 const std::vector<word_piece::TokenSpan> &spans) {
+  ++totalChecks();
+  if (ids.size() != spans.size()) {
+    throw std::runtime_error("Spans do not match ids");
+  }
+  size_t previous_end = 0;
+  for (size_t i = 0; i < ids.size(); i++) {
+    const word_piece::TokenSpan span = spans[i];
+    if (span.begin < previous_end || span.begin >= span.end || span.end > text.size()) {
+      throw std::runtime_error("Span is out of order in \"" + text + "\"");
+    }
+    previous_end = span.end;
+    if (ids[i] == kUnkTokenId || vocab[static_cast<size_t>(ids[i])] == "[UNK]") {
+      continue;
+    }
+    std::string token = vocab[static_cast<size_t>(ids[i])];
+    if (token.size() > 2 && token.compare(0, 2, "##") == 0) {
+      token = token.substr(2);
+    }
+    if (vkcom::decode_utf8(text.substr(span.begin, span.end - span.begin))
+        != vkcom::decode_utf8(token)) {
+      throw std::runtime_error("Span does not hold token \"" + token + "\"");
+    }
+  }
+}
+
+void checkSpans(const std::string &text,
+                const std::vector<std::string> &vocab,
+                const std::vector<word_piece::TokenSpan> &expected) {
+  std::vector<word_piece::TokenSpan> fast_spans;
+  const std::vector<int> fast_ids = word_piece::fast::Tokenizer(vocab).encode(text, &fast_spans);
+  std::vector<word_piece::TokenSpan> linear_spans;
+  const std::vector<int> linear_ids
+   = word_piece::linear::Tokenizer(vocab).encode(text, &linear_spans);
+  assertEq(linear_ids, fast_ids, text, vocab);
+  verifySpans(text, vocab, fast_ids, fast_spans);
+  ++totalChecks();
+  if (fast_spans != expected || linear_spans != expected) {
+    throw std::runtime_error("Unexpected spans in \"" + text + "\"");
+  }
+}
+
+// Invalid and truncated UTF-8, CJK, punctuation and non-ASCII spaces between words: the
+// byte-level engine must read the same code points as parseText.
+void testMixedBytes() {
+  static const std::vector<std::string> kPieces = {
+   "a", "b", "ab", "пр", "中", "文", ",", "-", " ", "  ", "\t", "\n", "\xe2\x96\x81",
+   "\xff", "\x80", "\xe4\xb8", "\xf0\x9f", "\xc0\xaf", "\xed\xa0\x80"};
+  static const std::vector<std::string> kVocab = {
+   "b", "ab", "##a", "##b", "##ab", "пр", "##пр", "##aпр", "中", "文", "##文", ",", "-",
+   "[UNK]"};
+  std::mt19937 rnd(17);
+  for (size_t iteration = 0; iteration < 2'000; iteration++) {
+    std::string sample;
+    const size_t pieces = rnd() % 40;
+    for (size_t i = 0; i < pieces; i++) {
+      sample += kPieces[rnd() % kPieces.size()];
+    }
+    std::vector<std::string> vocab = {"a"};
+    for (const std::string &word : kVocab) {
+      if (rnd() % 4 != 0) {
+        vocab.push_back(word);
+      }
+    }
+    std::vector<word_piece::TokenSpan> spans;
+    const std::vector<int> fast = word_piece::fast::Tokenizer(vocab).encode(sample, &spans);
+    assertEq(word_piece::fast_bytes::encode(sample, vocab), fast, sample, vocab);
+    verifySpans(sample, vocab, fast, spans);
+  }
+}
+
+void testTokenSpans() {
+  checkSpans("   aaaa  ", {"aa", "##aa"}, {{3, 5}, {5, 7}});
+  checkSpans("aaaa", {"aa", "a", "##aaa"}, {{0, 4}});
+  checkSpans("abc a abc abd", {"a", "abd"}, {{0, 3}, {4, 5}, {6, 9}, {10, 13}});
+  checkSpans("self, made", {"self", "made", ",", "##,", "##made"}, {{0, 4}, {4, 5}, {6, 10}});
+  checkSpans("привет мир", {"при", "##вет", "мир"}, {{0, 6}, {6, 12}, {13, 19}});
+  checkSpans("¿qué? 中文",
+             {"qué", "¿", "?", "中", "文"},
+             {{0, 2}, {2, 6}, {6, 7}, {8, 11}, {11, 14}});
+  // Dropped bytes inside a word belong to the token around them, trailing ones do not.
+  checkSpans("a\xff\xff" "b c\xff", {"a", "##b", "c"}, {{0, 1}, {3, 4}, {5, 6}});
+  checkSpans("ab\xe4\xb8 b", {"ab", "b"}, {{0, 2}, {5, 6}});
+
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000);
+  const std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  std::string text;
+  for (size_t i = 0; i < 300; i++) {
+    text += sample.substr(rnd() % sample.size(), rnd() % 20);
+    text += rnd() % 5 == 0 ? " \xff, " : " ";
+  }
+  std::vector<word_piece::TokenSpan> spans;
+  const std::vector<int> ids = word_piece::fast::Tokenizer(vocab).encode(text, &spans);
+  verifySpans(text, vocab, ids, spans);
+}
+
+// Chunks of random sizes cut UTF-8 sequences and words anywhere.
+void testStreamingEncoder() {
+  static const std::vector<std::string> kPieces = {
+   "a", "b", "ab", "пр", "中", "-", " ", "\t", "\xe2\x96\x81", "\xff", "\x80", "\xe4\xb8",
+   "\xf0\x9f", "\xf0\x9f\x98\x80"};
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000);
+  std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  vocab.insert(vocab.end(), {"пр", "##пр", "中", "-", "\xf0\x9f\x98\x80", "[UNK]"});
+  const word_piece::fast::Tokenizer tokenizer(vocab);
+
+  std::vector<int> streamed;
+  word_piece::fast::StreamingEncoder encoder(tokenizer, [&streamed](const std::vector<int> &ids) {
+    streamed.insert(streamed.end(), ids.begin(), ids.end());
+  });
+  for (size_t iteration = 0; iteration < 500; iteration++) {
+    std::string text;
+    const size_t pieces = rnd() % 200;
+    for (size_t i = 0; i < pieces; i++) {
+      text += rnd() % 2 == 0 ? sample.substr(rnd() % sample.size(), rnd() % 30)
+                             : kPieces[rnd() % kPieces.size()];
+    }
+    streamed.clear();
+    size_t begin = 0;
+    while (begin < text.size()) {
+      const size_t chunk
+       = std::min<size_t>(text.size() - begin, rnd() % 2 == 0 ? rnd() % 4 : rnd() % 64);
+      encoder.feed(text.data() + begin, chunk);
+      begin += chunk;
+    }
+    encoder.finish();
+    assertEq(streamed, tokenizer.encode(text), text, vocab);
+  }
+}
+
+// Words longer than any token are matched while they arrive: the ids do not change and a stream
+// without spaces does not pile up in the encoder.
+void testStreamingLongWords() {
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000);
+  std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  vocab.insert(vocab.end(), {"中", "-", "##ж"});
+  const word_piece::fast::Tokenizer tokenizer(vocab);
+  std::vector<int> streamed;
+  word_piece::fast::StreamingEncoder encoder(tokenizer, [&streamed](const std::vector<int> &ids) {
+    streamed.insert(streamed.end(), ids.begin(), ids.end());
+  });
+  for (size_t iteration = 0; iteration < 200; iteration++) {
+    std::string text;
+    const size_t words = 1 + rnd() % 4;
+    for (size_t i = 0; i < words; i++) {
+      for (size_t length = rnd() % 2'000; text.size() < length;) {
+        text += sample.substr(rnd() % sample.size(), rnd() % 30);
+        if (rnd() % 200 == 0) {
+          text += rnd() % 2 == 0 ? "ж" : "中";
+        }
+      }
+      text += rnd() % 2 == 0 ? " " : "-";
+    }
+    streamed.clear();
+    for (size_t begin = 0; begin < text.size();) {
+      const size_t chunk = std::min<size_t>(text.size() - begin, 1 + rnd() % 100);
+      encoder.feed(text.data() + begin, chunk);
+      begin += chunk;
+    }
+    encoder.finish();
+    assertEq(streamed, tokenizer.encode(text), text, vocab);
+  }
+
+#if defined(__GLIBC__)
+  // 8 MB of one word: the encoder keeps its ids, not its code points.
+  const std::string piece = sample.substr(0, 32);
+  const word_piece::fast::Tokenizer piece_tokenizer(std::vector<std::string>{piece, "##" + piece});
+  std::string text;
+  while (text.size() < 8'000'000) {
+    text += piece;
+  }
+  size_t id_count = 0;
+  bool ids_match = true;
+  const size_t heap_before = heap_live_bytes.load();
+  heap_peak_bytes = heap_before;
+  {
+    word_piece::fast::StreamingEncoder piece_encoder(
+     piece_tokenizer, [&](const std::vector<int> &ids) {
+       for (int id : ids) {
+         ids_match = ids_match && id == (id_count == 0 ? 0 : 1);
+         ++id_count;
+       }
+     });
+    for (size_t begin = 0; begin < text.size(); begin += 1 << 16) {
+      piece_encoder.feed(text.data() + begin, std::min<size_t>(text.size() - begin, 1 << 16));
+    }
+    piece_encoder.finish();
+  }
+  ++totalChecks();
+  if (!ids_match || id_count != text.size() / piece.size()) {
+    throw std::runtime_error("Streamed ids of a long word are wrong");
+  }
+  ++totalChecks();
+  if (heap_peak_bytes.load() - heap_before > text.size() / 2) {
+    throw std::runtime_error("Streaming encoder keeps a long word: "
+                             + std::to_string(heap_peak_bytes.load() - heap_before) + " bytes");
+  }
+#endif
+}
+
+void testTokenizerReuse() {
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000);
+  const std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  const std::vector<int> expected = word_piece::linear::encode(sample, vocab);
+
+  const word_piece::fast::Tokenizer fast_tokenizer(vocab);
+  const word_piece::linear::Tokenizer linear_tokenizer(vocab);
+  std::vector<std::vector<int>> fast_results(8);
+  std::vector<std::vector<int>> linear_results(8);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < fast_results.size(); i++) {
+    threads.emplace_back([&, i] {
+      fast_results[i] = fast_tokenizer.encode(sample);
+      linear_results[i] = linear_tokenizer.encode(sample);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < fast_results.size(); i++) {
+    assertEq(fast_results[i], expected, sample, vocab);
+    assertEq(linear_results[i], expected, sample, vocab);
+  }
+}
+
+void testEncodeBatch() {
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000);
+  std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  vocab.push_back("[UNK]");
+  const word_piece::fast::Tokenizer tokenizer(vocab);
+
+  const word_piece::BatchEncoding empty = tokenizer.encodeBatch({});
+  if (!empty.ids.empty() || empty.offsets != std::vector<size_t>{0}) {
+    throw std::runtime_error("Empty batch is not empty");
+  }
+
+  // Enough bytes for the batch to be split between threads.
+  std::vector<std::string> documents;
+  for (size_t i = 0; i < 5'000; i++) {
+    const size_t begin = rnd() % sample.size();
+    std::string document = sample.substr(begin, rnd() % 100);
+    if (rnd() % 10 == 0) {
+      document += " \xff " + sample.substr(0, rnd() % 10);
+    }
+    documents.push_back(std::move(document));
+  }
+  const std::vector<std::string_view> texts(documents.begin(), documents.end());
+  const word_piece::BatchEncoding batch = tokenizer.encodeBatch(texts, true);
+  if (batch.offsets.size() != texts.size() + 1 || batch.offsets.back() != batch.ids.size()
+      || batch.spans.size() != batch.ids.size()) {
+    throw std::runtime_error("Batch offsets are malformed");
+  }
+  for (size_t i = 0; i < texts.size(); i++) {
+    const auto begin = static_cast<int64_t>(batch.offsets[i]);
+    const auto end = static_cast<int64_t>(batch.offsets[i + 1]);
+    const std::vector<int> ids(batch.ids.begin() + begin, batch.ids.begin() + end);
+    std::vector<word_piece::TokenSpan> spans;
+    assertEq(ids, tokenizer.encode(documents[i], &spans), documents[i], vocab);
+    ++totalChecks();
+    if (!std::equal(spans.begin(), spans.end(), batch.spans.begin() + begin)) {
+      throw std::runtime_error("Batch spans differ from encode");
+    }
+  }
+}
+
+void testThreadPool() {
+  utils::ThreadPool &pool = utils::globalThreadPool();
+
+  // A group does not wait for tasks of another one: the first task runs until the second
+  // group is done.
+  std::atomic<bool> released{false};
+  utils::TaskGroup blocked(pool);
+  blocked.submit([&released] {
+    while (!released.load()) {
+      std::this_thread::yield();
+    }
+  });
+  std::atomic<size_t> sum{0};
+  {
+    utils::TaskGroup group(pool);
+    for (size_t i = 1; i <= 100; i++) {
+      group.submit([&sum, i] { sum += i; });
+    }
+    group.wait();
+  }
+  ++totalChecks();
+  if (sum != 5050) {
+    throw std::runtime_error("Task group finished before its tasks");
+  }
+  released = true;
+  blocked.wait();
+
+  // Groups inside tasks, more of them than threads: waiting threads run queued tasks.
+  sum = 0;
+  utils::TaskGroup outer(pool);
+  for (size_t i = 0; i < 4 * pool.maxThreads(); i++) {
+    outer.submit([&pool, &sum] {
+      utils::TaskGroup inner(pool);
+      for (size_t j = 0; j < 16; j++) {
+        inner.submit([&sum] { sum += 1; });
+      }
+      inner.wait();
+    });
+  }
+  outer.wait();
+  ++totalChecks();
+  if (sum != 4 * pool.maxThreads() * 16) {
+    throw std::runtime_error("Nested task groups lost tasks");
+  }
+
+  utils::TaskGroup failing(pool);
+  failing.submit([] { throw std::runtime_error("task failed"); });
+  failing.submit([] {});
+  bool thrown = false;
+  try {
+    failing.wait();
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  ++totalChecks();
+  if (!thrown) {
+    throw std::runtime_error("Task group did not rethrow the task exception");
+  }
+
+  // Concurrent batches share the pool.
+  std::mt19937 rnd(17);
+  const std::vector<std::string> vocab = randomSplit(randomString(rnd, 1'000), rnd, 200);
+  std::vector<std::string> docs;
+  for (size_t i = 0; i < 64; i++) {
+    std::string doc;
+    while (doc.size() < 1'000) {
+      doc += vocab[rnd() % vocab.size()] + (rnd() % 3 == 0 ? " " : "");
+    }
+    docs.push_back(doc);
+  }
+  const std::vector<std::string_view> texts(docs.begin(), docs.end());
+  const word_piece::fast::Tokenizer tokenizer(vocab);
+  const std::vector<int> expected = tokenizer.encodeBatch(texts).ids;
+  std::vector<std::thread> callers;
+  std::atomic<size_t> mismatches{0};
+  for (size_t caller = 0; caller < 8; caller++) {
+    callers.emplace_back([&] {
+      for (size_t call = 0; call < 20; call++) {
+        mismatches += tokenizer.encodeBatch(texts).ids != expected;
+      }
+    });
+  }
+  for (std::thread &caller : callers) {
+    caller.join();
+  }
+  ++totalChecks();
+  if (mismatches != 0) {
+    throw std::runtime_error("Concurrent batches differ");
+  }
+}
+
+void testVocabImage() {
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000) + " [UNK] a ##";
+  std::vector<std::string> vocab = randomSplit(sample.substr(0, 3'000), rnd, 300);
+  vocab.push_back("[UNK]");
+  vocab.push_back("a");
+
+  const auto temp_dir = std::filesystem::temp_directory_path();
+  const std::string vocab_file = temp_dir / "word_piece_test_vocab.txt";
+  const std::string image_file = temp_dir / "word_piece_test_vocab.bin";
+  {
+    std::ofstream fout(vocab_file);
+    for (const std::string &word : vocab) {
+      fout << word << '\n';
+    }
+  }
+  utils::CompiledVocab(utils::readVocabFromFile(vocab_file)).saveImage(image_file);
+  if (!utils::CompiledVocab::isImage(image_file) || utils::CompiledVocab::isImage(vocab_file)) {
+    throw std::runtime_error("Vocab image is not detected");
+  }
+
+  const std::vector<int> expected = word_piece::fast::encode(sample, vocab);
+  assertEq(word_piece::fast::Tokenizer(image_file).encode(sample), expected, sample, vocab);
+  assertEq(word_piece::linear::Tokenizer(image_file).encode(sample), expected, sample, vocab);
+  ++totalChecks();
+  if (utils::CompiledVocab::fromFile(vocab_file).contentHash()
+      != utils::CompiledVocab::fromFile(image_file).contentHash()) {
+    throw std::runtime_error("Vocab image has another content hash");
+  }
+  std::filesystem::remove(vocab_file);
+  std::filesystem::remove(image_file);
+}
+
+void testIdFiles() {
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000);
+  const std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  std::string text;
+  for (size_t i = 0; i < 20'000; i++) {
+    text += sample.substr(rnd() % sample.size(), rnd() % 20) + (rnd() % 10 == 0 ? " xyz " : " ");
+  }
+
+  const auto temp_dir = std::filesystem::temp_directory_path();
+  const std::string vocab_file = temp_dir / "word_piece_test_ids_vocab.txt";
+  const std::string text_file = temp_dir / "word_piece_test_ids_text.txt";
+  const std::string ids_file = temp_dir / "word_piece_test_ids.bin";
+  {
+    std::ofstream fout(vocab_file);
+    for (const std::string &word : vocab) {
+      fout << word << '\n';
+    }
+    std::ofstream(text_file) << text;
+  }
+  const std::vector<int> expected = word_piece::fast::encode(text, vocab);
+
+  // Text and binary with 16-bit ids (UNK is 0xFFFF) and 32-bit ids, larger than the buffer.
+  std::vector<int> wide_ids(1'000'000);
+  for (int &id : wide_ids) {
+    id = static_cast<int>(rnd() % 100'000) - 1;
+  }
+  for (auto format : {word_piece::OutputFormat::kText, word_piece::OutputFormat::kBinary}) {
+    utils::writeToFile(ids_file, expected, format, 1, vocab.size());
+    assertEq(utils::readIdsFromFile(ids_file), expected, text, vocab);
+    utils::writeToFile(ids_file, wide_ids, format, 1, 100'000);
+    assertEq(utils::readIdsFromFile(ids_file), wide_ids, text, vocab);
+  }
+
+  const size_t memory_limit = text.size() / 3;
+  word_piece::fast::encodeExternal(
+   text_file, vocab_file, ids_file, memory_limit, word_piece::OutputFormat::kBinary);
+  assertEq(utils::readIdsFromFile(ids_file), expected, text, vocab);
+  word_piece::trie::encodeExternal(text_file, vocab_file, ids_file, memory_limit);
+  assertEq(utils::readIdsFromFile(ids_file), expected, text, vocab);
+  word_piece::linear::encodeExternal(text_file, vocab_file, ids_file, memory_limit * 10);
+  assertEq(utils::readIdsFromFile(ids_file), expected, text, vocab);
+
+  word_piece::fast_bytes::encodeExternal(
+   text_file, vocab_file, ids_file, memory_limit, word_piece::OutputFormat::kBinary);
+  std::ifstream fin(ids_file.c_str(), std::ios::binary);
+  utils::IdFileHeader header{};
+  fin.read(reinterpret_cast<char *>(&header), sizeof(header));
+  ++totalChecks();
+  if (header.id_bytes != 2 || header.token_count != expected.size()
+      || header.vocab_hash != utils::CompiledVocab::fromFile(vocab_file).contentHash()) {
+    throw std::runtime_error("Id file header is wrong");
+  }
+
+  std::filesystem::remove(vocab_file);
+  std::filesystem::remove(text_file);
+  std::filesystem::remove(ids_file);
+}
+
+void testDecode() {
+  const std::vector<std::string> vocab = {
+   "hello", "##lo", "world", "##s", "!", "\xd0\xbc\xd0\xb8\xd1\x80"};
+  const word_piece::fast::Tokenizer tokenizer(vocab);
+  const auto expect = [](const std::string &actual, const std::string &expected) {
+    ++totalChecks();
+    if (actual != expected) {
+      throw std::runtime_error("Decoded \"" + actual + "\" instead of \"" + expected + "\"");
+    }
+  };
+  expect(tokenizer.decode({}), "");
+  expect(tokenizer.decode({0, 2, 3, 4}), "hello worlds !");
+  expect(tokenizer.decode({1, 5, -1, 3}), "lo \xd0\xbc\xd0\xb8\xd1\x80 [UNK]s");
+  for (int id : {6, -2}) {
+    bool thrown = false;
+    try {
+      tokenizer.decode({0, id});
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    ++totalChecks();
+    if (!thrown) {
+      throw std::runtime_error("Decode of id " + std::to_string(id) + " does not throw");
+    }
+  }
+
+  // Long enough for the parallel path, with UNK.
+  std::mt19937 rnd(17);
+  const std::vector<std::string> random_vocab = randomSplit(randomString(rnd, 3'000), rnd, 300);
+  const word_piece::fast::Tokenizer random_tokenizer(random_vocab);
+  std::vector<int> ids(3'000'000);
+  for (int &id : ids) {
+    id = static_cast<int>(rnd() % (random_vocab.size() + 1)) - 1;
+  }
+  std::string expected;
+  for (int id : ids) {
+    const std::string token = id < 0 ? "[UNK]" : random_vocab[static_cast<size_t>(id)];
+    const bool is_suffix = token.rfind("##", 0) == 0;
+    if (!is_suffix && !expected.empty()) {
+      expected += ' ';
+    }
+    expected += is_suffix ? token.substr(2) : token;
+  }
+  expect(random_tokenizer.decode(ids), expected);
+
+  const std::vector<std::string_view> texts = {"hello worlds", "", "hello xyz !"};
+  const word_piece::BatchEncoding batch = tokenizer.encodeBatch(texts, false);
+  const std::vector<std::string> decoded = tokenizer.decodeBatch(batch);
+  ++totalChecks();
+  if (decoded.size() != texts.size()) {
+    throw std::runtime_error("decodeBatch returned a wrong number of texts");
+  }
+  expect(decoded[0], "hello worlds");
+  expect(decoded[1], "");
+  expect(decoded[2], "hello [UNK] !");
+
+  // The image keeps the UTF-8 of the tokens.
+  const auto temp_dir = std::filesystem::temp_directory_path();
+  const std::string vocab_file = temp_dir / "word_piece_test_decode_vocab.txt";
+  const std::string image_file = temp_dir / "word_piece_test_decode_vocab.bin";
+  {
+    std::ofstream fout(vocab_file);
+    for (const std::string &word : vocab) {
+      fout << word << '\n';
+    }
+  }
+  utils::CompiledVocab(utils::readVocabFromFile(vocab_file)).saveImage(image_file);
+  expect(word_piece::fast::Tokenizer(image_file).decode({1, 5, -1, 3}),
+         "lo \xd0\xbc\xd0\xb8\xd1\x80 [UNK]s");
+  const std::vector<std::string> tokens = word_piece::fast::decode(image_file, {0, 1, 5, 6});
+  ++totalChecks();
+  if (tokens != std::vector<std::string>{"hello", "##lo", "\xd0\xbc\xd0\xb8\xd1\x80"}) {
+    throw std::runtime_error("Decode of a vocab file is wrong");
+  }
+  std::filesystem::remove(vocab_file);
+  std::filesystem::remove(image_file);
+}
+
+void testNormalization() {
+  const auto uncased = word_piece::Normalization::uncased();
+  const std::vector<std::string> vocab = {
+   "[UNK]", "Hello", "world", "angstrom", "##s", "\xed\x95\x9c", "istanbul", "stra\xc3\x9f" "e"};
+  const std::vector<std::pair<std::string, std::vector<int>>> cases = {
+   {"H\xc3\xa9llo WORLDS", {1, 2, 4}},
+   // A control character inside a word is dropped, a combining mark goes with the accent.
+   {"wo\x01rld \xc3\x85ngstro\xcc\x88m", {2, 3}},
+   // Hangul syllables are decomposed into jamo in the text and in the vocab.
+   {"\xed\x95\x9c \xc4\xb0stanbul STRASSE stra\xc3\x9f" "e", {5, 6, 0, 7}},
+  };
+  const word_piece::fast::Tokenizer fast(vocab, uncased);
+  const word_piece::linear::Tokenizer linear(vocab, uncased);
+  const word_piece::trie::Tokenizer trie(vocab, uncased);
+  for (const auto &[text, expected] : cases) {
+    assertEq(fast.encode(text), expected, text, vocab);
+    assertEq(linear.encode(text), expected, text, vocab);
+    assertEq(trie.encode(text), expected, text, vocab);
+    assertEq(fast.encodeBatch({text}).ids, expected, text, vocab);
+  }
+  // Without lowercasing "Hello" is cased, text cleaning alone still drops the control character.
+  assertEq(word_piece::fast::Tokenizer(vocab, {true, false, false}).encode("Hello wo\x01rld"),
+           {1, 2},
+           "",
+           vocab);
+  assertEq(word_piece::fast::Tokenizer(vocab).encode("hello"), {0}, "", vocab);
+
+  // Spans cover the source bytes of the normalized code points, dropped ones included.
+  const std::vector<std::pair<std::string, std::vector<word_piece::TokenSpan>>> span_cases = {
+   {"H\xc3\xa9llo WORLDS", {{0, 6}, {7, 12}, {12, 13}}},
+   {"wo\x01rld \xc3\x85ngstro\xcc\x88m", {{0, 6}, {7, 18}}},
+   {"\xed\x95\x9c \xc4\xb0stanbul STRASSE stra\xc3\x9f" "e\xff",
+    {{0, 3}, {4, 13}, {14, 21}, {22, 29}}},
+  };
+  for (const auto &[text, expected] : span_cases) {
+    std::vector<word_piece::TokenSpan> fast_spans;
+    std::vector<word_piece::TokenSpan> linear_spans;
+    fast.encode(text, &fast_spans);
+    linear.encode(text, &linear_spans);
+    ++totalChecks();
+    if (fast_spans != expected || linear_spans != expected
+        || fast.encodeBatch({text}, true).spans != expected) {
+      throw std::runtime_error("Unexpected normalized spans in \"" + text + "\"");
+    }
+  }
+  // Every token of a syllable decomposed into jamo covers the whole syllable.
+  const std::vector<std::string> jamo_vocab = {"\xe1\x84\x92", "##\xe1\x85\xa1\xe1\x86\xab"};
+  std::vector<word_piece::TokenSpan> jamo_spans;
+  assertEq(word_piece::fast::Tokenizer(jamo_vocab, uncased).encode("\xed\x95\x9c", &jamo_spans),
+           {0, 1},
+           "",
+           jamo_vocab);
+  ++totalChecks();
+  if (jamo_spans != std::vector<word_piece::TokenSpan>{{0, 3}, {0, 3}}) {
+    throw std::runtime_error("Unexpected spans of a decomposed syllable");
+  }
+
+  // The multithreaded decoder cuts chunks anywhere, normalization must not depend on it.
+  std::mt19937 rnd(17);
+  const std::vector<std::string> words = {"H\xc3\xa9llo", "WORLD\x7f", "\xc3\x85ngstr\xc3\xb6m",
+                                          "\xed\x95\x9c", "\xc4\xb0stanbul", "stra\xc3\x9f" "e"};
+  const std::vector<int> word_ids = {1, 2, 3, 5, 6, 7};
+  std::string text;
+  std::vector<int> expected;
+  std::vector<word_piece::TokenSpan> expected_spans;
+  while (text.size() < 11'000'000) {
+    const size_t word = rnd() % words.size();
+    // The control character which ends a word is dropped and is not in its span.
+    const size_t length = words[word].size() - (words[word].back() == '\x7f' ? 1 : 0);
+    expected_spans.push_back({text.size(), text.size() + length});
+    text += words[word];
+    text += rnd() % 7 == 0 ? "\n" : " ";
+    expected.push_back(word_ids[word]);
+  }
+  std::vector<word_piece::TokenSpan> spans;
+  assertEq(fast.encode(text, &spans), expected, "", vocab);
+  ++totalChecks();
+  if (spans != expected_spans) {
+    throw std::runtime_error("Normalized spans depend on decoder chunks");
+  }
+  assertEq(linear.encode(text), expected, "", vocab);
+
+  const auto temp_dir = std::filesystem::temp_directory_path();
+  const std::string vocab_file = temp_dir / "word_piece_test_normalization_vocab.txt";
+  const std::string image_file = temp_dir / "word_piece_test_normalization_vocab.bin";
+  const std::string text_file = temp_dir / "word_piece_test_normalization_text.txt";
+  const std::string ids_file = temp_dir / "word_piece_test_normalization_ids.txt";
+  {
+    std::ofstream fout(vocab_file);
+    for (const std::string &word : vocab) {
+      fout << word << '\n';
+    }
+    std::ofstream(text_file) << text;
+  }
+  utils::CompiledVocab(utils::readVocabFromFile(vocab_file, uncased)).saveImage(image_file);
+  assertEq(word_piece::fast::Tokenizer(image_file, uncased).encode(cases[0].first),
+           cases[0].second,
+           cases[0].first,
+           vocab);
+  bool thrown = false;
+  try {
+    word_piece::fast::Tokenizer tokenizer(image_file);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  ++totalChecks();
+  if (!thrown) {
+    throw std::runtime_error("Vocab image with another normalization is accepted");
+  }
+  word_piece::fast::Tokenizer(vocab_file, uncased)
+   .encodeExternal(text_file, ids_file, text.size() / 3);
+  assertEq(utils::readIdsFromFile(ids_file), expected, "", vocab);
+
+  std::filesystem::remove(vocab_file);
+  std::filesystem::remove(image_file);
+  std::filesystem::remove(text_file);
+  std::filesystem::remove(ids_file);
+}
+
+// Cached words give the same ids and spans, a thread switching between tokenizers does not mix
+// up their caches.
+void testWordCache() {
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 2'000);
+  const std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  const std::vector<std::string> other_vocab = randomSplit(sample, rnd, 200);
+  // Short words repeat, some of them are UNK.
+  std::vector<std::string> words;
+  for (size_t i = 0; i < 300; i++) {
+    words.push_back(sample.substr(rnd() % (sample.size() - 12), 1 + rnd() % 12));
+  }
+  words.push_back("xyz!");
+  std::string text;
+  for (size_t i = 0; i < 30'000; i++) {
+    text += words[std::min(rnd() % words.size(), rnd() % words.size())];
+    text += rnd() % 5 == 0 ? "\n" : " ";
+  }
+
+  const word_piece::fast::Tokenizer uncached(vocab, {}, 0);
+  const word_piece::fast::Tokenizer cached(vocab, {}, 64);
+  const word_piece::fast::Tokenizer other(other_vocab, {}, 64);
+  std::vector<word_piece::TokenSpan> expected_spans;
+  const std::vector<int> expected = uncached.encode(text, &expected_spans);
+  const std::vector<int> other_expected
+   = word_piece::fast::Tokenizer(other_vocab, {}, 0).encode(text);
+  for (size_t round = 0; round < 2; round++) {
+    std::vector<word_piece::TokenSpan> spans;
+    assertEq(cached.encode(text, &spans), expected, text, vocab);
+    assertEq(other.encode(text), other_expected, text, other_vocab);
+    ++totalChecks();
+    if (spans != expected_spans) {
+      throw std::runtime_error("Cached words give other spans");
+    }
+    const std::vector<uint16_t> compact = cached.encodeChunked<uint16_t>(text).join();
+    ++totalChecks();
+    const auto same_id
+     = [](uint16_t lhs, int rhs) { return lhs == (rhs < 0 ? word_piece::kUnkId16 : rhs); };
+    if (!std::equal(compact.begin(), compact.end(), expected.begin(), expected.end(), same_id)) {
+      throw std::runtime_error("Cached words give other 16-bit ids");
+    }
+  }
+
+  const word_piece::fast::WordCacheStats stats = cached.wordCacheStats();
+  ++totalChecks();
+  if (stats.hits == 0 || stats.misses == 0 || uncached.wordCacheStats().hits != 0
+      || uncached.wordCacheStats().misses != 0) {
+    throw std::runtime_error("Word cache counters are wrong");
+  }
+  bool thrown = false;
+  try {
+    word_piece::fast::Tokenizer tokenizer(vocab, {}, 100);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  ++totalChecks();
+  if (!thrown) {
+    throw std::runtime_error("Word cache size which is not a power of two is accepted");
+  }
+}
+
+// The linear engine peaks at under 16 bytes of heap per input char, decoded text included.
+void testLinearMemory() {
+#if defined(__GLIBC__)
+  std::mt19937 rnd(17);
+  const std::string sample = randomString(rnd, 3'000);
+  const std::vector<std::string> vocab = randomSplit(sample, rnd, 300);
+  // Long enough for the multithreaded paths, words are split at spaces.
+  std::string text;
+  while (text.size() < 3'000'000) {
+    text += vocab[rnd() % vocab.size()];
+    text += rnd() % 4 == 0 ? " " : "";
+  }
+  const word_piece::linear::Tokenizer tokenizer(vocab);
+
+  const size_t heap_before = heap_live_bytes.load();
+  heap_peak_bytes = heap_before;
+  const std::vector<int> ids = tokenizer.encode(text);
+  const double bytes_per_char
+   = static_cast<double>(heap_peak_bytes.load() - heap_before) / static_cast<double>(text.size());
+  std::cout << "linear engine peak heap: " << std::fixed << std::setprecision(1) << bytes_per_char
+            << " bytes per input char" << std::endl;
+  std::cout.unsetf(std::ios_base::floatfield);
+
+  // 4 bytes of decoded text and 9-10 of the suffix array pipeline, it used to take 37 in total.
+  ++totalChecks();
+  if (bytes_per_char > 16) {
+    throw std::runtime_error("Linear engine takes too much memory: "
+                             + std::to_string(bytes_per_char) + " bytes per char");
+  }
+  assertEq(ids, word_piece::fast::encode(text, vocab), text, vocab);
+#endif
+}
+
+// Chunks of the multithreaded engines are cut at spaces: a long run without them, invalid bytes
+// and UNK-only words must not change the ids or spans.
+void testSkewedChunks() {
+  std::mt19937 rnd(17);
+  std::vector<std::string> vocab = randomSplit(randomString(rnd, 2'000), rnd, 300);
+  for (const std::string token : {"a", "##a"}) {
+    if (std::find(vocab.begin(), vocab.end(), token) == vocab.end()) {
+      vocab.push_back(token);
+    }
+  }
+  std::string text;
+  while (text.size() < 3'000'000) {
+    const uint32_t kind = rnd() % 1'000;
+    if (kind == 0) {
+      text.append(200'000 + rnd() % 300'000, 'a');
+    } else if (kind < 5) {
+      text.append(rnd() % 1'000, '\xff');
+    } else if (kind < 10) {
+      // Letters right after a chinese character are matched differently by the engines.
+      text += "\xe4\xb8\xad\xe6\x96\x87 ";
+    } else {
+      text += vocab[rnd() % vocab.size()];
+    }
+    text += rnd() % 3 == 0 ? " " : "";
+  }
+  check(text, vocab);
+
+  std::vector<word_piece::TokenSpan> fast_spans;
+  const std::vector<int> fast_ids = word_piece::fast::Tokenizer(vocab).encode(text, &fast_spans);
+  std::vector<word_piece::TokenSpan> linear_spans;
+  const std::vector<int> linear_ids
+   = word_piece::linear::Tokenizer(vocab).encode(text, &linear_spans);
+  assertEq(linear_ids, fast_ids, "skewed text", vocab);
+  verifySpans(text, vocab, fast_ids, fast_spans);
+  ++totalChecks();
+  if (linear_spans != fast_spans) {
+    throw std::runtime_error("Spans of skewed text differ");
+  }
+
+  // Chunked results hold the same ids, written to a file without the join.
+  const word_piece::ChunkedIds fast_chunks = word_piece::fast::Tokenizer(vocab).encodeChunked(text);
+  assertEq(word_piece::ChunkedIds(fast_chunks).join(), fast_ids, "skewed text", vocab);
+  const word_piece::ChunkedIds linear_chunks
+   = word_piece::linear::Tokenizer(vocab).encodeChunked(text);
+  assertEq(word_piece::ChunkedIds(linear_chunks).join(), fast_ids, "skewed text", vocab);
+  const std::string ids_file
+   = std::filesystem::temp_directory_path() / "word_piece_test_chunks.bin";
+  utils::writeToFile(ids_file, fast_chunks, word_piece::OutputFormat::kBinary, 1, vocab.size());
+  assertEq(utils::readIdsFromFile(ids_file), fast_ids, "skewed text", vocab);
+
+  // 16-bit ids are the same with UNK as kUnkId16, and are written the same way.
+  std::vector<uint16_t> expected_compact;
+  for (int id : fast_ids) {
+    expected_compact.push_back(id == kUnkTokenId ? word_piece::kUnkId16
+                                                 : static_cast<uint16_t>(id));
+  }
+  for (auto chunks : {word_piece::fast::Tokenizer(vocab).encodeChunked<uint16_t>(text),
+                      word_piece::linear::Tokenizer(vocab).encodeChunked<uint16_t>(text)}) {
+    for (auto format : {word_piece::OutputFormat::kText, word_piece::OutputFormat::kBinary}) {
+      utils::writeToFile(ids_file, chunks, format, 1, vocab.size());
+      assertEq(utils::readIdsFromFile(ids_file), fast_ids, "skewed text", vocab);
+    }
+    ++totalChecks();
+    if (std::move(chunks).join() != expected_compact) {
+      throw std::runtime_error("16-bit ids of skewed text differ");
+    }
+  }
+  std::filesystem::remove(ids_file);
+}
+
+// Valid code points of every length with ASCII runs, corrupted by random bytes and cuts.
+static std::string randomUtf8Bytes(std::mt19937 &rnd, size_t length) {
+  static constexpr uint32_t kRanges[][2]
+   = {{0x20, 0x7f}, {0x80, 0x7ff}, {0x800, 0xd7ff}, {0xe000, 0xffff}, {0x10000, 0x10ffff}};
+  std::string text;
+  while (text.size() < length) {
+    const uint32_t kind = rnd() % 8;
+    if (kind < 3) {
+      text.append(rnd() % 40, static_cast<char>('a' + rnd() % 26));
+    } else if (kind < 7) {
+      const auto &range = kRanges[rnd() % std::size(kRanges)];
+      vkcom::utf8_to_chars(range[0] + rnd() % (range[1] - range[0] + 1), std::back_inserter(text));
+    } else if (rnd() % 2 == 0) {
+      text.push_back(static_cast<char>(rnd() % 256));
+    } else if (!text.empty()) {
+      text.pop_back();
+    }
+  }
+  return text;
+}
+
+void testUtf8Decode() {
+  std::mt19937 rnd(17);
+  for (size_t iteration = 0; iteration < 3'000; iteration++) {
+    const std::string text = randomUtf8Bytes(rnd, rnd() % 300);
+    const char *end = text.data() + text.size();
+    std::vector<uint32_t> expected;
+    std::vector<size_t> expected_invalid;
+    uint64_t utf8_len = 0;
+    for (const char *it = text.data(); it < end; it += utf8_len) {
+      const uint32_t code_point = vkcom::chars_to_utf8(it, end - it, &utf8_len);
+      if (code_point != vkcom::INVALID_UNICODE) {
+        expected.push_back(code_point);
+      } else {
+        expected_invalid.push_back(static_cast<size_t>(it - text.data()));
+      }
+    }
+
+    for (int isa = 0; isa <= static_cast<int>(utils::bestUtf8Isa()); isa++) {
+      std::vector<uint32_t> decoded(text.size());
+      std::vector<size_t> invalid;
+      decoded.resize(utils::decodeUtf8(
+       static_cast<utils::Utf8Isa>(isa), text.data(), end, decoded.data(), &invalid));
+      ++totalChecks();
+      if (decoded != expected || invalid != expected_invalid) {
+        throw std::runtime_error(std::string("UTF-8 decoder ")
+                                 + utils::utf8IsaName(static_cast<utils::Utf8Isa>(isa))
+                                 + " differs from the scalar one");
+      }
+    }
+  }
+
+  // Long enough for the multithreaded path.
+  const std::string text = randomUtf8Bytes(rnd, 12'000'000);
+  std::vector<size_t> invalid;
+  const std::vector<uint32_t> decoded
+   = utils::parseText(text.data(), text.size(), utils::globalThreadPool(), &invalid);
+  std::vector<uint32_t> expected(text.size());
+  std::vector<size_t> expected_invalid;
+  expected.resize(utils::decodeUtf8(utils::Utf8Isa::kScalar,
+                                    text.data(),
+                                    text.data() + text.size(),
+                                    expected.data(),
+                                    &expected_invalid));
+  ++totalChecks();
+  if (decoded != expected || invalid != expected_invalid) {
+    throw std::runtime_error("Multithreaded UTF-8 decoding differs from the scalar one");
+  }
+}
+
 void testRandomSplit(size_t text_len_from,
                      size_t text_len_to,
                      size_t text_len_step,
@@ -246,12 +1292,33 @@ void testRandomSplit(size_t text_len_from,
 }
 
 int main() {
+  // Segmented linear sweeps and the parallel suffix sort need several threads, even on one core.
+  utils::globalThreadPool(std::max<size_t>(4, std::thread::hardware_concurrency()));
+
   std::cout << "running small unit tests." << std::endl;
   testSimple();
   testNonSplitted();
   testPunctuation();
   testMaxMatch();
+  testLinearMerge();
+  testFirstLengths();
   testUtf8();
+  testCharClasses();
+  testMixedBytes();
+  testTokenSpans();
+  testStreamingEncoder();
+  testStreamingLongWords();
+  testTokenizerReuse();
+  testEncodeBatch();
+  testThreadPool();
+  testVocabImage();
+  testIdFiles();
+  testDecode();
+  testNormalization();
+  testWordCache();
+  testLinearMemory();
+  testSkewedChunks();
+  testUtf8Decode();
 
   std::cout << "running stress tests (split)." << std::endl;
   testRandomSplit(10, 300, 5, 2, 100, true);